@@ -11,6 +11,7 @@ It is free to use for educational purpose and cannot be redistributed outside of
 #include "Lighting.h"
 #include "Intersection.h"
 #include "ImageIO.h"
+#include "ThreadPool.h"
 
 unsigned int buffer[MAX_WIDTH * MAX_HEIGHT];
 
@@ -208,15 +209,13 @@ void render(Scene* scene, unsigned int threadID, int threadTotal, const int widt
 	}
 }
 
-// a THREAD_START_ROUTINE function that casts its argument, calls the render function, and then exits gracefully
-DWORD __stdcall renderThreadStart(LPVOID threadData)
+// a ThreadJob function that picks out this thread's data and calls the render function
+void renderJob(void* threadData, const unsigned int threadIndex)
 {
 	// cast the pointer to void (i.e. an untyped pointer) into something we can use
-	ThreadData* data = (ThreadData*)threadData;
+	ThreadData* data = (ThreadData*)threadData + threadIndex;
 
 	render(&data->scene, data->threadID,data->threadTotal, data->width, data->height, /*data->buffer,*/ data->samples, data->blockSize, data->out, data->blockCount);
-
-	ExitThread(NULL);
 }
 
 // read command line arguments, render, and write out BMP file
@@ -293,47 +292,50 @@ int main(int argc, char* argv[])
 		return -1;
 	}
 
+	// start the threads once (every run reuses them, so starting them isn't part of the timing)
+	ThreadPool pool;
+	Timer poolTimer;
+	initThreadPool(&pool, threads);
+	poolTimer.end();
+
+	// set up the thread data with sensible initial values (the same for every run)
+	ThreadData* threadData = new ThreadData[threads];
+	for (unsigned int i = 0; i < threads; i++) {
+
+		threadData[i].scene = scene;
+		threadData[i].threadID = i;
+		threadData[i].threadTotal = threads;
+		threadData[i].samples = samples;
+		threadData[i].width = width;
+		threadData[i].height = height;
+		threadData[i].blockSize = blockSize;
+		threadData[i].out = buffer + i * width * height / threads;
+		threadData[i].blockCount = &blockCount;
+	}
+
 	// total time taken to render all runs (used to calculate average)
 	int totalTime = 0;
 	for (int i = 0; i < times; i++)
 	{
 		Timer timer;									// create timer
 
-		HANDLE* threadHandles = new HANDLE[threads];
-		ThreadData* threadData = new ThreadData[threads];
+		// start again from the first block
+		blockCount = -1;
 
-		// create all the threads with sensible initial values
-		for (unsigned int i = 0; i < threads; i++) {
-
-			threadData[i].scene = scene;
-			threadData[i].threadID = i;
-			threadData[i].threadTotal = threads;
-			threadData[i].samples = samples;
-			threadData[i].width = width;
-			threadData[i].height = height;
-			threadData[i].blockSize = blockSize;
-			threadData[i].out = buffer + i * width * height / threads;
-			threadData[i].blockCount = &blockCount;
-
-
-			threadHandles[i] = CreateThread(NULL, 0, renderThreadStart, (void*)&threadData[i], 0, NULL);
-		}
-
-		// wait for everything to finish
-		for (unsigned int i = 0; i < threads; i++) {
-			WaitForSingleObject(threadHandles[i], INFINITE);
-		}
-
-		// release dynamic memory
-		delete[] threadHandles;
-		delete[] threadData;
+		// render with every thread, and wait for everything to finish
+		runThreadPool(&pool, renderJob, threadData);
 
 		timer.end();									// record end time
 		totalTime += timer.getMilliseconds();
 	}
 
+	// release dynamic memory
+	delete[] threadData;
+	freeThreadPool(&pool);
+
 	// output timing information (times run and average)
 	printf("average time taken (%d run(s)): %ums\n", times, totalTime / times);
+	printf("thread pool start time: %ums (%u threads, not included in the average)\n", poolTimer.getMilliseconds(), threads);
 
 	// output BMP file
 	write_bmp(outputFilename, buffer, width, height, width);
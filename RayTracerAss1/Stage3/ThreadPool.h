@@ -0,0 +1,49 @@
+// a set of worker threads that is started once and then given job after job (one for each run)
+// so that creating threads isn't part of the time anything takes
+// between jobs the workers sleep on a condition variable (so they don't use any CPU time)
+
+#ifndef __THREAD_POOL_H
+#define __THREAD_POOL_H
+
+#include <windows.h>
+
+// a job is run by every worker at once, each with the same data and its own index (from 0 to threadCount - 1)
+typedef void (*ThreadJob)(void* data, const unsigned int threadIndex);
+
+struct ThreadPool;
+
+// what each worker is given when it starts
+typedef struct PoolWorker
+{
+	ThreadPool* pool;
+	unsigned int index;
+} PoolWorker;
+
+typedef struct ThreadPool
+{
+	unsigned int threadCount;
+	HANDLE* threads;
+	PoolWorker* workers;
+
+	// the current job
+	ThreadJob job;
+	void* data;
+
+	CRITICAL_SECTION lock;				// (protects everything below)
+	CONDITION_VARIABLE jobReady;		// woken when there's a new job (or the pool is shutting down)
+	CONDITION_VARIABLE jobDone;			// woken when the last worker finishes the job
+	unsigned int jobNumber;				// counts the jobs, so a worker can tell a new job from the one it has just done
+	unsigned int busyCount;				// workers still running the current job
+	bool quit;
+} ThreadPool;
+
+// start threadCount worker threads (waiting for a job)
+void initThreadPool(ThreadPool* pool, const unsigned int threadCount);
+
+// run a job on all of the workers and wait until they have all finished it
+void runThreadPool(ThreadPool* pool, ThreadJob job, void* data);
+
+// stop the workers (once they're waiting for a job) and free everything
+void freeThreadPool(ThreadPool* pool);
+
+#endif // __THREAD_POOL_H
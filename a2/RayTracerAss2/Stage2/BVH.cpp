@@ -0,0 +1,622 @@
+// surface area heuristic bounding volume hierarchy construction
+// see: https://www.pbr-book.org/3ed-2018/Primitives_and_Intersection_Acceleration/Bounding_Volume_Hierarchies
+// see: http://www.sci.utah.edu/~wald/Publications/2007/ParallelBVHBuild/fastbuild.pdf
+
+#define NOMINMAX			// stop windows.h breaking std::min and std::max
+#include <windows.h>
+#include "BVH.h"
+#include <algorithm>
+#include <cmath>
+#include <cstring>
+#include <malloc.h>
+
+// relative costs used by the surface area heuristic
+// primitives are tested 8 at a time so each individual test is cheap compared to visiting a node
+const float SAH_TRAVERSAL_COST = 1.0f;
+const float SAH_INTERSECTION_COST = 0.25f;
+
+// nodes with this many (or fewer) primitives always become leaves, leaves never get bigger than the maximum
+// (unless the maximum depth is reached)
+const unsigned int MIN_LEAF_SIZE = 2;
+const unsigned int MAX_LEAF_SIZE = 16;
+
+// number of bins the primitives' centroids are sorted into when looking for the cheapest split
+const int SAH_BINS = 16;
+
+// subtrees with more primitives than this are handed to another worker thread, smaller ones are built by whichever thread split them off
+const unsigned int PARALLEL_TASK_SIZE = 1024;
+
+
+// a sphere or triangle as seen by the builder
+typedef struct BuildPrimitive
+{
+	AABB bounds;					// bounds of the primitive
+	Point centroid;					// centre of the bounds (used for binning)
+	unsigned int index;				// index into sphereContainer or triangleContainer
+	bool isSphere;					// which container the index refers to
+} BuildPrimitive;
+
+
+// a subtree waiting to be built by one of the worker threads
+typedef struct BuildTask
+{
+	unsigned int begin, end;		// range of primitives
+	unsigned int nodeIndex;			// node to build them into
+	int depth;						// depth of that node
+	volatile unsigned int ready;	// set once the rest of the task has been filled in
+} BuildTask;
+
+
+// everything shared by the worker threads during a build
+typedef struct BuildState
+{
+	BuildPrimitive* primitives;		// all primitives (partitioned in place during the build)
+
+	BVHNode* nodes;					// output nodes
+	volatile unsigned int numNodes;
+
+	BuildTask* tasks;				// subtrees waiting to be built (claimed in order by the worker threads)
+	volatile unsigned int numTasks;
+	volatile unsigned int nextTask;
+	volatile unsigned int primitivesLeft;	// number of primitives not in a leaf yet (the build is done when this reaches 0)
+
+	const Scene* scene;				// source primitives
+	Sphere* spheres;				// spheres in leaf order
+	unsigned int numSpheres;
+	Triangle* triangles;			// triangles in leaf order
+	unsigned int numTriangles;
+} BuildState;
+
+
+// ---- building ----
+
+// reserve the next output node
+inline unsigned int allocateNode(BuildState& state)
+{
+	return InterlockedIncrement(&state.numNodes) - 1;
+}
+
+
+// add a subtree for any of the worker threads to build
+static void addTask(BuildState& state, unsigned int begin, unsigned int end, unsigned int nodeIndex, int depth)
+{
+	BuildTask& task = state.tasks[InterlockedIncrement(&state.numTasks) - 1];
+
+	task.begin = begin;
+	task.end = end;
+	task.nodeIndex = nodeIndex;
+	task.depth = depth;
+
+	// only let the task be claimed once everything else is filled in
+	InterlockedExchange(&task.ready, 1);
+}
+
+
+// bin a primitive's centroid along an axis
+inline int findBin(const BuildPrimitive& primitive, int axis, float min, float binScale)
+{
+	return std::min(int((component(primitive.centroid, axis) - min) * binScale), SAH_BINS - 1);
+}
+
+
+// turn a node into a leaf
+// the primitives are copied into the output containers once the whole tree is built (see orderLeaves()),
+// until then the leaf's left and right hold its range of primitives
+static void makeLeaf(BuildState& state, BVHNode& node, unsigned int begin, unsigned int end)
+{
+	node.left = begin;
+	node.right = end;
+	node.numSpheres = node.numTriangles = 0;
+
+	for (unsigned int i = begin; i < end; ++i)
+	{
+		if (state.primitives[i].isSphere) node.numSpheres++;
+		else node.numTriangles++;
+	}
+
+	InterlockedExchangeAdd(&state.primitivesLeft, 0u - (end - begin));
+}
+
+
+// build the node for the primitives in [begin, end)
+// big subtrees are handed to the other worker threads, small ones are built recursively
+static void buildNode(BuildState& state, unsigned int begin, unsigned int end, unsigned int nodeIndex, int depth)
+{
+	BVHNode& node = state.nodes[nodeIndex];
+	BuildPrimitive* primitives = state.primitives;
+
+	// bounds of everything in this node (and of their centroids, which is the range the bins cover)
+	AABB centroidBounds = emptyBox();
+	node.bounds = emptyBox();
+	for (unsigned int i = begin; i < end; ++i)
+	{
+		growBox(node.bounds, primitives[i].bounds);
+		growBox(centroidBounds, primitives[i].centroid);
+	}
+
+	unsigned int count = end - begin;
+
+	// small enough (or deep enough) that it has to be a leaf
+	if (count <= MIN_LEAF_SIZE || depth >= BVH_MAX_DEPTH - 1)
+	{
+		makeLeaf(state, node, begin, end);
+		return;
+	}
+
+	// find the cheapest split between bins along each axis
+	float inverseArea = 1.0f / std::max(surfaceArea(node.bounds), FLT_MIN);
+	float bestCost = FLT_MAX;
+	int bestBin = 0;
+	int bestAxis = -1;
+
+	for (int axis = 0; axis < 3; ++axis)
+	{
+		float min = component(centroidBounds.min, axis);
+		float extent = component(centroidBounds.max, axis) - min;
+
+		// all the centroids are in the same place along this axis
+		if (extent <= 0.0f) continue;
+
+		float binScale = SAH_BINS / extent;
+
+		// count the primitives in each bin (and find each bin's bounds)
+		AABB binBounds[SAH_BINS];
+		unsigned int binCounts[SAH_BINS] = { 0 };
+		for (int b = 0; b < SAH_BINS; ++b)
+		{
+			binBounds[b] = emptyBox();
+		}
+
+		for (unsigned int i = begin; i < end; ++i)
+		{
+			int b = findBin(primitives[i], axis, min, binScale);
+			binCounts[b]++;
+			growBox(binBounds[b], primitives[i].bounds);
+		}
+
+		// area and number of everything to the right of each split (empty bins are skipped, as growing a box by an empty box breaks it)
+		float rightAreas[SAH_BINS];
+		unsigned int rightCounts[SAH_BINS];
+		AABB rightBox = emptyBox();
+		unsigned int rightCount = 0;
+		for (int b = SAH_BINS - 1; b > 0; --b)
+		{
+			if (binCounts[b] > 0) growBox(rightBox, binBounds[b]);
+			rightCount += binCounts[b];
+			rightAreas[b] = surfaceArea(rightBox);
+			rightCounts[b] = rightCount;
+		}
+
+		// cost of splitting just before each bin
+		AABB leftBox = emptyBox();
+		unsigned int leftCount = 0;
+		for (int b = 1; b < SAH_BINS; ++b)
+		{
+			if (binCounts[b - 1] > 0) growBox(leftBox, binBounds[b - 1]);
+			leftCount += binCounts[b - 1];
+
+			if (leftCount == 0 || rightCounts[b] == 0) continue;
+
+			float cost = SAH_TRAVERSAL_COST + SAH_INTERSECTION_COST * inverseArea *
+				(surfaceArea(leftBox) * leftCount + rightAreas[b] * rightCounts[b]);
+
+			if (cost < bestCost)
+			{
+				bestCost = cost;
+				bestBin = b;
+				bestAxis = axis;
+			}
+		}
+	}
+
+	// stop splitting if a leaf is cheaper (and not too big)
+	if (count <= MAX_LEAF_SIZE && SAH_INTERSECTION_COST * count <= bestCost)
+	{
+		makeLeaf(state, node, begin, end);
+		return;
+	}
+
+	unsigned int split;
+	if (bestAxis == -1)
+	{
+		// every centroid is in the same place so there's nothing to choose between, just split the range in half
+		split = begin + count / 2;
+	}
+	else
+	{
+		// move everything left of the chosen split to the start of the range
+		float min = component(centroidBounds.min, bestAxis);
+		float binScale = SAH_BINS / (component(centroidBounds.max, bestAxis) - min);
+
+		split = (unsigned int)(std::partition(primitives + begin, primitives + end, [&](const BuildPrimitive& primitive)
+		{
+			return findBin(primitive, bestAxis, min, binScale) < bestBin;
+		}) - primitives);
+	}
+
+	// build the children (interior nodes have no primitives of their own)
+	node.numSpheres = node.numTriangles = 0;
+	node.left = allocateNode(state);
+	node.right = allocateNode(state);
+
+	if (end - split > PARALLEL_TASK_SIZE)
+	{
+		addTask(state, split, end, node.right, depth + 1);
+	}
+	else
+	{
+		buildNode(state, split, end, node.right, depth + 1);
+	}
+
+	buildNode(state, begin, split, node.left, depth + 1);
+}
+
+
+// thread pool job for building
+// claims tasks in the order they were added, until every primitive is in a leaf
+static void buildJob(void* inData, const unsigned int threadIndex)
+{
+	BuildState* state = (BuildState*)inData;
+
+	while (state->primitivesLeft > 0)
+	{
+		BuildTask& task = state->tasks[InterlockedIncrement(&state->nextTask) - 1];
+
+		// wait for the task to be added (which might never happen if the rest of the tree gets finished first)
+		while (!task.ready && state->primitivesLeft > 0)
+		{
+			Sleep(0);
+		}
+
+		if (task.ready) buildNode(*state, task.begin, task.end, task.nodeIndex, task.depth);
+	}
+}
+
+
+// copy every leaf's primitives into the output containers (in tree order, so each leaf's primitives are contiguous)
+static void orderLeaves(BuildState& state, unsigned int nodeIndex)
+{
+	BVHNode& node = state.nodes[nodeIndex];
+
+	if (node.numSpheres + node.numTriangles == 0)
+	{
+		orderLeaves(state, node.left);
+		orderLeaves(state, node.right);
+		return;
+	}
+
+	node.firstSphere = state.numSpheres;
+	node.firstTriangle = state.numTriangles;
+
+	for (unsigned int i = node.left; i < node.right; ++i)
+	{
+		const BuildPrimitive& primitive = state.primitives[i];
+
+		if (primitive.isSphere)
+		{
+			state.spheres[state.numSpheres++] = state.scene->sphereContainer[primitive.index];
+		}
+		else
+		{
+			state.triangles[state.numTriangles++] = state.scene->triangleContainer[primitive.index];
+		}
+	}
+
+	node.left = node.right = 0;
+}
+
+
+// build a surface area heuristic BVH over all of the scene's spheres and triangles
+void buildBVH(Scene& scene, ThreadPool* pool)
+{
+	unsigned int numPrimitives = scene.numSpheres + scene.numTriangles;
+
+	if (numPrimitives == 0)
+	{
+		scene.numBVHNodes = 0;
+		scene.bvhNodes = NULL;
+		return;
+	}
+
+	BuildState state;
+	state.primitives = new BuildPrimitive[numPrimitives];
+	state.nodes = new BVHNode[2 * numPrimitives - 1]();					// (zeroed, as interior nodes don't use all of their fields, and the nodes can be cached)
+	state.numNodes = 0;
+	state.tasks = new BuildTask[2 * numPrimitives - 1 + pool->threadCount]();	// every task is a different node (plus one unfilled task per thread at the end)
+	state.numTasks = 0;
+	state.nextTask = 0;
+	state.primitivesLeft = numPrimitives;
+	state.scene = &scene;
+	state.spheres = new Sphere[scene.numSpheres];
+	state.numSpheres = 0;
+	state.triangles = new Triangle[scene.numTriangles];
+	state.numTriangles = 0;
+	// get the bounds of every sphere and triangle
+	for (unsigned int i = 0; i < numPrimitives; ++i)
+	{
+		BuildPrimitive& primitive = state.primitives[i];
+
+		primitive.isSphere = i < scene.numSpheres;
+		primitive.index = primitive.isSphere ? i : i - scene.numSpheres;
+		primitive.bounds = primitive.isSphere ? sphereBounds(scene.sphereContainer[primitive.index]) : triangleBounds(scene.triangleContainer[primitive.index]);
+		primitive.centroid = centroid(primitive.bounds);
+	}
+
+	// build the tree, starting with the whole lot at the root
+	addTask(state, 0, numPrimitives, allocateNode(state), 0);
+
+	runThreadPool(pool, buildJob, &state);
+
+	// replace the scene's primitives with the leaf ordered versions
+	orderLeaves(state, 0);
+	memcpy(scene.sphereContainer, state.spheres, sizeof(Sphere) * scene.numSpheres);
+	memcpy(scene.triangleContainer, state.triangles, sizeof(Triangle) * scene.numTriangles);
+
+	scene.numBVHNodes = state.numNodes;
+	scene.bvhNodes = state.nodes;
+	scene.bvhBuildCost = bvhCost(scene);
+
+	// clean up
+	delete[] state.primitives;
+	delete[] state.tasks;
+	delete[] state.spheres;
+	delete[] state.triangles;
+}
+
+
+// surface area heuristic cost of a subtree (not yet divided by the area of the root)
+static float subtreeCost(const BVHNode* nodes, unsigned int nodeIndex)
+{
+	const BVHNode& node = nodes[nodeIndex];
+
+	if (node.numSpheres + node.numTriangles > 0) return SAH_INTERSECTION_COST * (node.numSpheres + node.numTriangles) * surfaceArea(node.bounds);
+
+	return SAH_TRAVERSAL_COST * surfaceArea(node.bounds) + subtreeCost(nodes, node.left) + subtreeCost(nodes, node.right);
+}
+
+
+// surface area heuristic cost of the whole BVH
+float bvhCost(const Scene& scene)
+{
+	if (scene.numBVHNodes == 0) return 0.0f;
+
+	return subtreeCost(scene.bvhNodes, 0) / std::max(surfaceArea(scene.bvhNodes[0].bounds), FLT_MIN);
+}
+
+
+// recursively collapse a binary node (and its descendants) into 8-wide nodes, returns the index of the new node
+// children are gathered by repeatedly opening up the interior child with the largest surface area
+static unsigned int collapseNode(Scene& scene, unsigned int binaryIndex)
+{
+	const BVHNode* nodes = scene.bvhNodes;
+
+	unsigned int children[8] = { binaryIndex };
+	int numChildren = 1;
+
+	while (numChildren < 8)
+	{
+		// find the biggest child that isn't a leaf
+		int biggest = -1;
+		float biggestArea = -1.0f;
+		for (int i = 0; i < numChildren; ++i)
+		{
+			const BVHNode& child = nodes[children[i]];
+			if (child.numSpheres + child.numTriangles == 0 && surfaceArea(child.bounds) > biggestArea)
+			{
+				biggest = i;
+				biggestArea = surfaceArea(child.bounds);
+			}
+		}
+
+		// everything is a leaf
+		if (biggest == -1) break;
+
+		// replace it with its own children
+		unsigned int opened = children[biggest];
+		children[biggest] = nodes[opened].left;
+		children[numChildren++] = nodes[opened].right;
+	}
+
+	unsigned int nodeIndex = scene.numBVH8Nodes++;
+	BVH8Node& node = scene.bvh8Nodes[nodeIndex];
+
+	for (int i = 0; i < 8; ++i)
+	{
+		// unused children get NaN bounds, as every comparison involving the NaN slab distances fails
+		// (empty +/-FLT_MAX bounds don't work here, they turn into an infinitely large box when the ray direction is tiny)
+		AABB bounds = { { NAN, NAN, NAN }, { NAN, NAN, NAN } };
+
+		if (i >= numChildren)
+		{
+			node.children[i] = BVH8_EMPTY;
+		}
+		else
+		{
+			const BVHNode& child = nodes[children[i]];
+			bounds = child.bounds;
+			node.children[i] = child.numSpheres + child.numTriangles > 0 ? (children[i] | BVH8_LEAF) : collapseNode(scene, children[i]);
+		}
+
+		node.minX.m256_f32[i] = bounds.min.x;
+		node.minY.m256_f32[i] = bounds.min.y;
+		node.minZ.m256_f32[i] = bounds.min.z;
+		node.maxX.m256_f32[i] = bounds.max.x;
+		node.maxY.m256_f32[i] = bounds.max.y;
+		node.maxZ.m256_f32[i] = bounds.max.z;
+	}
+
+	return nodeIndex;
+}
+
+
+// build an 8-wide BVH by collapsing the binary one
+void buildBVH8(Scene& scene)
+{
+	scene.numBVH8Nodes = 0;
+	scene.bvh8Nodes = NULL;
+
+	if (scene.numBVHNodes == 0) return;
+
+	// there can't be more 8-wide nodes than there are binary nodes
+	scene.bvh8Nodes = (BVH8Node*)_aligned_malloc(sizeof(BVH8Node) * scene.numBVHNodes, 32);
+
+	collapseNode(scene, 0);
+}
+
+
+// ---- quantization ----
+
+// quantize one axis of a child's bounds, rounding outwards (so the decoded bounds always contain the real ones)
+// the bounds are decoded with exactly the same sums as the traversal uses, so rounding can't make them shrink
+static void quantizeAxis(float origin, float scale, float min, float max, unsigned char* qMin, unsigned char* qMax)
+{
+	if (scale == 0.0f)
+	{
+		*qMin = *qMax = 0;
+		return;
+	}
+
+	int low = std::min(std::max((int)floorf((min - origin) / scale), 0), 255);
+	int high = std::min(std::max((int)ceilf((max - origin) / scale), 0), 255);
+
+	while (low > 0 && (float)low * scale + origin > min) --low;
+	while (high < 255 && (float)high * scale + origin < max) ++high;
+
+	*qMin = (unsigned char)low;
+	*qMax = (unsigned char)high;
+}
+
+
+// size of a step along an axis (nudged up so that 255 steps always reach the end of the node)
+static float quantizationScale(float min, float max)
+{
+	if (max <= min) return 0.0f;
+
+	float scale = (max - min) / 255.0f;
+	while (255.0f * scale + min < max) scale = nextafterf(scale, FLT_MAX);
+
+	return scale;
+}
+
+
+// build the compressed copy of the 8-wide BVH
+// also used after refitting, so reuses the nodes if there already are some
+void quantizeBVH8(Scene& scene)
+{
+	if (scene.numBVH8Nodes == 0) return;
+
+	if (scene.qbvh8Nodes == NULL) scene.qbvh8Nodes = (QBVH8Node*)_aligned_malloc(sizeof(QBVH8Node) * scene.numBVH8Nodes, 64);
+
+	for (unsigned int n = 0; n < scene.numBVH8Nodes; ++n)
+	{
+		const BVH8Node& node = scene.bvh8Nodes[n];
+		QBVH8Node& qNode = scene.qbvh8Nodes[n];
+
+		// the node's own bounds
+		AABB bounds = emptyBox();
+		for (int i = 0; i < 8; ++i)
+		{
+			if (node.children[i] == BVH8_EMPTY) continue;
+
+			AABB child = { { node.minX.m256_f32[i], node.minY.m256_f32[i], node.minZ.m256_f32[i] }, { node.maxX.m256_f32[i], node.maxY.m256_f32[i], node.maxZ.m256_f32[i] } };
+			growBox(bounds, child);
+		}
+
+		qNode.originX = bounds.min.x;
+		qNode.originY = bounds.min.y;
+		qNode.originZ = bounds.min.z;
+		qNode.scaleX = quantizationScale(bounds.min.x, bounds.max.x);
+		qNode.scaleY = quantizationScale(bounds.min.y, bounds.max.y);
+		qNode.scaleZ = quantizationScale(bounds.min.z, bounds.max.z);
+
+		for (int i = 0; i < 8; ++i)
+		{
+			qNode.children[i] = node.children[i];
+
+			// unused children are skipped by the traversal (using their child index), so their bounds don't matter
+			if (node.children[i] == BVH8_EMPTY)
+			{
+				qNode.minX[i] = qNode.minY[i] = qNode.minZ[i] = 0;
+				qNode.maxX[i] = qNode.maxY[i] = qNode.maxZ[i] = 0;
+				continue;
+			}
+
+			quantizeAxis(qNode.originX, qNode.scaleX, node.minX.m256_f32[i], node.maxX.m256_f32[i], &qNode.minX[i], &qNode.maxX[i]);
+			quantizeAxis(qNode.originY, qNode.scaleY, node.minY.m256_f32[i], node.maxY.m256_f32[i], &qNode.minY[i], &qNode.maxY[i]);
+			quantizeAxis(qNode.originZ, qNode.scaleZ, node.minZ.m256_f32[i], node.maxZ.m256_f32[i], &qNode.minZ[i], &qNode.maxZ[i]);
+		}
+	}
+}
+
+
+// ---- refitting ----
+
+// recursively refit a binary node, returns its new bounds
+static AABB refitNode(Scene& scene, unsigned int nodeIndex)
+{
+	BVHNode& node = scene.bvhNodes[nodeIndex];
+
+	if (node.numSpheres + node.numTriangles > 0)
+	{
+		node.bounds = emptyBox();
+		for (unsigned int i = node.firstSphere; i < node.firstSphere + node.numSpheres; ++i)
+		{
+			growBox(node.bounds, sphereBounds(scene.sphereContainer[i]));
+		}
+		for (unsigned int i = node.firstTriangle; i < node.firstTriangle + node.numTriangles; ++i)
+		{
+			growBox(node.bounds, triangleBounds(scene.triangleContainer[i]));
+		}
+	}
+	else
+	{
+		node.bounds = refitNode(scene, node.left);
+		growBox(node.bounds, refitNode(scene, node.right));
+	}
+
+	return node.bounds;
+}
+
+
+// recursively refit an 8-wide node (after the binary nodes have been refit), returns its new bounds
+static AABB refitNode8(Scene& scene, unsigned int nodeIndex)
+{
+	BVH8Node& node = scene.bvh8Nodes[nodeIndex];
+	AABB bounds = emptyBox();
+
+	for (int i = 0; i < 8; ++i)
+	{
+		// unused children keep their NaN bounds (and BVH8_EMPTY has the leaf flag set, so has to be checked first)
+		if (node.children[i] == BVH8_EMPTY) continue;
+
+		AABB child = (node.children[i] & BVH8_LEAF) ? scene.bvhNodes[node.children[i] & ~BVH8_LEAF].bounds : refitNode8(scene, node.children[i]);
+		growBox(bounds, child);
+
+		node.minX.m256_f32[i] = child.min.x;
+		node.minY.m256_f32[i] = child.min.y;
+		node.minZ.m256_f32[i] = child.min.z;
+		node.maxX.m256_f32[i] = child.max.x;
+		node.maxY.m256_f32[i] = child.max.y;
+		node.maxZ.m256_f32[i] = child.max.z;
+	}
+
+	return bounds;
+}
+
+
+// update the bounds of every node to fit the scene's spheres and triangles after they have moved
+void refitBVH(Scene& scene)
+{
+	if (scene.numBVHNodes > 0) refitNode(scene, 0);
+	if (scene.numBVH8Nodes > 0) refitNode8(scene, 0);
+	if (scene.qbvh8Nodes != NULL) quantizeBVH8(scene);
+}
+
+
+// surface area heuristic cost of the scene's BVH compared to what it was when it was built
+float bvhCostRatio(const Scene& scene)
+{
+	if (scene.numBVHNodes == 0) return 1.0f;
+
+	return bvhCost(scene) / scene.bvhBuildCost;
+}
@@ -0,0 +1,159 @@
+// bounding volume hierarchy used to accelerate ray/primitive intersection tests
+
+#ifndef __BVH_H
+#define __BVH_H
+
+#include "Scene.h"
+#include "ThreadPool.h"
+#include <algorithm>
+#include <cfloat>
+
+// maximum depth of the hierarchy (the builder makes a leaf rather than going deeper, so traversal stacks can be fixed size)
+const int BVH_MAX_DEPTH = 64;
+
+// axis aligned bounding box
+typedef struct AABB
+{
+	Point min, max;
+} AABB;
+
+// a single node of the hierarchy
+// interior nodes have two children and no primitives, leaves have a (contiguous) range of spheres and/or triangles
+typedef struct BVHNode
+{
+	AABB bounds;								// bounds of everything below this node
+	unsigned int left, right;					// child node indexes (interior nodes only)
+	unsigned int firstSphere, numSpheres;		// range of spheres in sphereContainer (leaves only)
+	unsigned int firstTriangle, numTriangles;	// range of triangles in triangleContainer (leaves only)
+} BVHNode;
+
+// a single node of the 8-wide hierarchy (made by collapsing the binary hierarchy)
+// the bounds of all 8 children are stored in SoA form so that a ray can be tested against all of them at once
+typedef struct BVH8Node
+{
+	__m256 minX, minY, minZ;					// child bounds (unused children have NaN bounds so are never hit)
+	__m256 maxX, maxY, maxZ;
+	unsigned int children[8];					// child BVH8Node indexes, or (flagged) indexes of leaves in the binary hierarchy
+} BVH8Node;
+
+// flag for BVH8Node children that refer to leaves of the binary hierarchy (and value for unused children)
+const unsigned int BVH8_LEAF = 0x80000000;
+const unsigned int BVH8_EMPTY = 0xFFFFFFFF;
+
+// compressed version of BVH8Node (less than half the size, so more of the tree stays in cache, but the bounds have to be decoded)
+// child bounds are stored in 8 bit steps from the minimum corner of the node's own bounds, rounded outwards so they only ever grow
+typedef struct QBVH8Node
+{
+	float originX, originY, originZ;			// minimum corner of the node's bounds
+	float scaleX, scaleY, scaleZ;				// size of a step along each axis
+	unsigned char minX[8], minY[8], minZ[8];	// child bounds (in steps from the origin)
+	unsigned char maxX[8], maxY[8], maxZ[8];
+	unsigned int children[8];					// same as the BVH8Node's (the two arrays of nodes have the same layout)
+} QBVH8Node;
+
+// primitive bounds are padded slightly so that rays which only just graze a primitive (e.g. a ray running along
+// the top of a sphere) aren't rejected by the box test before the primitive test gets a chance to accept them
+const float BOUNDS_PADDING = 1e-4f;
+
+
+// ---- bounding box helpers ----
+
+// get x, y, or z component of a point (or vector)
+inline float component(const Point& p, int axis)
+{
+	return axis == 0 ? p.x : (axis == 1 ? p.y : p.z);
+}
+
+inline float component(const Vector& v, int axis)
+{
+	return axis == 0 ? v.x : (axis == 1 ? v.y : v.z);
+}
+
+// box that contains nothing (grows to fit the first thing added to it)
+inline AABB emptyBox()
+{
+	AABB box = { { FLT_MAX, FLT_MAX, FLT_MAX }, { -FLT_MAX, -FLT_MAX, -FLT_MAX } };
+	return box;
+}
+
+// grow box to contain a point
+inline void growBox(AABB& box, const Point& p)
+{
+	box.min = { std::min(box.min.x, p.x), std::min(box.min.y, p.y), std::min(box.min.z, p.z) };
+	box.max = { std::max(box.max.x, p.x), std::max(box.max.y, p.y), std::max(box.max.z, p.z) };
+}
+
+// grow box to contain another box
+inline void growBox(AABB& box, const AABB& other)
+{
+	growBox(box, other.min);
+	growBox(box, other.max);
+}
+
+// surface area of a box (empty boxes have zero area)
+inline float surfaceArea(const AABB& box)
+{
+	Vector extent = box.max - box.min;
+
+	if (extent.x < 0.0f || extent.y < 0.0f || extent.z < 0.0f) return 0.0f;
+
+	return 2.0f * (extent.x * extent.y + extent.y * extent.z + extent.z * extent.x);
+}
+
+// centre of a box
+inline Point centroid(const AABB& box)
+{
+	return box.min + (box.max - box.min) * 0.5f;
+}
+
+// (padded) bounds of a sphere
+inline AABB sphereBounds(const Sphere& sphere)
+{
+	Vector radius = { sphere.size + BOUNDS_PADDING, sphere.size + BOUNDS_PADDING, sphere.size + BOUNDS_PADDING };
+	AABB box = { sphere.pos - radius, sphere.pos + radius };
+	return box;
+}
+
+// (padded) bounds of a triangle
+inline AABB triangleBounds(const Triangle& triangle)
+{
+	const Vector padding = { BOUNDS_PADDING, BOUNDS_PADDING, BOUNDS_PADDING };
+	AABB box = emptyBox();
+	growBox(box, triangle.p1);
+	growBox(box, triangle.p2);
+	growBox(box, triangle.p3);
+	box.min = box.min - padding;
+	box.max = box.max + padding;
+	return box;
+}
+
+
+// build a (binned) surface area heuristic BVH over all of the scene's spheres and triangles using the pool's threads
+// reorders sphereContainer and triangleContainer so that each leaf's primitives are contiguous,
+// so must be called after init() and before simdifySceneContainers()
+void buildBVH(Scene& scene, ThreadPool* pool);
+
+// build a linear BVH (one leaf per primitive, in Morton code order) over all of the scene's spheres and triangles using the pool's threads
+// much quicker to build than the SAH BVH (but slower to trace), and reuses the scene's existing nodes if it can, so is suitable for rebuilding every frame
+// like buildBVH() it reorders sphereContainer and triangleContainer, so must be called before simdifySceneContainers()
+void buildLBVH(Scene& scene, ThreadPool* pool);
+
+// build an 8-wide BVH by collapsing the binary one (so must be called after buildBVH())
+void buildBVH8(Scene& scene);
+
+// build the compressed copy of the 8-wide BVH (so must be called after buildBVH8())
+void quantizeBVH8(Scene& scene);
+
+// update the bounds of every node (binary, 8-wide, and compressed) to fit the scene's spheres and triangles after they have moved
+// the tree itself stays the same, so it gets less efficient the further things move (see bvhCostRatio())
+void refitBVH(Scene& scene);
+
+// surface area heuristic cost of the scene's BVH (expected cost of tracing a ray, relative to testing a single primitive)
+float bvhCost(const Scene& scene);
+
+// surface area heuristic cost of the scene's BVH compared to what it was when it was built (over the geometry as it was then)
+// this isn't measured against a fresh build over the geometry as it is now, so moving objects can take it below 1 as well as above,
+// but a ratio much above 1 is a sign that a full rebuild is worth doing
+float bvhCostRatio(const Scene& scene);
+
+#endif // __BVH_H
@@ -0,0 +1,316 @@
+// micro benchmarks of the intersection kernels and the fast maths functions
+
+#include <intrin.h>
+#include <stdio.h>
+#include <malloc.h>
+#include <algorithm>
+#include "Benchmark.h"
+#include "Constants.h"
+#include "Intersection.h"
+#include "PrimitivesSIMD.h"
+#include "IntersectionKernels.h"
+#include "BenchmarkMath.h"
+
+// number of rays each kernel is timed with, and how many times (the fastest time is kept)
+const unsigned int BENCHMARK_RAYS = 64;
+const unsigned int BENCHMARK_PASSES = 5;
+
+
+// the original triangle test, which works out the triangle's edges from its three points for every ray
+// (the same as isTriangleIntersected() apart from that)
+static bool isTriangleIntersectedFromPoints(const Scene* scene, const __m256* const points[9], const Ray* r, float* t, int* index)
+{
+	float tInitial = *t;
+
+	const __m256 epsilons = _mm256_set1_ps(EPSILON);
+	const __m256 negEpsilons = _mm256_set1_ps(-EPSILON);
+	const __m256 zeros = _mm256_setzero_ps();
+	const __m256 ones = _mm256_set1_ps(1.0f);
+	const __m256i eights = _mm256_set1_epi32(8);
+	const __m256i ends = _mm256_set1_epi32(scene->numTriangles);
+
+	__m256 ts = _mm256_set1_ps(tInitial);
+	__m256i indexes = _mm256_set1_epi32(*index);
+	__m256i ijs = _mm256_setr_epi32(0, 1, 2, 3, 4, 5, 6, 7);
+
+	Vector8 rDir(r->dir.x, r->dir.y, r->dir.z);
+	Vector8 rStart(r->start.x, r->start.y, r->start.z);
+
+	for (unsigned int i = 0; i < scene->numTrianglesSIMD; ++i)
+	{
+		Vector8 p1(points[0][i], points[1][i], points[2][i]);
+		Vector8 p2(points[3][i], points[4][i], points[5][i]);
+		Vector8 p3(points[6][i], points[7][i], points[8][i]);
+
+		Vector8 e1 = p2 - p1;
+		Vector8 e2 = p3 - p1;
+		Vector8 h = cross(rDir, e2);
+		__m256 det = dot(e1, h);
+		__m256 detBetweenEpsilons = (det > negEpsilons) & (det < epsilons);
+		__m256 invDet = ones / det;
+		Vector8 s = rStart - p1;
+		__m256 u = invDet * dot(s, h);
+		Vector8 q = cross(s, e1);
+		__m256 v = invDet * dot(q, rDir);
+		__m256 t0 = invDet * dot(e2, q);
+
+		__m256 success = _mm256_andnot_ps(detBetweenEpsilons, _mm256_castsi256_ps(_mm256_cmpgt_epi32(ends, ijs)) &
+			(u >= zeros) & (v >= zeros) & ((u + v) <= ones) & (t0 > epsilons) & (t0 < ts));
+
+		ts = select(success, t0, ts);
+		indexes = select(_mm256_castps_si256(success), ijs, indexes);
+
+		ijs = _mm256_add_epi32(ijs, eights);
+	}
+
+	selectMinimumAndIndex(ts, indexes, t, index);
+
+	return *t < tInitial;
+}
+
+
+// time the whole scene triangle test for each instruction set this CPU supports (the same source compiled 4, 8, and 16 wide)
+static void benchmarkKernelWidths(const Scene& scene, const Ray* rays)
+{
+	const IntersectionKernels* kernels[] = { &sse42Kernels, &avx2Kernels, &avx512Kernels };
+	const InstructionSet isas[] = { ISA_SSE42, ISA_AVX2, ISA_AVX512 };
+	const InstructionSet best = detectInstructionSet();
+
+	int reference[BENCHMARK_RAYS];
+	for (int k = 0; k < 3 && isas[k] <= best; ++k)
+	{
+		unsigned long long bestTime = ~0ULL;
+		unsigned int mismatches = 0;
+
+		for (unsigned int pass = 0; pass < BENCHMARK_PASSES; ++pass)
+		{
+			float ts[BENCHMARK_RAYS];
+			int indexes[BENCHMARK_RAYS];
+
+			unsigned long long start = __rdtsc();
+			for (unsigned int i = 0; i < BENCHMARK_RAYS; ++i)
+			{
+				ts[i] = MAX_RAY_DISTANCE;
+				indexes[i] = -1;
+				kernels[k]->triangles(&scene, &rays[i], &ts[i], &indexes[i]);
+			}
+			bestTime = std::min(bestTime, __rdtsc() - start);
+
+			// every width should find exactly the same collisions as the first one
+			mismatches = 0;
+			for (unsigned int i = 0; i < BENCHMARK_RAYS; ++i)
+			{
+				if (k == 0) reference[i] = indexes[i];
+				else if (indexes[i] != reference[i]) ++mismatches;
+			}
+		}
+
+		printf("  %-6s kernels:    %.2f cycles per test (%u mismatched)\n", instructionSetName(isas[k]), bestTime / ((double)BENCHMARK_RAYS * scene.numTrianglesSIMD * 8), mismatches);
+	}
+}
+
+
+// time (in cycles per ray/triangle test) the triangle intersection test using the precomputed edges against the original version
+void benchmarkTriangles(const Scene& scene)
+{
+	if (scene.numTriangles == 0)
+	{
+		printf("triangle benchmark: scene has no triangles\n");
+		return;
+	}
+
+	// SoA copies of all three points (in the same order as the scene's SoA copies)
+	__m256* points[9];
+	for (int i = 0; i < 9; ++i)
+	{
+		points[i] = (__m256*) _aligned_malloc(sizeof(__m256) * scene.numTrianglesSIMD, 32);
+	}
+	for (unsigned int i = 0; i < scene.numTrianglesSIMD * 8; ++i)
+	{
+		const Triangle& triangle = scene.triangleContainer[i < scene.numTriangles ? i : scene.numTriangles - 1];
+		const Point* corners[3] = { &triangle.p1, &triangle.p2, &triangle.p3 };
+
+		for (int j = 0; j < 3; ++j)
+		{
+			points[j * 3 + 0][i / 8].m256_f32[i % 8] = corners[j]->x;
+			points[j * 3 + 1][i / 8].m256_f32[i % 8] = corners[j]->y;
+			points[j * 3 + 2][i / 8].m256_f32[i % 8] = corners[j]->z;
+		}
+	}
+
+	// rays from the camera towards triangles spread through the scene (so that most of them hit something)
+	Ray rays[BENCHMARK_RAYS];
+	for (unsigned int i = 0; i < BENCHMARK_RAYS; ++i)
+	{
+		const Triangle& target = scene.triangleContainer[(unsigned long long)i * scene.numTriangles / BENCHMARK_RAYS];
+		Point centre = target.p1 + ((target.p2 - target.p1) + (target.p3 - target.p1)) * (1.0f / 3.0f);
+
+		rays[i].start = scene.cameraPosition;
+		rays[i].dir = normalise(centre - scene.cameraPosition);
+	}
+
+	unsigned long long bestPrecomputed = ~0ULL, bestFromPoints = ~0ULL;
+	unsigned int mismatches = 0, hits = 0;
+
+	for (unsigned int pass = 0; pass < BENCHMARK_PASSES; ++pass)
+	{
+		float tPrecomputed[BENCHMARK_RAYS], tFromPoints[BENCHMARK_RAYS];
+		int indexPrecomputed[BENCHMARK_RAYS], indexFromPoints[BENCHMARK_RAYS];
+
+		unsigned long long start = __rdtsc();
+		for (unsigned int i = 0; i < BENCHMARK_RAYS; ++i)
+		{
+			tPrecomputed[i] = MAX_RAY_DISTANCE;
+			indexPrecomputed[i] = -1;
+			isTriangleIntersected(&scene, &rays[i], &tPrecomputed[i], &indexPrecomputed[i]);
+		}
+		unsigned long long middle = __rdtsc();
+		for (unsigned int i = 0; i < BENCHMARK_RAYS; ++i)
+		{
+			tFromPoints[i] = MAX_RAY_DISTANCE;
+			indexFromPoints[i] = -1;
+			isTriangleIntersectedFromPoints(&scene, points, &rays[i], &tFromPoints[i], &indexFromPoints[i]);
+		}
+		unsigned long long end = __rdtsc();
+
+		bestPrecomputed = std::min(bestPrecomputed, middle - start);
+		bestFromPoints = std::min(bestFromPoints, end - middle);
+
+		// both versions should find exactly the same collisions
+		mismatches = hits = 0;
+		for (unsigned int i = 0; i < BENCHMARK_RAYS; ++i)
+		{
+			if (indexPrecomputed[i] != indexFromPoints[i]) ++mismatches;
+			if (indexPrecomputed[i] != -1) ++hits;
+		}
+	}
+
+	double tests = (double)BENCHMARK_RAYS * scene.numTrianglesSIMD * 8;
+	printf("triangle benchmark (%u rays x %u triangles, %u hit, %u mismatched):\n", BENCHMARK_RAYS, scene.numTriangles, hits, mismatches);
+	printf("  precomputed edges: %.2f cycles per test\n", bestPrecomputed / tests);
+	printf("  from points:       %.2f cycles per test\n", bestFromPoints / tests);
+
+	for (int i = 0; i < 9; ++i)
+	{
+		_aligned_free(points[i]);
+	}
+
+	benchmarkKernelWidths(scene, rays);
+}
+
+
+// the maths library version of one of the functions
+static __forceinline float exactMathFunction(const int function, const float x, const float y)
+{
+	switch (function)
+	{
+	case MATH_EXP: return expf(x);
+	case MATH_LOG: return logf(x);
+	case MATH_POW: return powf(x, y);
+	case MATH_SIN: return sinf(x);
+	case MATH_COS: return cosf(x);
+	default: return 1.0f / sqrtf(x);
+	}
+}
+
+// time the maths library version of one of the functions (in cycles per value)
+template <int Function>
+static double timeExactMathFunction(const MathBenchmarkData& data)
+{
+	unsigned long long bestTime = ~0ULL;
+
+	for (unsigned int pass = 0; pass < MATH_BENCHMARK_PASSES; ++pass)
+	{
+		unsigned long long start = __rdtsc();
+		for (unsigned int i = 0; i < MATH_BENCHMARK_VALUES; ++i)
+		{
+			data.results[Function][i] = exactMathFunction(Function, data.inputs[Function][i], data.powers[i]);
+		}
+		bestTime = std::min(bestTime, __rdtsc() - start);
+	}
+
+	return bestTime / (double)MATH_BENCHMARK_VALUES;
+}
+
+
+// time (in cycles per value) the maths library's exp, log, pow, sin, cos and 1 / sqrt against the fast versions at each width this CPU supports
+void benchmarkMath()
+{
+	static const char* names[NUM_MATH_FUNCTIONS] = { "exp", "log", "pow", "sin", "cos", "rsqrt" };
+
+	// each function gets the sort of values the renderer gives it (exposures, specular terms and powers, texture coordinates, and squared lengths)
+	static const float lows[NUM_MATH_FUNCTIONS] = { -20.0f, 0.001f, 0.0f, -10.0f, -10.0f, 0.01f };
+	static const float highs[NUM_MATH_FUNCTIONS] = { 0.0f, 100.0f, 1.0f, 10.0f, 10.0f, 10000.0f };
+
+	MathBenchmarkData data;
+	float* exact[NUM_MATH_FUNCTIONS];
+	data.powers = (float*) _aligned_malloc(sizeof(float) * MATH_BENCHMARK_VALUES, 64);
+	for (int f = 0; f < NUM_MATH_FUNCTIONS; ++f)
+	{
+		data.inputs[f] = (float*) _aligned_malloc(sizeof(float) * MATH_BENCHMARK_VALUES, 64);
+		data.results[f] = (float*) _aligned_malloc(sizeof(float) * MATH_BENCHMARK_VALUES, 64);
+		exact[f] = (float*) _aligned_malloc(sizeof(float) * MATH_BENCHMARK_VALUES, 64);
+	}
+
+	// evenly spread inputs, and powers from 1 to 100 in a different order
+	for (unsigned int i = 0; i < MATH_BENCHMARK_VALUES; ++i)
+	{
+		float fraction = (i + 0.5f) / MATH_BENCHMARK_VALUES;
+		for (int f = 0; f < NUM_MATH_FUNCTIONS; ++f)
+		{
+			data.inputs[f][i] = lows[f] + fraction * (highs[f] - lows[f]);
+		}
+		data.powers[i] = 1.0f + 99.0f * ((i * 2654435761u) % MATH_BENCHMARK_VALUES) / MATH_BENCHMARK_VALUES;
+	}
+
+	double exactCycles[NUM_MATH_FUNCTIONS];
+	exactCycles[MATH_EXP] = timeExactMathFunction<MATH_EXP>(data);
+	exactCycles[MATH_LOG] = timeExactMathFunction<MATH_LOG>(data);
+	exactCycles[MATH_POW] = timeExactMathFunction<MATH_POW>(data);
+	exactCycles[MATH_SIN] = timeExactMathFunction<MATH_SIN>(data);
+	exactCycles[MATH_COS] = timeExactMathFunction<MATH_COS>(data);
+	exactCycles[MATH_RSQRT] = timeExactMathFunction<MATH_RSQRT>(data);
+	for (int f = 0; f < NUM_MATH_FUNCTIONS; ++f)
+	{
+		std::copy(data.results[f], data.results[f] + MATH_BENCHMARK_VALUES, exact[f]);
+	}
+
+	printf("maths benchmark (%u values, cycles per value, speedup over the maths library, and largest error relative to max(1, |exact|)):\n", MATH_BENCHMARK_VALUES);
+	printf("  %-15s", "");
+	for (int f = 0; f < NUM_MATH_FUNCTIONS; ++f) printf(" %20s", names[f]);
+	printf("\n  %-15s", "libm");
+	for (int f = 0; f < NUM_MATH_FUNCTIONS; ++f) printf(" %20.2f", exactCycles[f]);
+	printf("\n");
+
+	const InstructionSet isas[] = { ISA_SSE42, ISA_AVX2, ISA_AVX512 };
+	const int widths[] = { 4, 8, 16 };
+	const InstructionSet best = detectInstructionSet();
+
+	for (int k = 0; k < 3 && isas[k] <= best; ++k)
+	{
+		double cycles[NUM_MATH_FUNCTIONS];
+		if (widths[k] == 4) timeFastMath<4>(data, cycles);
+		else if (widths[k] == 8) timeFastMath<8>(data, cycles);
+		else timeFastMath16(data, cycles);
+
+		printf("  %-6s %2d wide ", instructionSetName(isas[k]), widths[k]);
+		for (int f = 0; f < NUM_MATH_FUNCTIONS; ++f)
+		{
+			float worst = 0.0f;
+			for (unsigned int i = 0; i < MATH_BENCHMARK_VALUES; ++i)
+			{
+				worst = std::max(worst, fabsf(data.results[f][i] - exact[f][i]) / std::max(1.0f, fabsf(exact[f][i])));
+			}
+			printf(" %5.2f %5.1fx %7.1e", cycles[f], exactCycles[f] / cycles[f], worst);
+		}
+		printf("\n");
+	}
+
+	_aligned_free(data.powers);
+	for (int f = 0; f < NUM_MATH_FUNCTIONS; ++f)
+	{
+		_aligned_free(data.inputs[f]);
+		_aligned_free(data.results[f]);
+		_aligned_free(exact[f]);
+	}
+}
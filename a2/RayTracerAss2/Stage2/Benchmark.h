@@ -0,0 +1,18 @@
+// micro benchmarks of the intersection kernels and maths functions (run with command line options instead of rendering)
+
+#ifndef __BENCHMARK_H
+#define __BENCHMARK_H
+
+#include "Scene.h"
+
+// time (in cycles per ray/triangle test) the triangle intersection test using the precomputed edges,
+// against the original version that works the edges out from the three points for every ray,
+// then the same test compiled for each instruction set the CPU supports (4, 8, and 16 wide)
+// must be called after simdifySceneContainers()
+void benchmarkTriangles(const Scene& scene);
+
+// time (in cycles per value) the maths library's exp, log, pow, sin, cos and 1 / sqrt against the fast versions in MathSIMD.h,
+// 4, 8, and 16 wide (as far as the CPU supports), along with how far the fast versions are from the maths library
+void benchmarkMath();
+
+#endif // __BENCHMARK_H
@@ -0,0 +1,8 @@
+// 16 wide (AVX-512) timing of the fast maths functions
+
+#include "BenchmarkMath.h"
+
+void timeFastMath16(const MathBenchmarkData& data, double cycles[NUM_MATH_FUNCTIONS])
+{
+	timeFastMath<16>(data, cycles);
+}
@@ -0,0 +1,77 @@
+// timing the fast maths functions at one width (Benchmark.cpp does 4 and 8 wide, and BenchmarkAVX512.cpp does 16 wide)
+
+#ifndef __BENCHMARK_MATH_H
+#define __BENCHMARK_MATH_H
+
+#include <intrin.h>
+#include <algorithm>
+#include "MathSIMD.h"
+
+// the functions that are timed
+enum { MATH_EXP, MATH_LOG, MATH_POW, MATH_SIN, MATH_COS, MATH_RSQRT, NUM_MATH_FUNCTIONS };
+
+// number of values each function is timed with, and how many times (the fastest time is kept)
+const unsigned int MATH_BENCHMARK_VALUES = 4096;
+const unsigned int MATH_BENCHMARK_PASSES = 20;
+
+// inputs for each function (and the powers for pow), and where each function's results go
+typedef struct MathBenchmarkData
+{
+	float* inputs[NUM_MATH_FUNCTIONS];
+	float* powers;
+	float* results[NUM_MATH_FUNCTIONS];
+} MathBenchmarkData;
+
+// time each function 16 wide (in cycles per value)
+void timeFastMath16(const MathBenchmarkData& data, double cycles[NUM_MATH_FUNCTIONS]);
+
+
+// one of the fast functions (the switch goes away once the function is a constant)
+template <int Width>
+__forceinline SimdFloat<Width> fastMathFunction(const int function, const SimdFloat<Width> x, const SimdFloat<Width> y)
+{
+	switch (function)
+	{
+	case MATH_EXP: return fastExp(x);
+	case MATH_LOG: return fastLog(x);
+	case MATH_POW: return fastPow(x, y);
+	case MATH_SIN: return fastSin(x);
+	case MATH_COS: return fastCos(x);
+	default: return fastRsqrt(x);
+	}
+}
+
+// time one function at one width (in cycles per value)
+template <int Width, int Function>
+double timeFastMathFunction(const MathBenchmarkData& data)
+{
+	unsigned long long bestTime = ~0ULL;
+
+	for (unsigned int pass = 0; pass < MATH_BENCHMARK_PASSES; ++pass)
+	{
+		unsigned long long start = __rdtsc();
+		for (unsigned int i = 0; i < MATH_BENCHMARK_VALUES; i += Width)
+		{
+			SimdFloat<Width> xs = SimdFloat<Width>::load(data.inputs[Function] + i, Width);
+			SimdFloat<Width> ys = SimdFloat<Width>::load(data.powers + i, Width);
+			fastMathFunction<Width>(Function, xs, ys).store(data.results[Function] + i);
+		}
+		bestTime = std::min(bestTime, __rdtsc() - start);
+	}
+
+	return bestTime / (double)MATH_BENCHMARK_VALUES;
+}
+
+// time each function at one width (in cycles per value)
+template <int Width>
+void timeFastMath(const MathBenchmarkData& data, double cycles[NUM_MATH_FUNCTIONS])
+{
+	cycles[MATH_EXP] = timeFastMathFunction<Width, MATH_EXP>(data);
+	cycles[MATH_LOG] = timeFastMathFunction<Width, MATH_LOG>(data);
+	cycles[MATH_POW] = timeFastMathFunction<Width, MATH_POW>(data);
+	cycles[MATH_SIN] = timeFastMathFunction<Width, MATH_SIN>(data);
+	cycles[MATH_COS] = timeFastMathFunction<Width, MATH_COS>(data);
+	cycles[MATH_RSQRT] = timeFastMathFunction<Width, MATH_RSQRT>(data);
+}
+
+#endif // __BENCHMARK_MATH_H
@@ -0,0 +1,284 @@
+// on-disk cache of fully built scenes
+
+#define NOMINMAX
+#include <windows.h>
+#include <stdio.h>
+#include <string.h>
+#include "Cache.h"
+#include "BVH.h"
+
+// bump this whenever the builders or the layout of anything that gets cached changes
+const unsigned int CACHE_VERSION = 5;
+
+// start of every cache file
+const char CACHE_MAGIC[8] = { 'R', 'T', 'C', 'A', 'C', 'H', 'E', 0 };
+
+// every section of the file starts on a cache line (so the SoA copies keep their alignment when mapped)
+const unsigned int CACHE_ALIGNMENT = 64;
+
+// the most sections a scene can have
+const unsigned int MAX_CACHE_SECTIONS = 40;
+
+// the start of a cache file
+// the scene is stored as is (for all of its counts and settings), its pointers are replaced as the sections are mapped
+typedef struct CacheHeader
+{
+	char magic[8];
+	unsigned int version;
+	unsigned int sceneSize;
+	unsigned int numSections;
+	Scene scene;
+} CacheHeader;
+
+// one of the scene's containers (where its pointer lives, and how big it is)
+typedef struct CacheSection
+{
+	void** pointer;
+	size_t size;
+} CacheSection;
+
+
+// find all of the scene's containers that get cached (in file order), returns how many there are
+static unsigned int findSections(Scene& scene, CacheSection* sections)
+{
+	unsigned int numSections = 0;
+
+#define ADD_SECTION(p, s) { sections[numSections].pointer = (void**) &(p); sections[numSections].size = (s); ++numSections; }
+
+	// objects
+	ADD_SECTION(scene.materialContainer, sizeof(Material) * scene.numMaterials);
+	ADD_SECTION(scene.sphereContainer, sizeof(Sphere) * scene.numSpheres);
+	ADD_SECTION(scene.triangleContainer, sizeof(Triangle) * scene.numTriangles);
+	ADD_SECTION(scene.lightContainer, sizeof(Light) * scene.numLights);
+
+	// SIMD spheres (with their extra vector of padding)
+	size_t sphereSize = scene.numSpheres > 0 ? sizeof(__m256) * (scene.numSpheresSIMD + 1) : 0;
+	ADD_SECTION(scene.spherePosX, sphereSize);
+	ADD_SECTION(scene.spherePosY, sphereSize);
+	ADD_SECTION(scene.spherePosZ, sphereSize);
+	ADD_SECTION(scene.sphereSize, sphereSize);
+	ADD_SECTION(scene.sphereMaterialId, sphereSize);
+
+	// SIMD triangles (also padded)
+	size_t triangleSize = scene.numTriangles > 0 ? sizeof(__m256) * (scene.numTrianglesSIMD + 1) : 0;
+	ADD_SECTION(scene.triangle1X, triangleSize);
+	ADD_SECTION(scene.triangle1Y, triangleSize);
+	ADD_SECTION(scene.triangle1Z, triangleSize);
+	ADD_SECTION(scene.triangleEdge1X, triangleSize);
+	ADD_SECTION(scene.triangleEdge1Y, triangleSize);
+	ADD_SECTION(scene.triangleEdge1Z, triangleSize);
+	ADD_SECTION(scene.triangleEdge2X, triangleSize);
+	ADD_SECTION(scene.triangleEdge2Y, triangleSize);
+	ADD_SECTION(scene.triangleEdge2Z, triangleSize);
+
+	// SIMD lights
+	size_t lightSize = sizeof(__m256) * scene.numLightsSIMD;
+	ADD_SECTION(scene.posX, lightSize);
+	ADD_SECTION(scene.posY, lightSize);
+	ADD_SECTION(scene.posZ, lightSize);
+	ADD_SECTION(scene.red, lightSize);
+	ADD_SECTION(scene.green, lightSize);
+	ADD_SECTION(scene.blue, lightSize);
+
+	// acceleration structures
+	ADD_SECTION(scene.bvhNodes, sizeof(BVHNode) * scene.numBVHNodes);
+	ADD_SECTION(scene.bvh8Nodes, sizeof(BVH8Node) * scene.numBVH8Nodes);
+	ADD_SECTION(scene.qbvh8Nodes, scene.accelerator == Scene::QBVH8 ? sizeof(QBVH8Node) * scene.numBVH8Nodes : 0);
+
+#undef ADD_SECTION
+
+	return numSections;
+}
+
+
+// empty the parts of a scene that are never cached
+static void clearUncachedParts(Scene& scene)
+{
+	scene.grid = NULL;
+	scene.numModels = scene.numInstances = scene.numTLASNodes = 0;
+	scene.modelContainer = NULL;
+	scene.instanceContainer = NULL;
+	scene.tlasNodes = NULL;
+	scene.numLightTreeNodes = 0;
+	scene.lightTreeNodes = NULL;
+	scene.lightTreeIndexes = NULL;
+	scene.lightSamples = 0;
+	scene.lightAliasProbability = NULL;
+	scene.lightAlias = NULL;
+}
+
+
+// round an offset up to the next section boundary
+static size_t alignOffset(size_t offset)
+{
+	return (offset + CACHE_ALIGNMENT - 1) & ~(size_t)(CACHE_ALIGNMENT - 1);
+}
+
+
+// 64 bit FNV-1a hash
+// see: http://www.isthe.com/chongo/tech/comp/fnv/
+static unsigned long long hashBytes(const void* data, size_t size, unsigned long long hash)
+{
+	const unsigned char* bytes = (const unsigned char*) data;
+
+	for (size_t i = 0; i < size; ++i)
+	{
+		hash = (hash ^ bytes[i]) * 0x100000001b3ULL;
+	}
+
+	return hash;
+}
+
+
+// work out the name of the cache file for a scene file built with the given accelerator (in the given directory)
+bool getCacheName(const char* cacheDirectory, const char* inputName, const char* accelerator, char* cacheName)
+{
+	if (strlen(cacheDirectory) + 32 >= CACHE_NAME_LENGTH) return false;
+
+	FILE* file = fopen(inputName, "rb");
+	if (file == NULL) return false;
+
+	// the hash covers the scene file's contents, the accelerator, and the cache format
+	unsigned long long hash = 0xcbf29ce484222325ULL;
+	char buffer[65536];
+	size_t read;
+
+	while ((read = fread(buffer, 1, sizeof(buffer), file)) > 0)
+	{
+		hash = hashBytes(buffer, read, hash);
+	}
+	fclose(file);
+
+	unsigned int sceneSize = sizeof(Scene);
+	hash = hashBytes(accelerator, strlen(accelerator), hash);
+	hash = hashBytes(&CACHE_VERSION, sizeof(CACHE_VERSION), hash);
+	hash = hashBytes(&sceneSize, sizeof(sceneSize), hash);
+
+	sprintf(cacheName, "%s/%016llx.scenecache", cacheDirectory, hash);
+
+	return true;
+}
+
+
+// load a scene from a cache file (returns false if there isn't a usable one)
+bool loadSceneCache(const char* cacheName, Scene& scene)
+{
+	HANDLE file = CreateFileA(cacheName, GENERIC_READ, FILE_SHARE_READ, NULL, OPEN_EXISTING, FILE_ATTRIBUTE_NORMAL, NULL);
+	if (file == INVALID_HANDLE_VALUE) return false;
+
+	LARGE_INTEGER fileSize;
+	if (!GetFileSizeEx(file, &fileSize) || fileSize.QuadPart < (long long) sizeof(CacheHeader))
+	{
+		CloseHandle(file);
+		return false;
+	}
+
+	// map the file copy-on-write (the mapping keeps the file open, and is never closed, as the scene lives until exit)
+	HANDLE mapping = CreateFileMappingA(file, NULL, PAGE_WRITECOPY, 0, 0, NULL);
+	CloseHandle(file);
+	if (mapping == NULL) return false;
+
+	char* base = (char*) MapViewOfFile(mapping, FILE_MAP_COPY, 0, 0, 0);
+	CloseHandle(mapping);
+	if (base == NULL) return false;
+
+	const CacheHeader* header = (const CacheHeader*) base;
+	if (memcmp(header->magic, CACHE_MAGIC, sizeof(CACHE_MAGIC)) != 0 || header->version != CACHE_VERSION || header->sceneSize != sizeof(Scene))
+	{
+		UnmapViewOfFile(base);
+		return false;
+	}
+
+	// take the scene's counts and settings, then point each container at its section of the file
+	Scene loaded = header->scene;
+	CacheSection sections[MAX_CACHE_SECTIONS];
+	unsigned int numSections = findSections(loaded, sections);
+
+	if (numSections != header->numSections)
+	{
+		UnmapViewOfFile(base);
+		return false;
+	}
+
+	size_t offset = alignOffset(sizeof(CacheHeader));
+	for (unsigned int i = 0; i < numSections; ++i)
+	{
+		if (offset + sections[i].size > (size_t) fileSize.QuadPart)
+		{
+			// truncated (or otherwise broken) file
+			UnmapViewOfFile(base);
+			return false;
+		}
+
+		*sections[i].pointer = sections[i].size > 0 ? base + offset : NULL;
+		offset = alignOffset(offset + sections[i].size);
+	}
+
+	clearUncachedParts(loaded);
+
+	scene = loaded;
+
+	return true;
+}
+
+
+// whether a built scene can be cached
+bool isSceneCacheable(const Scene& scene)
+{
+	return scene.numBVHNodes > 0 && scene.numInstances == 0;
+}
+
+// write a built scene out to a cache file
+bool saveSceneCache(const char* cacheName, const Scene& scene)
+{
+	if (!isSceneCacheable(scene)) return false;
+
+	CacheHeader header;
+	memset(&header, 0, sizeof(header));
+	memcpy(header.magic, CACHE_MAGIC, sizeof(CACHE_MAGIC));
+	header.version = CACHE_VERSION;
+	header.sceneSize = sizeof(Scene);
+	header.scene = scene;
+	clearUncachedParts(header.scene);
+
+	CacheSection sections[MAX_CACHE_SECTIONS];
+	header.numSections = findSections(header.scene, sections);
+
+	// the pointers are replaced when the file is mapped, so they're written as NULL (and the same scene always gives the same file)
+	const void* data[MAX_CACHE_SECTIONS];
+	for (unsigned int i = 0; i < header.numSections; ++i)
+	{
+		data[i] = *sections[i].pointer;
+		*sections[i].pointer = NULL;
+	}
+
+	// write to a temporary file first, so that another process never maps a half written cache
+	char tempName[CACHE_NAME_LENGTH + 8];
+	sprintf(tempName, "%s.tmp", cacheName);
+
+	FILE* file = fopen(tempName, "wb");
+	if (file == NULL) return false;
+
+	static const char padding[CACHE_ALIGNMENT] = { 0 };
+	bool success = fwrite(&header, sizeof(header), 1, file) == 1;
+	size_t offset = sizeof(header);
+
+	for (unsigned int i = 0; i < header.numSections && success; ++i)
+	{
+		size_t aligned = alignOffset(offset);
+		if (aligned > offset) success = fwrite(padding, aligned - offset, 1, file) == 1;
+		if (sections[i].size > 0 && success) success = fwrite(data[i], sections[i].size, 1, file) == 1;
+		offset = aligned + sections[i].size;
+	}
+
+	success = fclose(file) == 0 && success;
+
+	// replace any existing cache with the new one
+	if (!success || !MoveFileExA(tempName, cacheName, MOVEFILE_REPLACE_EXISTING))
+	{
+		remove(tempName);
+		return false;
+	}
+
+	return true;
+}
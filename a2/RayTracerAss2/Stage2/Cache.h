@@ -0,0 +1,27 @@
+// on-disk cache of fully built scenes (objects, SoA copies, and acceleration structures)
+// cache files are named by a hash of the scene file's contents and the build options, so a changed scene never matches an old cache
+// loading just maps the file into memory and points the scene's containers into it, so nothing is parsed or built
+
+#ifndef __CACHE_H
+#define __CACHE_H
+
+#include "Scene.h"
+
+// longest cache filename that will be generated
+const unsigned int CACHE_NAME_LENGTH = 1024;
+
+// work out the name of the cache file for a scene file built with the given accelerator (in the given directory)
+// returns false if the scene file can't be read
+bool getCacheName(const char* cacheDirectory, const char* inputName, const char* accelerator, char* cacheName);
+
+// load a scene from a cache file (returns false if there isn't a usable one)
+// the file is mapped copy-on-write, so the objects can still be moved (and the BVH refitted) after loading
+bool loadSceneCache(const char* cacheName, Scene& scene);
+
+// whether a built scene can be cached (only scenes with a BVH, of either kind, and no instances can be)
+bool isSceneCacheable(const Scene& scene);
+
+// write a built scene out to a cache file (returns false if it can't be cached, or the file can't be written)
+bool saveSceneCache(const char* cacheName, const Scene& scene);
+
+#endif // __CACHE_H
@@ -0,0 +1,93 @@
+// view ray generation
+
+#include "Camera.h"
+#include "MathSIMD.h"
+#include "Cpu.h"
+
+
+// everything about the view rays that's the same for the whole frame
+Camera initCamera(const Scene* scene, const int width, const int aaLevel)
+{
+	Camera camera;
+	camera.position = scene->cameraPosition;
+	camera.cosRotation = cosf(scene->cameraRotation);
+	camera.sinRotation = sinf(scene->cameraRotation);
+	camera.dirStepSize = 1.0f / (0.5f * width / tanf(PIOVER180 * 0.5f * scene->cameraFieldOfView));
+	camera.aaLevel = aaLevel;
+	camera.sampleStep = 1.0f / aaLevel;
+	return camera;
+}
+
+
+// turn Width points on the screen (in pixels from the centre) into view ray directions
+// (with -fastMath, the directions are normalised with the estimate of 1 / sqrt and a step of Newton's method, which can move a ray that
+// was exactly on the edge between two triangles to the other side of it)
+template <int Width>
+static __forceinline void rotateAndNormalise(const Camera* camera, const float* us, const float* vs, float* xs, float* ys, float* zs)
+{
+	typedef SimdFloat<Width> Floats;
+
+	// direction of the default forward facing ray (z is 1), then rotated about the y axis
+	const Floats steps = Floats::broadcast(camera->dirStepSize);
+	const Floats dxs = Floats::load(us, Width) * steps, dys = Floats::load(vs, Width) * steps;
+
+	const Floats coss = Floats::broadcast(camera->cosRotation), sins = Floats::broadcast(camera->sinRotation);
+	const Floats rxs = dxs * coss - sins, rzs = dxs * sins + coss;
+
+	const Floats lengths = rxs * rxs + dys * dys + rzs * rzs;
+	const Floats invLengths = mathAccuracy == MATH_FAST ? fastRsqrt(lengths) : Floats::broadcast(1.0f) / sqrt(lengths);
+
+	(rxs * invLengths).store(xs);
+	(dys * invLengths).store(ys);
+	(rzs * invLengths).store(zs);
+}
+
+// directions of the view rays first to first + 7 of a line of pixels starting at (x, y)
+void viewRayDirections(const Camera* camera, const int x, const int y, const unsigned int first, ViewRays8* rays)
+{
+	const int aaLevel = camera->aaLevel;
+	const unsigned int samples = aaLevel * aaLevel;
+
+	// the first ray's pixel and sub-location, then count through the rest (so that there's no error building up from adding the sample step)
+	int pixel = first / samples;
+	int sx = (first % samples) / aaLevel, sy = first % aaLevel;
+
+	float us[8], vs[8];
+	for (int i = 0; i < 8; ++i)
+	{
+		us[i] = float(x + pixel) + sx * camera->sampleStep;
+		vs[i] = float(y) + sy * camera->sampleStep;
+
+		if (++sy == aaLevel)
+		{
+			sy = 0;
+			if (++sx == aaLevel)
+			{
+				sx = 0;
+				++pixel;
+			}
+		}
+	}
+
+	// two lots of 4 without AVX2
+	if (instructionSet >= ISA_AVX2)
+	{
+		rotateAndNormalise<8>(camera, us, vs, rays->x, rays->y, rays->z);
+	}
+	else
+	{
+		rotateAndNormalise<4>(camera, us, vs, rays->x, rays->y, rays->z);
+		rotateAndNormalise<4>(camera, us + 4, vs + 4, rays->x + 4, rays->y + 4, rays->z + 4);
+	}
+}
+
+// directions of all of the view rays of count pixels from (x, y)
+void viewRayLine(const Camera* camera, const int x, const int y, const int count, ViewRays8* rays)
+{
+	const unsigned int numRays = count * camera->aaLevel * camera->aaLevel;
+
+	for (unsigned int i = 0; i < numRays; i += 8)
+	{
+		viewRayDirections(camera, x, y, i, &rays[i / 8]);
+	}
+}
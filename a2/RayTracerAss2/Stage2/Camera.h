@@ -0,0 +1,44 @@
+// view ray generation
+// the camera's rotation and the spacing of the view rays are worked out once per frame, then the directions are made 8 at a time
+
+#ifndef __CAMERA_H
+#define __CAMERA_H
+
+#include "Scene.h"
+
+// everything about the view rays that's the same for the whole frame
+typedef struct Camera
+{
+	Point position;
+	float cosRotation, sinRotation;		// of the camera's rotation (about the y axis)
+	float dirStepSize;					// angle between the view rays of neighbouring pixels
+	int aaLevel;						// sub-locations across (and down) each pixel
+	float sampleStep;					// 1 / aaLevel
+} Camera;
+
+// directions of 8 view rays (SoA, normalised)
+typedef struct ViewRays8
+{
+	float x[8], y[8], z[8];
+} ViewRays8;
+
+Camera initCamera(const Scene* scene, const int width, const int aaLevel);
+
+// directions of the view rays first to first + 7 of a line of pixels starting at (x, y) (in pixels from the centre)
+// the rays are numbered through the sub-locations of each pixel (down each column of them, then across) and then along the line
+// (pixels past the end of the line are just the next pixels along, so the last call for a line can be used for as much of it as is needed)
+void viewRayDirections(const Camera* camera, const int x, const int y, const unsigned int first, ViewRays8* rays);
+
+// directions of all of the view rays of count pixels from (x, y), numbered as above
+// rays needs space for (count * aaLevel * aaLevel + 7) / 8 of them
+void viewRayLine(const Camera* camera, const int x, const int y, const int count, ViewRays8* rays);
+
+// view ray number n (of the ones from viewRayLine())
+inline Ray primaryRay(const Camera* camera, const ViewRays8* rays, const unsigned int n)
+{
+	const ViewRays8& group = rays[n / 8];
+	Ray ray = { camera->position, { group.x[n % 8], group.y[n % 8], group.z[n % 8] } };
+	return ray;
+}
+
+#endif // __CAMERA_H
@@ -7,6 +7,8 @@
 
 #include <algorithm>
 
+#include "MathSIMD.h"
+
 // a colour consists of three primary components (red, green, and blue)
 struct Colour 
 {
@@ -39,6 +41,17 @@ struct Colour
 	// convert colour to pixel (in 0x00BBGGRR format) with respect to an exposure level 
 	inline unsigned int convertToPixel(float exposure)
 	{
+		// all three exponentials at once
+		if (mathAccuracy == MATH_FAST)
+		{
+			float exps[4];
+			fastExp(SimdFloat<4>{ _mm_setr_ps(red, green, blue, 0.0f) } * SimdFloat<4>::broadcast(exposure)).store(exps);
+
+			return ((unsigned char) (255 * (std::min(1.0f - exps[2], 1.0f))) << 16) +
+				((unsigned char) (255 * (std::min(1.0f - exps[1], 1.0f))) << 8) +
+				((unsigned char) (255 * (std::min(1.0f - exps[0], 1.0f))) << 0);
+		}
+
 		return ((unsigned char) (255 * (std::min(1.0f - expf(blue * exposure), 1.0f))) << 16) +
 			((unsigned char) (255 * (std::min(1.0f - expf(green * exposure), 1.0f))) << 8) +
 			((unsigned char) (255 * (std::min(1.0f - expf(red * exposure), 1.0f))) << 0);
@@ -0,0 +1,55 @@
+// CPU feature detection (via CPUID, and XGETBV for what the OS saves on context switches)
+
+#include <intrin.h>
+#include <immintrin.h>
+#include "Cpu.h"
+
+InstructionSet instructionSet = ISA_AVX2;
+
+
+// best instruction set this CPU (and OS) supports
+// AVX2 also needs FMA and the OS to save the ymm registers, AVX-512 needs the F, DQ, BW and VL parts and the OS to save the zmm and mask registers
+InstructionSet detectInstructionSet()
+{
+	int info[4];
+
+	__cpuid(info, 0);
+	int maxLeaf = info[0];
+
+	__cpuid(info, 1);
+	bool osxsave = (info[2] & (1 << 27)) != 0;
+	bool avx = (info[2] & (1 << 28)) != 0;
+	bool fma = (info[2] & (1 << 12)) != 0;
+
+	// which register states the OS saves (bits 1 and 2 for xmm and ymm, 5 to 7 for the AVX-512 mask and zmm registers)
+	unsigned long long xcr0 = osxsave ? _xgetbv(0) : 0;
+	bool osYmm = (xcr0 & 0x06) == 0x06;
+	bool osZmm = (xcr0 & 0xE6) == 0xE6;
+
+	if (maxLeaf < 7 || !avx || !fma || !osYmm) return ISA_SSE42;
+
+	__cpuidex(info, 7, 0);
+	unsigned int features = info[1];
+	bool avx2 = (features & (1u << 5)) != 0;
+	bool avx512 = (features & (1u << 16)) && (features & (1u << 17)) && (features & (1u << 30)) && (features & (1u << 31));
+
+	if (!avx2) return ISA_SSE42;
+	if (!avx512 || !osZmm) return ISA_AVX2;
+
+	return ISA_AVX512;
+}
+
+
+const char* instructionSetName(const InstructionSet isa)
+{
+	switch (isa)
+	{
+	case ISA_SSE42:
+		return "sse4.2";
+	case ISA_AVX2:
+		return "avx2";
+	default:
+		return "avx512";
+	}
+}
+
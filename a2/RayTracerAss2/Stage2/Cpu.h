@@ -0,0 +1,19 @@
+// working out which instruction sets the CPU (and OS) support, so the fastest SIMD kernels that will actually run can be picked at startup
+
+#ifndef __CPU_H
+#define __CPU_H
+
+// instruction sets that the intersection kernels are compiled for (each one needs everything that the ones before it need)
+// anything older than SSE4.2 isn't supported
+typedef enum InstructionSet { ISA_SSE42, ISA_AVX2, ISA_AVX512 } InstructionSet;
+
+// the instruction set everything is using (the best one available, unless a lower one was asked for)
+extern InstructionSet instructionSet;
+
+// best instruction set this CPU (and OS) supports
+InstructionSet detectInstructionSet();
+
+// name of an instruction set (as printed, and as given on the command line)
+const char* instructionSetName(const InstructionSet isa);
+
+#endif // __CPU_H
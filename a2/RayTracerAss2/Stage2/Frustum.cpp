@@ -0,0 +1,253 @@
+// per block view frustum culling
+
+#include "Frustum.h"
+#include "BVH.h"
+#include "PrimitivesSIMD.h"
+#include <malloc.h>
+
+// blocks are widened by a small fraction of a pixel so that rounding can't cull anything a view ray on the edge of the block would hit
+const float FRUSTUM_PADDING = 0.01f;
+
+
+// frustum containing all of the view rays through the pixels from (xMin, yMin) to (xMax, yMax) (in pixels from the centre)
+Frustum blockFrustum(const Camera* camera, const int xMin, const int xMax, const int yMin, const int yMax)
+{
+	// view rays head in (x * dirStepSize, y * dirStepSize, 1) before being rotated, so the planes through the block's edges are
+	// x >= xMin * dirStepSize * z, x <= xMax * dirStepSize * z, and likewise for y
+	const float dirStepSize = camera->dirStepSize;
+	const float left = (xMin - FRUSTUM_PADDING) * dirStepSize, right = (xMax + FRUSTUM_PADDING) * dirStepSize;
+	const float bottom = (yMin - FRUSTUM_PADDING) * dirStepSize, top = (yMax + FRUSTUM_PADDING) * dirStepSize;
+	const Vector normals[4] = { { 1.0f, 0.0f, -left }, { -1.0f, 0.0f, right }, { 0.0f, 1.0f, -bottom }, { 0.0f, -1.0f, top } };
+
+	// rotate the normals the same way as the view rays
+	const float cosRotation = camera->cosRotation, sinRotation = camera->sinRotation;
+
+	Frustum frustum;
+	frustum.origin = camera->position;
+	for (int i = 0; i < 4; ++i)
+	{
+		Vector rotated = {
+			normals[i].x * cosRotation - normals[i].z * sinRotation,
+			normals[i].y,
+			normals[i].x * sinRotation + normals[i].z * cosRotation };
+		frustum.normals[i] = normalise(rotated);
+	}
+
+	return frustum;
+}
+
+
+// ---- single primitive tests ----
+
+inline bool isSphereInFrustum(const Frustum* frustum, const Sphere& sphere)
+{
+	Vector offset = sphere.pos - frustum->origin;
+	for (int i = 0; i < 4; ++i)
+	{
+		if (frustum->normals[i] * offset < -sphere.size) return false;
+	}
+	return true;
+}
+
+// (a triangle is only outside if all three of its points are outside the same plane)
+inline bool isTriangleInFrustum(const Frustum* frustum, const Triangle& triangle)
+{
+	Vector offset1 = triangle.p1 - frustum->origin, offset2 = triangle.p2 - frustum->origin, offset3 = triangle.p3 - frustum->origin;
+	for (int i = 0; i < 4; ++i)
+	{
+		if (frustum->normals[i] * offset1 < 0.0f && frustum->normals[i] * offset2 < 0.0f && frustum->normals[i] * offset3 < 0.0f) return false;
+	}
+	return true;
+}
+
+// (a box is only outside if its corner furthest along a plane's normal is outside that plane)
+inline bool isBoxInFrustum(const Frustum* frustum, const AABB& box)
+{
+	for (int i = 0; i < 4; ++i)
+	{
+		const Vector& normal = frustum->normals[i];
+		Point corner = { normal.x >= 0.0f ? box.max.x : box.min.x, normal.y >= 0.0f ? box.max.y : box.min.y, normal.z >= 0.0f ? box.max.z : box.min.z };
+		if (normal * (corner - frustum->origin) < 0.0f) return false;
+	}
+	return true;
+}
+
+
+// ---- culled scenes ----
+
+// make space for a culled copy of the scene (big enough for all of its spheres and triangles)
+void initCulledScene(const Scene* scene, Scene* culled)
+{
+	*culled = *scene;
+	culled->accelerator = Scene::LINEAR;
+	culled->numInstances = 0;
+
+	// only the SoA fields that the intersection tests read are filled in
+	culled->sphereContainer = new Sphere[scene->numSpheres];
+	culled->spherePosX = (__m256*)_aligned_malloc(sizeof(__m256) * (scene->numSpheresSIMD + 1), 32);
+	culled->spherePosY = (__m256*)_aligned_malloc(sizeof(__m256) * (scene->numSpheresSIMD + 1), 32);
+	culled->spherePosZ = (__m256*)_aligned_malloc(sizeof(__m256) * (scene->numSpheresSIMD + 1), 32);
+	culled->sphereSize = (__m256*)_aligned_malloc(sizeof(__m256) * (scene->numSpheresSIMD + 1), 32);
+	culled->sphereMaterialId = NULL;
+
+	culled->triangleContainer = new Triangle[scene->numTriangles];
+	culled->triangle1X = (__m256*)_aligned_malloc(sizeof(__m256) * (scene->numTrianglesSIMD + 1), 32);
+	culled->triangle1Y = (__m256*)_aligned_malloc(sizeof(__m256) * (scene->numTrianglesSIMD + 1), 32);
+	culled->triangle1Z = (__m256*)_aligned_malloc(sizeof(__m256) * (scene->numTrianglesSIMD + 1), 32);
+	culled->triangleEdge1X = (__m256*)_aligned_malloc(sizeof(__m256) * (scene->numTrianglesSIMD + 1), 32);
+	culled->triangleEdge1Y = (__m256*)_aligned_malloc(sizeof(__m256) * (scene->numTrianglesSIMD + 1), 32);
+	culled->triangleEdge1Z = (__m256*)_aligned_malloc(sizeof(__m256) * (scene->numTrianglesSIMD + 1), 32);
+	culled->triangleEdge2X = (__m256*)_aligned_malloc(sizeof(__m256) * (scene->numTrianglesSIMD + 1), 32);
+	culled->triangleEdge2Y = (__m256*)_aligned_malloc(sizeof(__m256) * (scene->numTrianglesSIMD + 1), 32);
+	culled->triangleEdge2Z = (__m256*)_aligned_malloc(sizeof(__m256) * (scene->numTrianglesSIMD + 1), 32);
+}
+
+void freeCulledScene(Scene* culled)
+{
+	delete[] culled->sphereContainer;
+	_aligned_free(culled->spherePosX);
+	_aligned_free(culled->spherePosY);
+	_aligned_free(culled->spherePosZ);
+	_aligned_free(culled->sphereSize);
+
+	delete[] culled->triangleContainer;
+	_aligned_free(culled->triangle1X);
+	_aligned_free(culled->triangle1Y);
+	_aligned_free(culled->triangle1Z);
+	_aligned_free(culled->triangleEdge1X);
+	_aligned_free(culled->triangleEdge1Y);
+	_aligned_free(culled->triangleEdge1Z);
+	_aligned_free(culled->triangleEdge2X);
+	_aligned_free(culled->triangleEdge2Y);
+	_aligned_free(culled->triangleEdge2Z);
+}
+
+// add the spheres (from first, selected by a lane mask) to the culled copy
+inline void addSpheres(const Scene* scene, unsigned int first, int mask, Scene* culled)
+{
+	while (mask != 0)
+	{
+		unsigned long lane;
+		_BitScanForward(&lane, mask);
+		mask &= mask - 1;
+
+		culled->sphereContainer[culled->numSpheres++] = scene->sphereContainer[first + lane];
+	}
+}
+
+inline void addTriangles(const Scene* scene, unsigned int first, int mask, Scene* culled)
+{
+	while (mask != 0)
+	{
+		unsigned long lane;
+		_BitScanForward(&lane, mask);
+		mask &= mask - 1;
+
+		culled->triangleContainer[culled->numTriangles++] = scene->triangleContainer[first + lane];
+	}
+}
+
+// fill in the culled copy with the scene's spheres and triangles that are (at least partly) inside the frustum
+void cullScene(const Scene* scene, const Frustum* frustum, Scene* culled)
+{
+	culled->numSpheres = 0;
+	culled->numTriangles = 0;
+
+	if (scene->bvhNodes != NULL)
+	{
+		// walk the BVH, skipping nodes that are outside the frustum, and testing the primitives of the leaves that aren't
+		unsigned int stack[BVH_MAX_DEPTH + 1];
+		int stackSize = 0;
+		stack[stackSize++] = 0;
+
+		while (stackSize > 0)
+		{
+			const BVHNode* node = &scene->bvhNodes[stack[--stackSize]];
+			if (!isBoxInFrustum(frustum, node->bounds)) continue;
+
+			if (node->numSpheres + node->numTriangles > 0)
+			{
+				for (unsigned int i = node->firstSphere; i < node->firstSphere + node->numSpheres; ++i)
+				{
+					if (isSphereInFrustum(frustum, scene->sphereContainer[i])) culled->sphereContainer[culled->numSpheres++] = scene->sphereContainer[i];
+				}
+				for (unsigned int i = node->firstTriangle; i < node->firstTriangle + node->numTriangles; ++i)
+				{
+					if (isTriangleInFrustum(frustum, scene->triangleContainer[i])) culled->triangleContainer[culled->numTriangles++] = scene->triangleContainer[i];
+				}
+			}
+			else
+			{
+				stack[stackSize++] = node->right;
+				stack[stackSize++] = node->left;
+			}
+		}
+	}
+	else
+	{
+		// test the SoA spheres and triangles 8 at a time
+		Vector8 origin(frustum->origin.x, frustum->origin.y, frustum->origin.z);
+		Vector8 normals[4];
+		for (int i = 0; i < 4; ++i) normals[i] = Vector8(frustum->normals[i].x, frustum->normals[i].y, frustum->normals[i].z);
+		const __m256 zeros = _mm256_setzero_ps();
+		const __m256i eights = _mm256_set1_epi32(8);
+
+		// index of each lane (so the padding lanes past the end can be left out)
+		__m256i ijs = _mm256_setr_epi32(0, 1, 2, 3, 4, 5, 6, 7);
+		const __m256i numSpheres = _mm256_set1_epi32(scene->numSpheres);
+		for (unsigned int i = 0; i < scene->numSpheresSIMD; ++i)
+		{
+			Vector8 offset = Vector8(scene->spherePosX[i], scene->spherePosY[i], scene->spherePosZ[i]) - origin;
+			__m256 negSizes = zeros - scene->sphereSize[i];
+
+			__m256 inside = _mm256_castsi256_ps(_mm256_cmpgt_epi32(numSpheres, ijs));
+			for (int j = 0; j < 4; ++j) inside = inside & (dot(normals[j], offset) >= negSizes);
+
+			addSpheres(scene, i * 8, _mm256_movemask_ps(inside), culled);
+			ijs = _mm256_add_epi32(ijs, eights);
+		}
+
+		ijs = _mm256_setr_epi32(0, 1, 2, 3, 4, 5, 6, 7);
+		const __m256i numTriangles = _mm256_set1_epi32(scene->numTriangles);
+		for (unsigned int i = 0; i < scene->numTrianglesSIMD; ++i)
+		{
+			Vector8 offset1 = Vector8(scene->triangle1X[i], scene->triangle1Y[i], scene->triangle1Z[i]) - origin;
+			Vector8 offset2 = offset1 + Vector8(scene->triangleEdge1X[i], scene->triangleEdge1Y[i], scene->triangleEdge1Z[i]);
+			Vector8 offset3 = offset1 + Vector8(scene->triangleEdge2X[i], scene->triangleEdge2Y[i], scene->triangleEdge2Z[i]);
+
+			__m256 inside = _mm256_castsi256_ps(_mm256_cmpgt_epi32(numTriangles, ijs));
+			for (int j = 0; j < 4; ++j) inside = inside & ((dot(normals[j], offset1) >= zeros) | (dot(normals[j], offset2) >= zeros) | (dot(normals[j], offset3) >= zeros));
+
+			addTriangles(scene, i * 8, _mm256_movemask_ps(inside), culled);
+			ijs = _mm256_add_epi32(ijs, eights);
+		}
+	}
+
+	// make the SoA copies of the spheres and triangles that are left (padded with copies of the last one, like the scene's own)
+	const unsigned int valuesPerVector = sizeof(__m256) / sizeof(float);
+	culled->numSpheresSIMD = culled->numSpheres == 0 ? 0 : (culled->numSpheres - 1) / valuesPerVector + 1;
+	for (unsigned int i = 0; i < culled->numSpheresSIMD * valuesPerVector; ++i)
+	{
+		const Sphere& sphere = culled->sphereContainer[i < culled->numSpheres ? i : culled->numSpheres - 1];
+		culled->spherePosX[i / valuesPerVector].m256_f32[i % valuesPerVector] = sphere.pos.x;
+		culled->spherePosY[i / valuesPerVector].m256_f32[i % valuesPerVector] = sphere.pos.y;
+		culled->spherePosZ[i / valuesPerVector].m256_f32[i % valuesPerVector] = sphere.pos.z;
+		culled->sphereSize[i / valuesPerVector].m256_f32[i % valuesPerVector] = sphere.size;
+	}
+
+	culled->numTrianglesSIMD = culled->numTriangles == 0 ? 0 : (culled->numTriangles - 1) / valuesPerVector + 1;
+	for (unsigned int i = 0; i < culled->numTrianglesSIMD * valuesPerVector; ++i)
+	{
+		const Triangle& triangle = culled->triangleContainer[i < culled->numTriangles ? i : culled->numTriangles - 1];
+		Vector edge1 = triangle.p2 - triangle.p1, edge2 = triangle.p3 - triangle.p1;
+		culled->triangle1X[i / valuesPerVector].m256_f32[i % valuesPerVector] = triangle.p1.x;
+		culled->triangle1Y[i / valuesPerVector].m256_f32[i % valuesPerVector] = triangle.p1.y;
+		culled->triangle1Z[i / valuesPerVector].m256_f32[i % valuesPerVector] = triangle.p1.z;
+		culled->triangleEdge1X[i / valuesPerVector].m256_f32[i % valuesPerVector] = edge1.x;
+		culled->triangleEdge1Y[i / valuesPerVector].m256_f32[i % valuesPerVector] = edge1.y;
+		culled->triangleEdge1Z[i / valuesPerVector].m256_f32[i % valuesPerVector] = edge1.z;
+		culled->triangleEdge2X[i / valuesPerVector].m256_f32[i % valuesPerVector] = edge2.x;
+		culled->triangleEdge2Y[i / valuesPerVector].m256_f32[i % valuesPerVector] = edge2.y;
+		culled->triangleEdge2Z[i / valuesPerVector].m256_f32[i % valuesPerVector] = edge2.z;
+	}
+}
@@ -0,0 +1,31 @@
+// per block view frustum culling
+// each block's view rays only need to be tested against the spheres and triangles that can be seen through the block
+
+#ifndef __FRUSTUM_H
+#define __FRUSTUM_H
+
+#include "Scene.h"
+#include "Camera.h"
+
+// the four planes through the camera position and the edges of a block of pixels
+// a point is inside the frustum when it's on the positive side of all four planes (normals are normalised)
+typedef struct Frustum
+{
+	Point origin;
+	Vector normals[4];
+} Frustum;
+
+// frustum containing all of the view rays through the pixels from (xMin, yMin) to (xMax, yMax) (in pixels from the centre)
+Frustum blockFrustum(const Camera* camera, const int xMin, const int xMax, const int yMin, const int yMax);
+
+// make space for a culled copy of the scene (big enough for all of its spheres and triangles)
+// the copy shares everything but the spheres and triangles with the scene, and is always searched linearly
+void initCulledScene(const Scene* scene, Scene* culled);
+
+// fill in the culled copy with the scene's spheres and triangles that are (at least partly) inside the frustum
+// uses the scene's BVH to find them if it has one, otherwise tests all of the SoA spheres and triangles 8 at a time
+void cullScene(const Scene* scene, const Frustum* frustum, Scene* culled);
+
+void freeCulledScene(Scene* culled);
+
+#endif // __FRUSTUM_H
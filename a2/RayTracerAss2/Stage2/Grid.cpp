@@ -0,0 +1,341 @@
+// uniform grid construction and 3D-DDA traversal
+// see: http://www.cse.yorku.ca/~amana/research/grid.pdf
+// see: https://www.pbr-book.org/3ed-2018/Primitives_and_Intersection_Acceleration (grids are discussed as an alternative to BVHs)
+
+#include "Grid.h"
+#include "BVH.h"
+#include <algorithm>
+#include <cfloat>
+#include <cmath>
+#include <cstring>
+
+// target number of grid cells per object
+const float GRID_DENSITY = 2.0f;
+
+// maximum number of cells along any one axis
+const int GRID_MAX_RESOLUTION = 256;
+
+// grid bounds are padded slightly so that objects touching the edge of the scene are always inside a cell
+const float GRID_PADDING = 1e-3f;
+
+
+// ---- helpers ----
+
+// index of a cell in the per-cell arrays
+inline int cellIndex(const Grid* grid, const int cell[3])
+{
+	return (cell[2] * grid->resY + cell[1]) * grid->resX + cell[0];
+}
+
+// find the cell containing a point (clamped to the grid)
+inline void findCell(const Grid* grid, const Point& p, int cell[3])
+{
+	const int res[3] = { grid->resX, grid->resY, grid->resZ };
+
+	for (int axis = 0; axis < 3; ++axis)
+	{
+		int c = int((component(p, axis) - component(grid->min, axis)) * component(grid->invCellSize, axis));
+		cell[axis] = std::min(std::max(c, 0), res[axis] - 1);
+	}
+}
+
+
+// ---- building ----
+
+// helper to loop over every cell overlapped by a box
+template <typename CellFunction>
+static void forEachCell(const Grid* grid, const AABB& box, CellFunction function)
+{
+	int lo[3], hi[3];
+	findCell(grid, box.min, lo);
+	findCell(grid, box.max, hi);
+
+	int cell[3];
+	for (cell[2] = lo[2]; cell[2] <= hi[2]; ++cell[2])
+	{
+		for (cell[1] = lo[1]; cell[1] <= hi[1]; ++cell[1])
+		{
+			for (cell[0] = lo[0]; cell[0] <= hi[0]; ++cell[0])
+			{
+				function(cellIndex(grid, cell));
+			}
+		}
+	}
+}
+
+
+// convert per-cell object counts into offsets of each cell's first object (and return the total number of objects)
+static unsigned int countsToOffsets(const unsigned int* counts, unsigned int* offsets, int numCells)
+{
+	offsets[0] = 0;
+	for (int i = 0; i < numCells; ++i)
+	{
+		offsets[i + 1] = offsets[i] + counts[i];
+	}
+
+	return offsets[numCells];
+}
+
+
+// build a uniform grid over all of the scene's spheres and triangles
+void buildGrid(Scene& scene)
+{
+	Grid* grid = new Grid;
+	scene.grid = grid;
+
+	// find bounds of everything in the scene
+	AABB bounds = emptyBox();
+
+	for (unsigned int i = 0; i < scene.numSpheres; ++i) growBox(bounds, sphereBounds(scene.sphereContainer[i]));
+	for (unsigned int i = 0; i < scene.numTriangles; ++i) growBox(bounds, triangleBounds(scene.triangleContainer[i]));
+
+	// empty scene
+	if (scene.numSpheres + scene.numTriangles == 0)
+	{
+		bounds.min = bounds.max = { 0.0f, 0.0f, 0.0f };
+	}
+
+	Vector padding = { GRID_PADDING, GRID_PADDING, GRID_PADDING };
+	grid->min = bounds.min - padding;
+	grid->max = bounds.max + padding;
+
+	// choose a resolution so that cells are roughly cubes and there are GRID_DENSITY cells per object
+	// (flat scenes would have zero volume, so very thin axes are treated as being a bit thicker)
+	Vector extent = grid->max - grid->min;
+	float largest = std::max(std::max(extent.x, extent.y), extent.z);
+	float volume = std::max(extent.x, largest * 0.01f) * std::max(extent.y, largest * 0.01f) * std::max(extent.z, largest * 0.01f);
+	float cellsPerUnit = cbrtf(GRID_DENSITY * (scene.numSpheres + scene.numTriangles) / volume);
+
+	grid->resX = std::min(std::max(int(extent.x * cellsPerUnit), 1), GRID_MAX_RESOLUTION);
+	grid->resY = std::min(std::max(int(extent.y * cellsPerUnit), 1), GRID_MAX_RESOLUTION);
+	grid->resZ = std::min(std::max(int(extent.z * cellsPerUnit), 1), GRID_MAX_RESOLUTION);
+
+	grid->cellSize = { extent.x / grid->resX, extent.y / grid->resY, extent.z / grid->resZ };
+	grid->invCellSize = { 1.0f / grid->cellSize.x, 1.0f / grid->cellSize.y, 1.0f / grid->cellSize.z };
+
+	int numCells = grid->resX * grid->resY * grid->resZ;
+
+	// count how many spheres and triangles overlap each cell
+	unsigned int* sphereCounts = new unsigned int[numCells];
+	unsigned int* triangleCounts = new unsigned int[numCells];
+	memset(sphereCounts, 0, sizeof(unsigned int) * numCells);
+	memset(triangleCounts, 0, sizeof(unsigned int) * numCells);
+
+	for (unsigned int i = 0; i < scene.numSpheres; ++i)
+	{
+		forEachCell(grid, sphereBounds(scene.sphereContainer[i]), [&](int cell) { sphereCounts[cell]++; });
+	}
+
+	for (unsigned int i = 0; i < scene.numTriangles; ++i)
+	{
+		forEachCell(grid, triangleBounds(scene.triangleContainer[i]), [&](int cell) { triangleCounts[cell]++; });
+	}
+
+	grid->cellSpheres = new unsigned int[numCells + 1];
+	grid->cellTriangles = new unsigned int[numCells + 1];
+
+	// the cells only need their own spheres and triangles (and the SoA copies of them that the intersection kernels use)
+	Scene& cells = grid->cells;
+	memset(&cells, 0, sizeof(Scene));
+	cells.accelerator = Scene::LINEAR;
+	cells.numSpheres = countsToOffsets(sphereCounts, grid->cellSpheres, numCells);
+	cells.numTriangles = countsToOffsets(triangleCounts, grid->cellTriangles, numCells);
+	cells.sphereContainer = new Sphere[cells.numSpheres];
+	cells.triangleContainer = new Triangle[cells.numTriangles];
+	grid->sphereIndex = new unsigned int[cells.numSpheres];
+	grid->triangleIndex = new unsigned int[cells.numTriangles];
+
+	// fill in the cells (reusing the counts to track how full each cell is)
+	memset(sphereCounts, 0, sizeof(unsigned int) * numCells);
+	memset(triangleCounts, 0, sizeof(unsigned int) * numCells);
+
+	for (unsigned int i = 0; i < scene.numSpheres; ++i)
+	{
+		forEachCell(grid, sphereBounds(scene.sphereContainer[i]), [&](int cell)
+		{
+			unsigned int slot = grid->cellSpheres[cell] + sphereCounts[cell]++;
+			cells.sphereContainer[slot] = scene.sphereContainer[i];
+			grid->sphereIndex[slot] = i;
+		});
+	}
+
+	for (unsigned int i = 0; i < scene.numTriangles; ++i)
+	{
+		forEachCell(grid, triangleBounds(scene.triangleContainer[i]), [&](int cell)
+		{
+			unsigned int slot = grid->cellTriangles[cell] + triangleCounts[cell]++;
+			cells.triangleContainer[slot] = scene.triangleContainer[i];
+			grid->triangleIndex[slot] = i;
+		});
+	}
+
+	delete[] sphereCounts;
+	delete[] triangleCounts;
+
+	simdifySceneContainers(cells);
+}
+
+
+// ---- traversal ----
+
+// state of a 3D-DDA walk through the grid
+typedef struct GridWalk
+{
+	int cell[3];			// current cell
+	int step[3];			// direction to step along each axis (-1, 0, or 1)
+	int end[3];				// cell index along each axis that means the walk has left the grid
+	float tNext[3];			// time at which the ray crosses the next cell boundary along each axis
+	float tDelta[3];		// time it takes the ray to cross a whole cell along each axis
+	float tExit;			// time at which the ray leaves the grid
+} GridWalk;
+
+
+// set up a walk along a ray, returns false if the ray misses the grid entirely (or enters it after time t)
+static bool startWalk(const Grid* grid, const Ray* r, float t, GridWalk* walk)
+{
+	const int res[3] = { grid->resX, grid->resY, grid->resZ };
+
+	// find where the ray enters and leaves the grid (slab test)
+	float tEnter = 0.0f;
+	walk->tExit = t;
+
+	for (int axis = 0; axis < 3; ++axis)
+	{
+		float start = component(r->start, axis), dir = component(r->dir, axis);
+		float min = component(grid->min, axis), max = component(grid->max, axis);
+
+		if (dir == 0.0f)
+		{
+			// parallel to this axis' slab, so must start inside it
+			if (start < min || start > max) return false;
+		}
+		else
+		{
+			float t0 = (min - start) / dir, t1 = (max - start) / dir;
+			tEnter = std::max(tEnter, std::min(t0, t1));
+			walk->tExit = std::min(walk->tExit, std::max(t0, t1));
+		}
+	}
+
+	if (tEnter > walk->tExit) return false;
+
+	// find the starting cell and how the ray moves through the cells
+	findCell(grid, r->start + r->dir * tEnter, walk->cell);
+
+	for (int axis = 0; axis < 3; ++axis)
+	{
+		float start = component(r->start, axis), dir = component(r->dir, axis);
+		float min = component(grid->min, axis), size = component(grid->cellSize, axis);
+
+		if (dir > 0.0f)
+		{
+			walk->step[axis] = 1;
+			walk->end[axis] = res[axis];
+			walk->tNext[axis] = (min + (walk->cell[axis] + 1) * size - start) / dir;
+			walk->tDelta[axis] = size / dir;
+		}
+		else if (dir < 0.0f)
+		{
+			walk->step[axis] = -1;
+			walk->end[axis] = -1;
+			walk->tNext[axis] = (min + walk->cell[axis] * size - start) / dir;
+			walk->tDelta[axis] = -size / dir;
+		}
+		else
+		{
+			walk->step[axis] = 0;
+			walk->end[axis] = -1;
+			walk->tNext[axis] = FLT_MAX;
+			walk->tDelta[axis] = FLT_MAX;
+		}
+	}
+
+	return true;
+}
+
+
+// move the walk into the next cell, returns false if the ray has left the grid
+// tCellExit receives the time at which the ray left the previous cell
+static __forceinline bool stepWalk(GridWalk* walk, float* tCellExit)
+{
+	// step along whichever axis has the closest cell boundary
+	int axis = walk->tNext[0] < walk->tNext[1] ? (walk->tNext[0] < walk->tNext[2] ? 0 : 2) : (walk->tNext[1] < walk->tNext[2] ? 1 : 2);
+
+	*tCellExit = walk->tNext[axis];
+	if (*tCellExit > walk->tExit) return false;
+
+	walk->cell[axis] += walk->step[axis];
+	if (walk->cell[axis] == walk->end[axis]) return false;
+
+	walk->tNext[axis] += walk->tDelta[axis];
+
+	return true;
+}
+
+
+// test to see if collision between ray and any object in the scene's grid happens before time t
+// objects can overlap several cells, so a collision found in a cell only ends the walk if it is inside that cell
+bool isGridIntersected(const Scene* scene, const Ray* r, float* t, Intersection* intersect)
+{
+	const Grid* grid = scene->grid;
+	float tInitial = *t;
+
+	GridWalk walk;
+	if (!startWalk(grid, r, *t, &walk)) return false;
+
+	float tCellExit;
+	do
+	{
+		int cell = cellIndex(grid, walk.cell);
+		unsigned int firstSphere = grid->cellSpheres[cell], numSpheres = grid->cellSpheres[cell + 1] - firstSphere;
+		unsigned int firstTriangle = grid->cellTriangles[cell], numTriangles = grid->cellTriangles[cell + 1] - firstTriangle;
+		int index;
+
+		if (numSpheres > 0 && isSphereRangeIntersected(&grid->cells, r, firstSphere, numSpheres, t, &index))
+		{
+			intersect->objectType = Intersection::SPHERE;
+			intersect->sphere = &scene->sphereContainer[grid->sphereIndex[index]];
+		}
+
+		if (numTriangles > 0 && isTriangleRangeIntersected(&grid->cells, r, firstTriangle, numTriangles, t, &index))
+		{
+			intersect->objectType = Intersection::TRIANGLE;
+			intersect->triangle = &scene->triangleContainer[grid->triangleIndex[index]];
+		}
+	} while (stepWalk(&walk, &tCellExit) && tCellExit < *t);
+
+	return *t < tInitial;
+}
+
+
+// short-circuiting version of grid intersection test that only returns true/false
+bool isGridIntersected(const Scene* scene, const Ray* r, float t, Occluder* occluder)
+{
+	const Grid* grid = scene->grid;
+
+	GridWalk walk;
+	if (!startWalk(grid, r, t, &walk)) return false;
+
+	float tCellExit;
+	do
+	{
+		int cell = cellIndex(grid, walk.cell);
+		unsigned int firstSphere = grid->cellSpheres[cell], numSpheres = grid->cellSpheres[cell + 1] - firstSphere;
+		unsigned int firstTriangle = grid->cellTriangles[cell], numTriangles = grid->cellTriangles[cell + 1] - firstTriangle;
+
+		// (the occluder's index is into the cells' copies, so is mapped back to the scene's)
+		if (numSpheres > 0 && isSphereRangeIntersected(&grid->cells, r, firstSphere, numSpheres, t, occluder))
+		{
+			if (occluder != NULL) occluder->index = grid->sphereIndex[occluder->index];
+			return true;
+		}
+
+		if (numTriangles > 0 && isTriangleRangeIntersected(&grid->cells, r, firstTriangle, numTriangles, t, occluder))
+		{
+			if (occluder != NULL) occluder->index = grid->triangleIndex[occluder->index];
+			return true;
+		}
+	} while (stepWalk(&walk, &tCellExit));
+
+	return false;
+}
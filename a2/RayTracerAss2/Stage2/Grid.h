@@ -0,0 +1,39 @@
+// uniform grid used to accelerate ray/primitive intersection tests (best suited to lots of similarly sized objects)
+
+#ifndef __GRID_H
+#define __GRID_H
+
+#include "Scene.h"
+#include "Intersection.h"
+
+// a uniform grid of cells over the scene's bounds
+// the spheres and triangles that overlap each cell are copied into cells, one cell after another (with its own SoA copies),
+// so each cell is a contiguous range that the intersection kernels test just like a BVH leaf
+typedef struct Grid
+{
+	Point min, max;								// bounds of the grid
+	Vector cellSize, invCellSize;				// size of each cell (and its inverse)
+	int resX, resY, resZ;						// number of cells along each axis
+
+	Scene cells;								// (only the spheres and triangles, and their SoA copies, are filled in)
+
+	// cell i's spheres are cells.sphereContainer[cellSpheres[i]] up to cells.sphereContainer[cellSpheres[i + 1]]
+	unsigned int* cellSpheres;
+	unsigned int* sphereIndex;					// index of each of them in the scene's sphereContainer
+
+	// cell i's triangles are cells.triangleContainer[cellTriangles[i]] up to cells.triangleContainer[cellTriangles[i + 1]]
+	unsigned int* cellTriangles;
+	unsigned int* triangleIndex;				// index of each of them in the scene's triangleContainer
+} Grid;
+
+// build a uniform grid over all of the scene's spheres and triangles (with roughly GRID_DENSITY cells per object)
+void buildGrid(Scene& scene);
+
+// test to see if collision between ray and any object in the scene's grid happens before time t
+// updates closest collision time (/distance) and intersection's object if collision occurs
+bool isGridIntersected(const Scene* scene, const Ray* r, float* t, Intersection* intersect);
+
+// short circuiting version of grid intersections
+bool isGridIntersected(const Scene* scene, const Ray* r, float t, Occluder* occluder = NULL);
+
+#endif // __GRID_H
@@ -0,0 +1,97 @@
+// top level hierarchy construction for instanced models
+// there are only ever a few hundred instances, so a simple median split is plenty
+
+#include "Instance.h"
+#include <algorithm>
+
+// leaves have this many (or fewer) instances
+const unsigned int TLAS_LEAF_SIZE = 2;
+
+
+// find the world space bounds of an instance (by moving the corners of its model's bounds into world space)
+static void findInstanceBounds(Instance& instance)
+{
+	const Scene* model = instance.model;
+
+	if (model->numBVHNodes == 0)
+	{
+		// empty model, so it can't be hit
+		instance.min = instance.max = instance.center;
+		return;
+	}
+
+	const AABB& local = model->bvhNodes[0].bounds;
+	AABB bounds = emptyBox();
+
+	for (int i = 0; i < 8; ++i)
+	{
+		Point corner = { (i & 1) ? local.max.x : local.min.x, (i & 2) ? local.max.y : local.min.y, (i & 4) ? local.max.z : local.min.z };
+		growBox(bounds, fromInstanceSpace(&instance, corner));
+	}
+
+	instance.min = bounds.min;
+	instance.max = bounds.max;
+}
+
+
+// recursively build the node for the instances in [begin, end), returns the index of the node
+static unsigned int buildTLASNode(Scene& scene, unsigned int begin, unsigned int end, unsigned int& numNodes)
+{
+	unsigned int nodeIndex = numNodes++;
+	TLASNode& node = scene.tlasNodes[nodeIndex];
+	Instance* instances = scene.instanceContainer;
+
+	// bounds of everything in this node (and of their centres)
+	AABB centres = emptyBox();
+	node.bounds = emptyBox();
+	for (unsigned int i = begin; i < end; ++i)
+	{
+		AABB bounds = { instances[i].min, instances[i].max };
+		growBox(node.bounds, bounds);
+		growBox(centres, centroid(bounds));
+	}
+
+	if (end - begin <= TLAS_LEAF_SIZE)
+	{
+		node.left = node.right = 0;
+		node.firstInstance = begin;
+		node.numInstances = end - begin;
+		return nodeIndex;
+	}
+
+	// split in half along the axis the centres are most spread out along
+	Vector extent = centres.max - centres.min;
+	int axis = extent.x > extent.y && extent.x > extent.z ? 0 : (extent.y > extent.z ? 1 : 2);
+	unsigned int middle = (begin + end) / 2;
+
+	std::nth_element(instances + begin, instances + middle, instances + end, [axis](const Instance& a, const Instance& b)
+	{
+		float centreA = axis == 0 ? a.min.x + a.max.x : (axis == 1 ? a.min.y + a.max.y : a.min.z + a.max.z);
+		float centreB = axis == 0 ? b.min.x + b.max.x : (axis == 1 ? b.min.y + b.max.y : b.min.z + b.max.z);
+		return centreA < centreB;
+	});
+
+	node.firstInstance = node.numInstances = 0;
+	node.left = buildTLASNode(scene, begin, middle, numNodes);
+	node.right = buildTLASNode(scene, middle, end, numNodes);
+
+	return nodeIndex;
+}
+
+
+// build the top level hierarchy over all of the scene's instances
+void buildTLAS(Scene& scene)
+{
+	scene.numTLASNodes = 0;
+	scene.tlasNodes = NULL;
+
+	if (scene.numInstances == 0) return;
+
+	for (unsigned int i = 0; i < scene.numInstances; ++i)
+	{
+		findInstanceBounds(scene.instanceContainer[i]);
+	}
+
+	scene.tlasNodes = new TLASNode[2 * scene.numInstances - 1];
+	buildTLASNode(scene, 0, scene.numInstances, scene.numTLASNodes);
+}
@@ -0,0 +1,23 @@
+// two level hierarchy for instanced models
+// each instanced model has its own BVH (the bottom level) built in object space, and the top level hierarchy is over the instances
+
+#ifndef __INSTANCE_H
+#define __INSTANCE_H
+
+#include "Scene.h"
+#include "BVH.h"
+
+// a single node of the top level hierarchy
+// interior nodes have two children, leaves have a (contiguous) range of instances
+typedef struct TLASNode
+{
+	AABB bounds;								// bounds of everything below this node (in world space)
+	unsigned int left, right;					// child node indexes (interior nodes only)
+	unsigned int firstInstance, numInstances;	// range of instances in instanceContainer (leaves only)
+} TLASNode;
+
+// build the top level hierarchy over all of the scene's instances
+// reorders instanceContainer, and needs the bounds of each model, so must be called after each model's BVH is built
+void buildTLAS(Scene& scene);
+
+#endif // __INSTANCE_H
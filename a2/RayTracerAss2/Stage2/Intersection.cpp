@@ -5,405 +5,886 @@
 #include "Intersection.h"
 #include <immintrin.h>
 #include "PrimitivesSIMD.h"
+#include "BVH.h"
+#include "Grid.h"
+#include "Instance.h"
+#include "IntersectionKernels.h"
 
 
-	// helper function to find "horizontal" minimum (and corresponding index value from another vector)
-__forceinline void selectMinimumAndIndex(__m256 values, __m256i indexes, float* min, int* index)
+// the kernels everything uses (see selectIntersectionKernels())
+static const IntersectionKernels* kernels = &avx2Kernels;
+
+
+// use the intersection kernels for an instruction set from now on
+void selectIntersectionKernels(const InstructionSet isa)
 {
-	// find min of elements 1&2, 3&4, 5&6, and 7&8
-	__m256 minNeighbours = _mm256_min_ps(values, _mm256_permute_ps(values, 0x31));
-	// find min of min(1,2)&min(5,6) and min(3,4)&min(7,8)
-	__m256 minNeighbours2 = _mm256_min_ps(minNeighbours, _mm256_permute2f128_ps(minNeighbours, minNeighbours, 0x05));
-	// find final minimum 
-	__m256 mins = _mm256_min_ps(minNeighbours2, _mm256_permute_ps(minNeighbours2, 0x02));
+	switch (isa)
+	{
+	case ISA_SSE42:
+		kernels = &sse42Kernels;
+		break;
+	case ISA_AVX2:
+		kernels = &avx2Kernels;
+		break;
+	default:
+		kernels = &avx512Kernels;
+		break;
+	}
+}
+
 
-	// find all elements that match our minimum
-	__m256i matchingTs = _mm256_castps_si256(_mm256_set1_ps(mins.m256_f32[0]) != values);
-	// set all other elements to be MAX_INT (-1 but unsigned)
-	__m256i matchingIndexes = matchingTs | indexes;
+// the whole scene sphere and triangle tests (and the range tests used for BVH leaves) just go through the selected kernels
+// (see IntersectionKernelsSIMD.h for how they work)
+bool isSphereIntersected(const Scene* scene, const Ray* r, float* t, int* index)
+{
+	return kernels->spheres(scene, r, t, index);
+}
 
-	// find minimum of remaining indexes (so smallest index will be chosen) using that same technique as above but with heaps of ugly casts
-	__m256i minIndexNeighbours = _mm256_min_epu32(matchingIndexes, _mm256_castps_si256(_mm256_permute_ps(_mm256_castsi256_ps(matchingIndexes), 0x31)));
-	__m256i minIndexNeighbours2 = _mm256_min_epu32(minIndexNeighbours, _mm256_castps_si256(_mm256_permute2f128_ps(
-		_mm256_castsi256_ps(minIndexNeighbours), _mm256_castsi256_ps(minIndexNeighbours), 0x05)));
-	__m256i minIndex = _mm256_min_epu32(minIndexNeighbours2, _mm256_castps_si256(_mm256_permute_ps(_mm256_castsi256_ps(minIndexNeighbours2), 0x02)));
 
-	// "return" minimum and associated index through reference parameters
-	*min = mins.m256_f32[0];
-	*index = minIndex.m256i_i32[0];
+bool isSphereIntersected(const Scene* scene, const Ray* r, float t, Occluder* occluder)
+{
+	return kernels->spheresShort(scene, r, t, occluder);
 }
 
-// test to see if collision between ray and a plane happens before time t (equivalent to distance)
-// updates closest collision time (/distance) if collision occurs
-// see: http://en.wikipedia.org/wiki/Line-sphere_intersection
-// see: http://www.codermind.com/articles/Raytracer-in-C++-Part-I-First-rays.html
-// see: Step 8 of http://meatfighter.com/juggler/ 
-// this code make heavy use of constant term removal due to ray always being a unit vector
-bool isSphereIntersected(const Scene* scene, const Ray* r, float* t, int* index)
+
+bool isTriangleIntersected(const Scene* scene, const Ray* r, float* t, int* index)
 {
-	float tInitial = *t;
+	return kernels->triangles(scene, r, t, index);
+}
 
-	// ray start and direction
-	Vector8 rStart(r->start.x, r->start.y, r->start.z);
-	Vector8 rDir(r->dir.x, r->dir.y, r->dir.z);
 
-	// constants
-	const __m256 epsilons = _mm256_set1_ps(EPSILON);
-	const __m256 zeros = _mm256_set1_ps(0.0f);
-	const __m256i eights = _mm256_set1_epi32(8);
+bool isTriangleIntersected(const Scene* scene, const Ray* r, float t, Occluder* occluder)
+{
+	return kernels->trianglesShort(scene, r, t, occluder);
+}
 
-	// best ts found so far and associated triangle indexes
-	__m256 ts = _mm256_set1_ps(tInitial);
-	__m256i indexes = _mm256_set1_epi32(*index);
 
-	// current corresponding index
-	__m256i ijs = _mm256_setr_epi32(0, 1, 2, 3, 4, 5, 6, 7);
+bool isSphereRangeIntersected(const Scene* scene, const Ray* r, unsigned int first, unsigned int count, float* t, int* index)
+{
+	return kernels->sphereRange(scene, r, first, count, t, index);
+}
 
-	// search for sphere collisions, storing closest one found
-	for (unsigned int i = 0; i < scene->numSpheresSIMD; ++i)
-	{
-		//Sphere& sphere = scene.sphereContainer[i * 8 + j];
-		Vector8 pos(scene->spherePosX[i], scene->spherePosY[i], scene->spherePosZ[i]);
-		__m256 sizes = scene->sphereSize[i];
 
-		// Vector dist = pos - r.start;
-		Vector8 dist = pos - rStart;
+bool isSphereRangeIntersected(const Scene* scene, const Ray* r, unsigned int first, unsigned int count, float t, Occluder* occluder)
+{
+	return kernels->sphereRangeShort(scene, r, first, count, t, occluder);
+}
 
-		// float B = r.dir * dist;
-		__m256 Bs = dot(rDir, dist);
 
-		// float D = B * B - dist * dist + size * size;
-		__m256 Ds = Bs * Bs - dot(dist, dist) + sizes * sizes;
+bool isTriangleRangeIntersected(const Scene* scene, const Ray* r, unsigned int first, unsigned int count, float* t, int* index)
+{
+	return kernels->triangleRange(scene, r, first, count, t, index);
+}
 
-		// if D < 0, no intersection, so don't try and calculate the point of intersection
-		//if (D < 0.0f) continue;
-		__m256 DLessThanZeros = Ds < zeros;
 
-		// calculate both intersection times(/distances)
-		//float t0 = B - sqrtf(D);
-		//float t1 = B + sqrtf(D);
-		__m256 sqrtDs = _mm256_sqrt_ps(Ds);
-		__m256 t0s = Bs - sqrtDs;
-		__m256 t1s = Bs + sqrtDs;
+bool isTriangleRangeIntersected(const Scene* scene, const Ray* r, unsigned int first, unsigned int count, float t, Occluder* occluder)
+{
+	return kernels->triangleRangeShort(scene, r, first, count, t, occluder);
+}
 
-		// check to see if either of the two sphere collision points are closer than time parameter
-		//if ((t1 > EPSILON) && (t1 < t))
-		__m256 t1GreaterThanEpsilonAndSmallerThanTs = (t1s > epsilons) & (t1s < ts);
-		//else if ((t0 > EPSILON) && (t0 < t))
-		__m256 t0GreaterThanEpsilonAndSmallerThanTs = (t0s > epsilons) & (t0s < ts);
 
-		// select best ts 
-		__m256 temp = select(t1GreaterThanEpsilonAndSmallerThanTs, t1s, ts);
-		__m256 temp2 = select(t0GreaterThanEpsilonAndSmallerThanTs, t0s, temp);
-		ts = select(DLessThanZeros, ts, temp2);
+// reciprocal of the ray direction (used by the slab test)
+// zero components are nudged away from zero so that the slab test never calculates 0 * infinity
+static __forceinline Vector inverseDirection(const Vector& dir)
+{
+	const float tiny = 1e-20f;
 
-		// select best corresponding sphere indexes
-		__m256i temp3 = select(_mm256_castps_si256(t1GreaterThanEpsilonAndSmallerThanTs), ijs, indexes);
-		__m256i temp4 = select(_mm256_castps_si256(t0GreaterThanEpsilonAndSmallerThanTs), ijs, temp3);
+	Vector invDir = {
+		1.0f / (fabsf(dir.x) > tiny ? dir.x : copysignf(tiny, dir.x)),
+		1.0f / (fabsf(dir.y) > tiny ? dir.y : copysignf(tiny, dir.y)),
+		1.0f / (fabsf(dir.z) > tiny ? dir.z : copysignf(tiny, dir.z)) };
 
-		indexes = select(_mm256_castps_si256(DLessThanZeros), indexes, temp4);
+	return invDir;
+}
 
-		// increase the index counters
-		ijs = _mm256_add_epi32(ijs, eights);
-	}
 
-	// extract the best t and corresponding triangle index
-	selectMinimumAndIndex(ts, indexes, t, index);
+// test to see if a ray enters a bounding box before time t (records the entry time if it does)
+// see: https://tavianator.com/2011/ray_box.html
+static __forceinline bool isBoxIntersected(const AABB& box, const Point& start, const Vector& invDir, float t, float* tEntry)
+{
+	float tx0 = (box.min.x - start.x) * invDir.x, tx1 = (box.max.x - start.x) * invDir.x;
+	float ty0 = (box.min.y - start.y) * invDir.y, ty1 = (box.max.y - start.y) * invDir.y;
+	float tz0 = (box.min.z - start.z) * invDir.z, tz1 = (box.max.z - start.z) * invDir.z;
 
-	return *t < tInitial;
+	float tNear = std::max(std::max(std::min(tx0, tx1), std::min(ty0, ty1)), std::min(tz0, tz1));
+	float tFar = std::min(std::min(std::max(tx0, tx1), std::max(ty0, ty1)), std::max(tz0, tz1));
+
+	*tEntry = tNear;
+
+	return tFar >= std::max(tNear, 0.0f) && tNear < t;
 }
 
 
-// short-circuiting version of sphere intersection test that only returns true/false
-bool isSphereIntersected(const Scene* scene, const Ray* r, float t)
+// test to see if collision between ray and any object below a node of the scene's BVH happens before time t
+// nearest child nodes are visited first so that the closest collision time can be used to skip further away nodes
+static bool isBVHSubtreeIntersected(const Scene* scene, const Ray* r, unsigned int root, float* t, Intersection* intersect)
 {
-	// ray start and direction
-	Vector8 rStart(r->start.x, r->start.y, r->start.z);
-	Vector8 rDir(r->dir.x, r->dir.y, r->dir.z);
+	float tInitial = *t;
+	Vector invDir = inverseDirection(r->dir);
 
-	// constants
-	const __m256 epsilons = _mm256_set1_ps(EPSILON);
-	const __m256 zeros = _mm256_set1_ps(0.0f);
+	// nodes still to be visited (and the time at which the ray enters them)
+	unsigned int stack[BVH_MAX_DEPTH + 1];
+	float stackEntry[BVH_MAX_DEPTH + 1];
+	int stackSize = 0;
 
-	// starting t
-	const __m256 ts = _mm256_set1_ps(t);
+	if (!isBoxIntersected(scene->bvhNodes[root].bounds, r->start, invDir, *t, &stackEntry[0])) return false;
+	stack[stackSize++] = root;
 
-	// search for sphere collisions, storing closest one found
-	for (unsigned int i = 0; i < scene->numSpheresSIMD; ++i)
+	while (stackSize > 0)
 	{
-		//Sphere& sphere = scene.sphereContainer[i * 8 + j];
-		Vector8 pos(scene->spherePosX[i], scene->spherePosY[i], scene->spherePosZ[i]);
-		__m256 sizes = scene->sphereSize[i];
+		--stackSize;
+
+		// skip nodes that are further away than a collision found since they were pushed
+		if (stackEntry[stackSize] >= *t) continue;
+
+		const BVHNode* node = &scene->bvhNodes[stack[stackSize]];
+
+		if (node->numSpheres + node->numTriangles > 0)
+		{
+			// leaf: test all of its primitives
+			int index;
+
+			if (node->numSpheres > 0 && isSphereRangeIntersected(scene, r, node->firstSphere, node->numSpheres, t, &index))
+			{
+				intersect->objectType = Intersection::SPHERE;
+				intersect->sphere = &scene->sphereContainer[index];
+			}
+
+			if (node->numTriangles > 0 && isTriangleRangeIntersected(scene, r, node->firstTriangle, node->numTriangles, t, &index))
+			{
+				intersect->objectType = Intersection::TRIANGLE;
+				intersect->triangle = &scene->triangleContainer[index];
+			}
+		}
+		else
+		{
+			// interior: push the children that are hit, further one first (so the nearer one is visited next)
+			float tLeft, tRight;
+			bool hitLeft = isBoxIntersected(scene->bvhNodes[node->left].bounds, r->start, invDir, *t, &tLeft);
+			bool hitRight = isBoxIntersected(scene->bvhNodes[node->right].bounds, r->start, invDir, *t, &tRight);
+
+			if (hitLeft && hitRight && tLeft < tRight)
+			{
+				stackEntry[stackSize] = tRight; stack[stackSize++] = node->right;
+				stackEntry[stackSize] = tLeft; stack[stackSize++] = node->left;
+			}
+			else
+			{
+				if (hitLeft) { stackEntry[stackSize] = tLeft; stack[stackSize++] = node->left; }
+				if (hitRight) { stackEntry[stackSize] = tRight; stack[stackSize++] = node->right; }
+			}
+		}
+	}
 
-		// Vector dist = pos - r.start;
-		Vector8 dist = pos - rStart;
+	return *t < tInitial;
+}
 
-		// float B = r.dir * dist;
-		__m256 Bs = dot(rDir, dist);
 
-		// float D = B * B - dist * dist + size * size;
-		__m256 Ds = Bs * Bs - dot(dist, dist) + sizes * sizes;
+// test to see if collision between ray and any object in the scene's BVH happens before time t
+bool isBVHIntersected(const Scene* scene, const Ray* r, float* t, Intersection* intersect)
+{
+	if (scene->numBVHNodes == 0) return false;
 
-		// if D < 0, no intersection, so don't try and calculate the point of intersection
-		//if (D < 0.0f) continue;
-		__m256 DLessThanZeros = Ds < zeros;
+	return isBVHSubtreeIntersected(scene, r, 0, t, intersect);
+}
+
+
+// short-circuiting version of BVH intersection test that only returns true/false
+// (and which primitive was hit, if an occluder is given)
+bool isBVHIntersected(const Scene* scene, const Ray* r, float t, Occluder* occluder)
+{
+	if (scene->numBVHNodes == 0) return false;
 
-		// calculate both intersection times(/distances)
-		//float t0 = B - sqrtf(D);
-		//float t1 = B + sqrtf(D);
-		__m256 sqrtDs = _mm256_sqrt_ps(Ds);
-		__m256 t0s = Bs - sqrtDs;
-		__m256 t1s = Bs + sqrtDs;
+	Vector invDir = inverseDirection(r->dir);
 
-		// check to see if either of the two sphere collision points are closer than time parameter
-		//if ((t1 > EPSILON) && (t1 < t))
-		__m256 t1GreaterThanEpsilonAndSmallerThanTs = (t1s > epsilons) & (t1s < ts);
-		//else if ((t0 > EPSILON) && (t0 < t))
-		__m256 t0GreaterThanEpsilonAndSmallerThanTs = (t0s > epsilons) & (t0s < ts);
+	// nodes still to be visited
+	unsigned int stack[BVH_MAX_DEPTH + 1];
+	int stackSize = 0;
+	float tEntry;
 
-		// combine all the success cases together
-		__m256 success = _mm256_andnot_ps(DLessThanZeros, t0GreaterThanEpsilonAndSmallerThanTs | t1GreaterThanEpsilonAndSmallerThanTs);
+	if (!isBoxIntersected(scene->bvhNodes[0].bounds, r->start, invDir, t, &tEntry)) return false;
+	stack[stackSize++] = 0;
 
-		// if any are successful, short-circuit
-		if (_mm256_movemask_ps(success)) return true;
+	while (stackSize > 0)
+	{
+		const BVHNode* node = &scene->bvhNodes[stack[--stackSize]];
+
+		if (node->numSpheres + node->numTriangles > 0)
+		{
+			if (node->numSpheres > 0 && isSphereRangeIntersected(scene, r, node->firstSphere, node->numSpheres, t, occluder)) return true;
+			if (node->numTriangles > 0 && isTriangleRangeIntersected(scene, r, node->firstTriangle, node->numTriangles, t, occluder)) return true;
+		}
+		else
+		{
+			if (isBoxIntersected(scene->bvhNodes[node->right].bounds, r->start, invDir, t, &tEntry)) stack[stackSize++] = node->right;
+			if (isBoxIntersected(scene->bvhNodes[node->left].bounds, r->start, invDir, t, &tEntry)) stack[stackSize++] = node->left;
+		}
 	}
 
 	return false;
 }
 
+// ---- packets of primary rays ----
+
+// flag for packet hits that are triangles (rather than spheres)
+const unsigned int PACKET_TRIANGLE = 0x80000000;
+const unsigned int PACKET_NONE = 0xFFFFFFFF;
+
+// test a box against 8 rays at once (slab test, as for the single ray version)
+// returns a mask of the rays that enter the box before their own time t
+static __forceinline int isBoxIntersected(const AABB& box, const Vector8& rStart, const Vector8& rInvDir, const __m256 ts)
+{
+	__m256 tx0 = (_mm256_set1_ps(box.min.x) - rStart.xs) * rInvDir.xs, tx1 = (_mm256_set1_ps(box.max.x) - rStart.xs) * rInvDir.xs;
+	__m256 ty0 = (_mm256_set1_ps(box.min.y) - rStart.ys) * rInvDir.ys, ty1 = (_mm256_set1_ps(box.max.y) - rStart.ys) * rInvDir.ys;
+	__m256 tz0 = (_mm256_set1_ps(box.min.z) - rStart.zs) * rInvDir.zs, tz1 = (_mm256_set1_ps(box.max.z) - rStart.zs) * rInvDir.zs;
+
+	__m256 tNears = _mm256_max_ps(_mm256_max_ps(_mm256_min_ps(tx0, tx1), _mm256_min_ps(ty0, ty1)), _mm256_min_ps(tz0, tz1));
+	__m256 tFars = _mm256_min_ps(_mm256_min_ps(_mm256_max_ps(tx0, tx1), _mm256_max_ps(ty0, ty1)), _mm256_max_ps(tz0, tz1));
+
+	return _mm256_movemask_ps((tFars >= _mm256_max_ps(tNears, _mm256_setzero_ps())) & (tNears < ts));
+}
+
 
-// short-circuiting version of sphere intersection test that only returns true/false
-// this version doesn't use helper functions from PrimitivesSIMD.h and is only included for reference
-/*bool isSphereIntersected(const Scene* scene, const Ray* r, float t)
+// test one sphere against 8 rays at once (the same sums as isSphereIntersected(), but the lanes hold rays rather than spheres)
+// updates the closest collision time and hit of each ray in the mask that hits the sphere
+static __forceinline void isSpherePacketIntersected(const Sphere& sphere, const unsigned int index, const Vector8& rStart, const Vector8& rDir, const int mask,
+	__m256* ts, __m256i* hits)
 {
-	// ray start and direction
-	const __m256 rStartxs = _mm256_set1_ps(r->start.x);
-	const __m256 rStartys = _mm256_set1_ps(r->start.y);
-	const __m256 rStartzs = _mm256_set1_ps(r->start.z);
-	const __m256 rDirxs = _mm256_set1_ps(r->dir.x);
-	const __m256 rDirys = _mm256_set1_ps(r->dir.y);
-	const __m256 rDirzs = _mm256_set1_ps(r->dir.z);
+	const __m256 epsilons = _mm256_set1_ps(EPSILON);
+	const __m256 active = _mm256_castsi256_ps(_mm256_cmpgt_epi32(_mm256_and_si256(_mm256_set1_epi32(mask), _mm256_setr_epi32(1, 2, 4, 8, 16, 32, 64, 128)), _mm256_setzero_si256()));
+
+	Vector8 dist = Vector8(sphere.pos.x, sphere.pos.y, sphere.pos.z) - rStart;
+	__m256 sizes = _mm256_set1_ps(sphere.size);
+
+	__m256 Bs = dot(rDir, dist);
+	__m256 Ds = Bs * Bs - dot(dist, dist) + sizes * sizes;
+	__m256 DLessThanZeros = Ds < _mm256_setzero_ps();
+
+	__m256 sqrtDs = _mm256_sqrt_ps(Ds);
+	__m256 t0s = Bs - sqrtDs;
+	__m256 t1s = Bs + sqrtDs;
+
+	// the nearer collision point is used if it's in range, otherwise the further one is
+	__m256 t1InRange = (t1s > epsilons) & (t1s < *ts);
+	__m256 t0InRange = (t0s > epsilons) & (t0s < *ts);
+	__m256 tNew = select(t0InRange, t0s, t1s);
+	__m256 success = _mm256_andnot_ps(DLessThanZeros, active & (t0InRange | t1InRange));
 
-	// constants
+	*ts = select(success, tNew, *ts);
+	*hits = select(_mm256_castps_si256(success), _mm256_set1_epi32(index), *hits);
+}
+
+
+// test one triangle against 8 rays at once (the same sums as isTriangleIntersected(), but the lanes hold rays rather than triangles)
+// updates the closest collision time and hit of each ray in the mask that hits the triangle
+static __forceinline void isTrianglePacketIntersected(const Scene* scene, const unsigned int index, const Vector8& rStart, const Vector8& rDir, const int mask,
+	__m256* ts, __m256i* hits)
+{
 	const __m256 epsilons = _mm256_set1_ps(EPSILON);
-	const __m256 zeros = _mm256_set1_ps(0.0f);
+	const __m256 negEpsilons = _mm256_set1_ps(-EPSILON);
+	const __m256 zeros = _mm256_setzero_ps();
+	const __m256 ones = _mm256_set1_ps(1.0f);
+	const __m256 active = _mm256_castsi256_ps(_mm256_cmpgt_epi32(_mm256_and_si256(_mm256_set1_epi32(mask), _mm256_setr_epi32(1, 2, 4, 8, 16, 32, 64, 128)), _mm256_setzero_si256()));
+
+	Vector8 p1(_mm256_broadcast_ss((const float*)scene->triangle1X + index), _mm256_broadcast_ss((const float*)scene->triangle1Y + index), _mm256_broadcast_ss((const float*)scene->triangle1Z + index));
+	Vector8 e1(_mm256_broadcast_ss((const float*)scene->triangleEdge1X + index), _mm256_broadcast_ss((const float*)scene->triangleEdge1Y + index), _mm256_broadcast_ss((const float*)scene->triangleEdge1Z + index));
+	Vector8 e2(_mm256_broadcast_ss((const float*)scene->triangleEdge2X + index), _mm256_broadcast_ss((const float*)scene->triangleEdge2Y + index), _mm256_broadcast_ss((const float*)scene->triangleEdge2Z + index));
+
+	Vector8 h = cross(rDir, e2);
+	__m256 det = dot(e1, h);
+	__m256 detBetweenEpsilons = (det > negEpsilons) & (det < epsilons);
+	__m256 invDet = ones / det;
+	Vector8 s = rStart - p1;
+	__m256 u = invDet * dot(s, h);
+	Vector8 q = cross(s, e1);
+	__m256 v = invDet * dot(q, rDir);
+	__m256 t0 = invDet * dot(e2, q);
+
+	__m256 success = _mm256_andnot_ps(detBetweenEpsilons, active &
+		(u >= zeros) & (v >= zeros) & ((u + v) <= ones) & (t0 > epsilons) & (t0 < *ts));
+
+	*ts = select(success, t0, *ts);
+	*hits = select(_mm256_castps_si256(success), _mm256_set1_epi32(index | PACKET_TRIANGLE), *hits);
+}
 
-	// starting t
-	const __m256 ts = _mm256_set1_ps(t);
 
-	// search for sphere collisions, storing closest one found
-	for (unsigned int i = 0; i < scene->numSpheresSIMD; ++i)
+// find the closest collision for each of a packet of (up to 8) rays in the scene's BVH
+// the packet walks the BVH together, visiting every node that any of its rays enter
+// once only a single ray is left in a subtree (i.e. the packet has diverged) that ray carries on by itself
+// fills in an intersection for each ray (including its position), and returns a mask of the rays that hit something
+int packetIntersection(const Scene* scene, const Ray* rays, const unsigned int count, Intersection* intersects)
+{
+	// SoA copy of the rays (unused lanes copy the first ray, and are never active)
+	Vector8 rStart, rDir, rInvDir;
+	for (unsigned int i = 0; i < 8; ++i)
 	{
-		//Sphere& sphere = scene.sphereContainer[i * 8 + j];
-		__m256 posxs = scene->spherePosX[i];
-		__m256 posys = scene->spherePosY[i];
-		__m256 poszs = scene->spherePosZ[i];
-		__m256 sizes = scene->sphereSize[i];
-
-		// Vector dist = pos - r.start;
-		__m256 distxs = _mm256_sub_ps(posxs, rStartxs);
-		__m256 distys = _mm256_sub_ps(posys, rStartys);
-		__m256 distzs = _mm256_sub_ps(poszs, rStartzs);
-
-		// float B = r.dir * dist;
-		__m256 Bs = _mm256_add_ps(_mm256_add_ps(_mm256_mul_ps(rDirxs, distxs), _mm256_mul_ps(rDirys, distys)), _mm256_mul_ps(rDirzs, distzs));
-
-		// float D = B * B - dist * dist + size * size;
-		__m256 distDot = _mm256_add_ps(_mm256_add_ps(_mm256_mul_ps(distxs, distxs), _mm256_mul_ps(distys, distys)), _mm256_mul_ps(distzs, distzs));
-		__m256 Ds = _mm256_add_ps(_mm256_sub_ps(_mm256_mul_ps(Bs, Bs), distDot), _mm256_mul_ps(sizes, sizes));
-
-		// if D < 0, no intersection, so don't try and calculate the point of intersection
-		//if (D < 0.0f) continue;
-		__m256 DLessThanZeros = _mm256_cmp_ps(Ds, zeros, _CMP_LT_OQ);
-
-		// calculate both intersection times(/distances)
-		//float t0 = B - sqrtf(D);
-		//float t1 = B + sqrtf(D);
-		__m256 sqrtDs = _mm256_sqrt_ps(Ds);
-		__m256 t0s = _mm256_sub_ps(Bs, sqrtDs);
-		__m256 t1s = _mm256_add_ps(Bs, sqrtDs);
-
-		// check to see if either of the two sphere collision points are closer than time parameter
-		//if ((t1 > EPSILON) && (t1 < t))
-		__m256 t0GreaterThanEpsilons = _mm256_cmp_ps(t0s, epsilons, _CMP_GT_OQ);
-		__m256 t0SmallerThanTs = _mm256_cmp_ps(t0s, ts, _CMP_LT_OQ);
-		__m256 t0GreaterThanEpsilonAndSmallerThanTs = _mm256_and_ps(t0GreaterThanEpsilons, t0SmallerThanTs);
-		//else if ((t0 > EPSILON) && (t0 < t))
-		__m256 t1GreaterThanEpsilons = _mm256_cmp_ps(t1s, epsilons, _CMP_GT_OQ);
-		__m256 t1SmallerThanTs = _mm256_cmp_ps(t1s, ts, _CMP_LT_OQ);
-		__m256 t1GreaterThanEpsilonAndSmallerThanTs = _mm256_and_ps(t1GreaterThanEpsilons, t1SmallerThanTs);
-
-		// combine all the success cases together
-		__m256 success = _mm256_andnot_ps(DLessThanZeros,
-			_mm256_or_ps(t0GreaterThanEpsilonAndSmallerThanTs, t1GreaterThanEpsilonAndSmallerThanTs));
-
-		// if any are successful, short-circuit
-		if (_mm256_movemask_ps(success)) return true;
+		const Ray& ray = rays[i < count ? i : 0];
+		Vector invDir = inverseDirection(ray.dir);
+
+		rStart.xs.m256_f32[i] = ray.start.x; rStart.ys.m256_f32[i] = ray.start.y; rStart.zs.m256_f32[i] = ray.start.z;
+		rDir.xs.m256_f32[i] = ray.dir.x; rDir.ys.m256_f32[i] = ray.dir.y; rDir.zs.m256_f32[i] = ray.dir.z;
+		rInvDir.xs.m256_f32[i] = invDir.x; rInvDir.ys.m256_f32[i] = invDir.y; rInvDir.zs.m256_f32[i] = invDir.z;
 	}
 
-	return false;
-}*/
+	const int activeMask = (1 << count) - 1;
 
+	// closest collision time and hit (sphere index, flagged triangle index, or PACKET_NONE) for each ray
+	__m256 ts = _mm256_set1_ps(MAX_RAY_DISTANCE);
+	__m256i hits = _mm256_set1_epi32(PACKET_NONE);
 
-// test to see if collision between ray and a triangle happens before time t (equivalent to distance)
-// updates closest collision time (/distance) if collision occurs
-// based on: https://en.wikipedia.org/wiki/M%C3%B6ller%E2%80%93Trumbore_intersection_algorithm
-// explanation at: https://www.scratchapixel.com/lessons/3d-basic-rendering/ray-tracing-rendering-a-triangle/moller-trumbore-ray-triangle-intersection
-// another: http://hugi.scene.org/online/hugi25/hugi%2025%20-%20coding%20corner%20graphics,%20sound%20&%20synchronization%20ken%20ray-triangle%20intersection%20tests%20for%20dummies.htm/*
+	// nodes still to be visited
+	unsigned int stack[BVH_MAX_DEPTH + 1];
+	int stackSize = 0;
 
-bool isTriangleIntersected(const Scene* scene, const Ray* r, float* t, int* index)
+	if (scene->numBVHNodes > 0) stack[stackSize++] = 0;
+
+	while (stackSize > 0)
+	{
+		unsigned int nodeIndex = stack[--stackSize];
+		const BVHNode* node = &scene->bvhNodes[nodeIndex];
+
+		// rays that enter the node before their closest collision so far
+		int mask = isBoxIntersected(node->bounds, rStart, rInvDir, ts) & activeMask;
+		if (mask == 0) continue;
+
+		if ((mask & (mask - 1)) == 0)
+		{
+			// only one ray left, so it finishes the subtree by itself
+			unsigned int lane = _tzcnt_u32(mask);
+			float t = ts.m256_f32[lane];
+			Intersection single;
+			single.objectType = Intersection::NONE;
+
+			if (isBVHSubtreeIntersected(scene, &rays[lane], nodeIndex, &t, &single))
+			{
+				ts.m256_f32[lane] = t;
+				hits.m256i_i32[lane] = single.objectType == Intersection::SPHERE ?
+					(int)(single.sphere - scene->sphereContainer) : (int)((single.triangle - scene->triangleContainer) | PACKET_TRIANGLE);
+			}
+		}
+		else if (node->numSpheres + node->numTriangles > 0)
+		{
+			// leaf: test each primitive against all the rays that got here
+			for (unsigned int i = node->firstSphere; i < node->firstSphere + node->numSpheres; ++i)
+			{
+				isSpherePacketIntersected(scene->sphereContainer[i], i, rStart, rDir, mask, &ts, &hits);
+			}
+			for (unsigned int i = node->firstTriangle; i < node->firstTriangle + node->numTriangles; ++i)
+			{
+				isTrianglePacketIntersected(scene, i, rStart, rDir, mask, &ts, &hits);
+			}
+		}
+		else
+		{
+			// interior: push both children, the one further along the first active ray first (so the nearer one is visited next)
+			const Ray& first = rays[_tzcnt_u32(mask)];
+			Vector leftToRight = centroid(scene->bvhNodes[node->right].bounds) - centroid(scene->bvhNodes[node->left].bounds);
+
+			if (leftToRight * first.dir > 0.0f)
+			{
+				stack[stackSize++] = node->right;
+				stack[stackSize++] = node->left;
+			}
+			else
+			{
+				stack[stackSize++] = node->left;
+				stack[stackSize++] = node->right;
+			}
+		}
+	}
+
+	// turn the hits into intersections
+	int hitMask = 0;
+	for (unsigned int i = 0; i < count; ++i)
+	{
+		unsigned int hit = hits.m256i_i32[i];
+
+		intersects[i].instance = NULL;
+
+		if (hit == PACKET_NONE)
+		{
+			intersects[i].objectType = Intersection::NONE;
+			continue;
+		}
+
+		if (hit & PACKET_TRIANGLE)
+		{
+			intersects[i].objectType = Intersection::TRIANGLE;
+			intersects[i].triangle = &scene->triangleContainer[hit & ~PACKET_TRIANGLE];
+		}
+		else
+		{
+			intersects[i].objectType = Intersection::SPHERE;
+			intersects[i].sphere = &scene->sphereContainer[hit];
+		}
+
+		intersects[i].pos = rays[i].start + rays[i].dir * ts.m256_f32[i];
+		hitMask |= 1 << i;
+	}
+
+	return hitMask;
+}
+
+
+// ---- packets of shadow rays ----
+
+// test one sphere against 8 shadow rays at once (the same sums as isSphereIntersected(), but the lanes hold rays rather than spheres)
+// returns a mask of the rays that hit the sphere before their own time t
+static __forceinline int isSphereShadowPacketIntersected(const Sphere& sphere, const Vector8& rStart, const Vector8& rDir, const __m256 ts)
 {
-	float tInitial = *t;
+	const __m256 epsilons = _mm256_set1_ps(EPSILON);
+
+	Vector8 dist = Vector8(sphere.pos.x, sphere.pos.y, sphere.pos.z) - rStart;
+	__m256 sizes = _mm256_set1_ps(sphere.size);
+
+	__m256 Bs = dot(rDir, dist);
+	__m256 Ds = Bs * Bs - dot(dist, dist) + sizes * sizes;
+	__m256 DLessThanZeros = Ds < _mm256_setzero_ps();
+
+	__m256 sqrtDs = _mm256_sqrt_ps(Ds);
+	__m256 t0s = Bs - sqrtDs;
+	__m256 t1s = Bs + sqrtDs;
 
-	//constants
+	__m256 t1InRange = (t1s > epsilons) & (t1s < ts);
+	__m256 t0InRange = (t0s > epsilons) & (t0s < ts);
+
+	return _mm256_movemask_ps(_mm256_andnot_ps(DLessThanZeros, t0InRange | t1InRange));
+}
+
+
+// test one triangle against 8 shadow rays at once (the same sums as isTriangleIntersected(), but the lanes hold rays rather than triangles)
+// returns a mask of the rays that hit the triangle before their own time t
+static __forceinline int isTriangleShadowPacketIntersected(const Scene* scene, const unsigned int index, const Vector8& rStart, const Vector8& rDir, const __m256 ts)
+{
 	const __m256 epsilons = _mm256_set1_ps(EPSILON);
 	const __m256 negEpsilons = _mm256_set1_ps(-EPSILON);
-	const __m256 zeros = _mm256_set1_ps(0.0f);
+	const __m256 zeros = _mm256_setzero_ps();
 	const __m256 ones = _mm256_set1_ps(1.0f);
-	const __m256i eights = _mm256_set1_epi32(8);
 
+	Vector8 p1(_mm256_broadcast_ss((const float*)scene->triangle1X + index), _mm256_broadcast_ss((const float*)scene->triangle1Y + index), _mm256_broadcast_ss((const float*)scene->triangle1Z + index));
+	Vector8 e1(_mm256_broadcast_ss((const float*)scene->triangleEdge1X + index), _mm256_broadcast_ss((const float*)scene->triangleEdge1Y + index), _mm256_broadcast_ss((const float*)scene->triangleEdge1Z + index));
+	Vector8 e2(_mm256_broadcast_ss((const float*)scene->triangleEdge2X + index), _mm256_broadcast_ss((const float*)scene->triangleEdge2Y + index), _mm256_broadcast_ss((const float*)scene->triangleEdge2Z + index));
+
+	Vector8 h = cross(rDir, e2);
+	__m256 det = dot(e1, h);
+	__m256 detBetweenEpsilons = (det > negEpsilons) & (det < epsilons);
+	__m256 invDet = ones / det;
+	Vector8 s = rStart - p1;
+	__m256 u = invDet * dot(s, h);
+	Vector8 q = cross(s, e1);
+	__m256 v = invDet * dot(q, rDir);
+	__m256 t0 = invDet * dot(e2, q);
+
+	return _mm256_movemask_ps(_mm256_andnot_ps(detBetweenEpsilons,
+		(u >= zeros) & (v >= zeros) & ((u + v) <= ones) & (t0 > epsilons) & (t0 < ts)));
+}
 
-	// best ts found so far and associated triangle indexes
-	__m256 ts = _mm256_set1_ps(tInitial);
-	__m256i indexes = _mm256_set1_epi32(*index);
 
-	// current corresponding index
-	__m256i ijs = _mm256_setr_epi32(0, 1, 2, 3, 4, 5, 6, 7);
+// test a range of spheres and triangles against the rays of a shadow packet that are still in it (mask)
+// rays that hit something are taken out of the mask (and their occluder filled in, if there are occluders)
+// returns true once there are no rays left
+static __forceinline bool isRangeShadowPacketIntersected(const Scene* scene, unsigned int firstSphere, unsigned int numSpheres, unsigned int firstTriangle, unsigned int numTriangles,
+	const Vector8& rStart, const Vector8& rDir, const __m256 ts, int activeMask, int* mask, Occluder* occluders)
+{
+	unsigned long lane;
 
-	//setting up vector8s for ray vstart and direction
-	Vector8 rDir(r->dir.x, r->dir.y, r->dir.z);
-	Vector8 rStart(r->start.x, r->start.y, r->start.z);
+	for (unsigned int i = firstSphere; i < firstSphere + numSpheres; ++i)
+	{
+		int hits = isSphereShadowPacketIntersected(scene->sphereContainer[i], rStart, rDir, ts) & activeMask & *mask;
+		if (hits == 0) continue;
+
+		*mask &= ~hits;
+		if (occluders != NULL) for (; _BitScanForward(&lane, hits); hits &= hits - 1) sphereOccluder(&occluders[lane], i);
+		if (*mask == 0) return true;
+	}
+
+	for (unsigned int i = firstTriangle; i < firstTriangle + numTriangles; ++i)
+	{
+		int hits = isTriangleShadowPacketIntersected(scene, i, rStart, rDir, ts) & activeMask & *mask;
+		if (hits == 0) continue;
+
+		*mask &= ~hits;
+		if (occluders != NULL) for (; _BitScanForward(&lane, hits); hits &= hits - 1) triangleOccluder(&occluders[lane], i);
+		if (*mask == 0) return true;
+	}
+
+	return false;
+}
+
+
+// test a packet of (up to 8) shadow rays that all start from the same point against the scene's spheres and triangles
+// every primitive (or BVH node) is loaded once for all of the rays, instead of once per ray, and rays drop out as soon as they hit something
+// returns a mask of the rays (of those in mask) that hit something before their own time t
+int shadowPacketIntersection(const Scene* scene, const Point& start, const Vector8& rDir, const __m256 ts, int mask, Occluder* occluders)
+{
+	Vector8 rStart(start.x, start.y, start.z);
+	const int rays = mask;
+
+	// without a BVH, every primitive is tested (in the same order as the single ray tests)
+	if (scene->accelerator == Scene::LINEAR || scene->numBVHNodes == 0)
+	{
+		isRangeShadowPacketIntersected(scene, 0, scene->numSpheres, 0, scene->numTriangles, rStart, rDir, ts, mask, &mask, occluders);
+		return rays & ~mask;
+	}
+
+	// reciprocal of each ray's direction (the same as inverseDirection())
+	const __m256 tinys = _mm256_set1_ps(1e-20f);
+	const __m256 signs = _mm256_set1_ps(-0.0f);
+	const __m256 ones = _mm256_set1_ps(1.0f);
+	Vector8 rInvDir(
+		ones / select(_mm256_andnot_ps(signs, rDir.xs) > tinys, rDir.xs, _mm256_or_ps(_mm256_and_ps(signs, rDir.xs), tinys)),
+		ones / select(_mm256_andnot_ps(signs, rDir.ys) > tinys, rDir.ys, _mm256_or_ps(_mm256_and_ps(signs, rDir.ys), tinys)),
+		ones / select(_mm256_andnot_ps(signs, rDir.zs) > tinys, rDir.zs, _mm256_or_ps(_mm256_and_ps(signs, rDir.zs), tinys)));
+
+	// nodes still to be visited (in the same order as the single ray test)
+	unsigned int stack[BVH_MAX_DEPTH + 1];
+	int stackSize = 0;
+	stack[stackSize++] = 0;
 
-	for (unsigned int i = 0; i < scene->numTrianglesSIMD; ++i)
+	while (stackSize > 0)
 	{
-		//setting the point to vector8 coords, and the normal
-		Vector8 p1(scene->triangle1X[i], scene->triangle1Y[i], scene->triangle1Z[i]);
-		Vector8 p2(scene->triangle2X[i], scene->triangle2Y[i], scene->triangle2Z[i]);
-		Vector8 p3(scene->triangle3X[i], scene->triangle3Y[i], scene->triangle3Z[i]);
-		Vector8 trianglenormal(scene->triangleNormalX[i], scene->triangleNormalY[i], scene->triangleNormalZ[i]);
+		const BVHNode* node = &scene->bvhNodes[stack[--stackSize]];
+
+		// rays still in the packet that enter the node
+		int nodeMask = isBoxIntersected(node->bounds, rStart, rInvDir, ts) & mask;
+		if (nodeMask == 0) continue;
+
+		if (node->numSpheres + node->numTriangles > 0)
+		{
+			if (isRangeShadowPacketIntersected(scene, node->firstSphere, node->numSpheres, node->firstTriangle, node->numTriangles, rStart, rDir, ts, nodeMask, &mask, occluders)) break;
+		}
+		else
+		{
+			stack[stackSize++] = node->right;
+			stack[stackSize++] = node->left;
+		}
+	}
+
+	return rays & ~mask;
+}
+
+
+// test 8 boxes against a ray at once (slab test, as for the binary version)
+// returns a mask of the boxes that are entered before time t (and the entry times through tEntries)
+static __forceinline int areBoxesIntersected(const __m256 minX, const __m256 minY, const __m256 minZ, const __m256 maxX, const __m256 maxY, const __m256 maxZ,
+	const Vector8& rStart, const Vector8& rInvDir, float t, __m256* tEntries)
+{
+	__m256 tx0 = (minX - rStart.xs) * rInvDir.xs, tx1 = (maxX - rStart.xs) * rInvDir.xs;
+	__m256 ty0 = (minY - rStart.ys) * rInvDir.ys, ty1 = (maxY - rStart.ys) * rInvDir.ys;
+	__m256 tz0 = (minZ - rStart.zs) * rInvDir.zs, tz1 = (maxZ - rStart.zs) * rInvDir.zs;
 
-		//two edges of the triangle, as world coord offsets
-		Vector8 e1 = p2 - p1;
-		Vector8 e2 = p3 - p1;
+	__m256 tNears = _mm256_max_ps(_mm256_max_ps(_mm256_min_ps(tx0, tx1), _mm256_min_ps(ty0, ty1)), _mm256_min_ps(tz0, tz1));
+	__m256 tFars = _mm256_min_ps(_mm256_min_ps(_mm256_max_ps(tx0, tx1), _mm256_max_ps(ty0, ty1)), _mm256_max_ps(tz0, tz1));
 
-		// vector perpendicular to the ray's direction and the second edge of the triangle
-		Vector8 h = cross(rDir, e2);
+	*tEntries = tNears;
 
-		//position calculations
-		//determinant of above vector and the first edge of the triangle
-		__m256 det = dot(e1, h);
+	return _mm256_movemask_ps((tFars >= _mm256_max_ps(tNears, _mm256_setzero_ps())) & (tNears < _mm256_set1_ps(t)));
+}
 
-		//if (det > -EPSILON && det < EPSILON) //dont know if it needs inverting, done this without inverting// prob need to invert all but top statement
-		__m256 detBetweenEpsilons = (det > negEpsilons)&(det < epsilons);
 
-		__m256 invDet = ones / det;
+// test all 8 children of a BVH8 node against a ray at once
+static __forceinline int areChildBoxesIntersected(const BVH8Node* node, const Vector8& rStart, const Vector8& rInvDir, float t, __m256* tEntries)
+{
+	return areBoxesIntersected(node->minX, node->minY, node->minZ, node->maxX, node->maxY, node->maxZ, rStart, rInvDir, t, tEntries);
+}
 
-		// distance vector between start of ray and first point of triangle
-		Vector8 s = rStart - p1;
 
-		// barycentric coord u (i.e. p2 in coordinate system based around triangle's extents)
-		__m256 u = invDet * dot(s, h);
+// decode 8 quantized bounds (steps from the origin) back into floats
+static __forceinline __m256 dequantize(const unsigned char* steps, float origin, float scale)
+{
+	__m256 stepsf = _mm256_cvtepi32_ps(_mm256_cvtepu8_epi32(_mm_loadl_epi64((const __m128i*)steps)));
+	return stepsf * _mm256_set1_ps(scale) + _mm256_set1_ps(origin);
+}
 
-		// barycentric coord v (i.e. p3)
-		Vector8 q = cross(s, e1);
-		__m256 v = invDet * dot(q, rDir);
 
-		// find point of intersection
-		__m256 t0 = invDet * dot(e2, q);
+// compressed node version of the above (the child bounds are decoded first)
+// unused children don't have NaN bounds, so they're masked out using their child indexes instead
+static __forceinline int areChildBoxesIntersected(const QBVH8Node* node, const Vector8& rStart, const Vector8& rInvDir, float t, __m256* tEntries)
+{
+	__m256 minX = dequantize(node->minX, node->originX, node->scaleX);
+	__m256 minY = dequantize(node->minY, node->originY, node->scaleY);
+	__m256 minZ = dequantize(node->minZ, node->originZ, node->scaleZ);
+	__m256 maxX = dequantize(node->maxX, node->originX, node->scaleX);
+	__m256 maxY = dequantize(node->maxY, node->originY, node->scaleY);
+	__m256 maxZ = dequantize(node->maxZ, node->originZ, node->scaleZ);
 
-		//if (u < 0.0f || u > 1.0f)
-		__m256 uOutside1OR0 = (u > zeros) | (u < ones);
+	__m256i children = _mm256_loadu_si256((const __m256i*)node->children);
+	int emptyMask = _mm256_movemask_ps(_mm256_castsi256_ps(_mm256_cmpeq_epi32(children, _mm256_set1_epi32(BVH8_EMPTY))));
 
-		//if (v < 0.0f || u + v > 1.0f)
-		__m256 vUnder0ORuvOver1 = (v > zeros) | ((u + v) < ones);
+	return areBoxesIntersected(minX, minY, minZ, maxX, maxY, maxZ, rStart, rInvDir, t, tEntries) & ~emptyMask;
+}
 
-		//if (t0 > EPSILON && t0 < t)
-		__m256 t0WithinEpsilont = (t0 > epsilons) & (t0 < ts);
 
-		// select best ts 
-		__m256 temp = select(t0WithinEpsilont, t0, ts);
-		ts = select(detBetweenEpsilons, ts, temp);
+// walk an 8-wide BVH (of either node type) for the closest collision
+// hit children are visited nearest first (sorted by entry time) so further away children can be skipped
+template <typename Node>
+static bool isWideBVHIntersected(const Scene* scene, const Node* nodes, const Ray* r, float* t, Intersection* intersect)
+{
+	float tInitial = *t;
+	Vector invDir = inverseDirection(r->dir);
+	Vector8 rStart(r->start.x, r->start.y, r->start.z);
+	Vector8 rInvDir(invDir.x, invDir.y, invDir.z);
 
-		// select best corresponding sphere indexes
-		__m256i temp1 = select(_mm256_castps_si256(t0WithinEpsilont), ijs, indexes);
+	// nodes still to be visited (and the time at which the ray enters them)
+	// each level of the tree can push at most 7 more entries than it pops
+	unsigned int stack[7 * BVH_MAX_DEPTH + 1];
+	float stackEntry[7 * BVH_MAX_DEPTH + 1];
+	int stackSize = 0;
 
-		indexes = select(_mm256_castps_si256(detBetweenEpsilons), indexes, temp1);
+	stack[stackSize] = 0;
+	stackEntry[stackSize++] = 0.0f;
 
-		// increase the index counters
-		ijs = _mm256_add_epi32(ijs, eights);
+	while (stackSize > 0)
+	{
+		--stackSize;
+
+		// skip nodes that are further away than a collision found since they were pushed
+		if (stackEntry[stackSize] >= *t) continue;
+
+		unsigned int entry = stack[stackSize];
+
+		if (entry & BVH8_LEAF)
+		{
+			// leaf: test all of its primitives
+			const BVHNode* leaf = &scene->bvhNodes[entry & ~BVH8_LEAF];
+			int index;
+
+			if (leaf->numSpheres > 0 && isSphereRangeIntersected(scene, r, leaf->firstSphere, leaf->numSpheres, t, &index))
+			{
+				intersect->objectType = Intersection::SPHERE;
+				intersect->sphere = &scene->sphereContainer[index];
+			}
+
+			if (leaf->numTriangles > 0 && isTriangleRangeIntersected(scene, r, leaf->firstTriangle, leaf->numTriangles, t, &index))
+			{
+				intersect->objectType = Intersection::TRIANGLE;
+				intersect->triangle = &scene->triangleContainer[index];
+			}
+		}
+		else
+		{
+			const Node* node = &nodes[entry];
+
+			__m256 tEntries;
+			int hitMask = areChildBoxesIntersected(node, rStart, rInvDir, *t, &tEntries);
+
+			// gather the hit children sorted by decreasing entry time (insertion sort, there are at most 8)
+			unsigned int hitChildren[8];
+			float hitEntries[8];
+			int numHits = 0;
+
+			while (hitMask)
+			{
+				unsigned int i = _tzcnt_u32(hitMask);
+				hitMask &= hitMask - 1;
+
+				float tChild = tEntries.m256_f32[i];
+				int j = numHits++;
+				for (; j > 0 && hitEntries[j - 1] < tChild; --j)
+				{
+					hitChildren[j] = hitChildren[j - 1];
+					hitEntries[j] = hitEntries[j - 1];
+				}
+				hitChildren[j] = node->children[i];
+				hitEntries[j] = tChild;
+			}
+
+			// push further children first (so the nearest is visited next)
+			for (int i = 0; i < numHits; ++i)
+			{
+				stack[stackSize] = hitChildren[i];
+				stackEntry[stackSize++] = hitEntries[i];
+			}
+		}
 	}
-	// extract the best t and corresponding triangle index
-	selectMinimumAndIndex(ts, indexes, t, index);
 
 	return *t < tInitial;
-	
 }
 
-bool isTriangleIntersected(const Scene* scene, const Ray* r, float t)
+
+// short-circuiting version of the above
+template <typename Node>
+static bool isWideBVHIntersected(const Scene* scene, const Node* nodes, const Ray* r, float t, Occluder* occluder)
 {
-	//constants
-	const __m256 epsilons = _mm256_set1_ps(EPSILON);
-	const __m256 negEpsilons = _mm256_set1_ps(-EPSILON);
-	const __m256 zeros = _mm256_set1_ps(0.0f);
-	const __m256 ones = _mm256_set1_ps(1.0f);
+	Vector invDir = inverseDirection(r->dir);
+	Vector8 rStart(r->start.x, r->start.y, r->start.z);
+	Vector8 rInvDir(invDir.x, invDir.y, invDir.z);
 
-	//starting t
-	const __m256 ts = _mm256_set1_ps(t);
+	// nodes still to be visited
+	unsigned int stack[7 * BVH_MAX_DEPTH + 1];
+	int stackSize = 0;
 
-	//setting up vector8s for ray vstart and direction
-	Vector8 rDir(r->dir.x, r->dir.y, r->dir.z);
-	Vector8 rStart(r->start.x, r->start.y, r->start.z);
+	stack[stackSize++] = 0;
 
-	for (unsigned int i = 0; i < scene->numTrianglesSIMD; ++i)
+	while (stackSize > 0)
 	{
-		//setting the point to vector8 coords, and the normal
-		Vector8 p1(scene->triangle1X[i], scene->triangle1Y[i], scene->triangle1Z[i]);
-		Vector8 p2(scene->triangle2X[i], scene->triangle2Y[i], scene->triangle2Z[i]);
-		Vector8 p3(scene->triangle3X[i], scene->triangle3Y[i], scene->triangle3Z[i]);
-		Vector8 trianglenormal(scene->triangleNormalX[i], scene->triangleNormalY[i], scene->triangleNormalZ[i]);
+		unsigned int entry = stack[--stackSize];
+
+		if (entry & BVH8_LEAF)
+		{
+			const BVHNode* leaf = &scene->bvhNodes[entry & ~BVH8_LEAF];
+
+			if (leaf->numSpheres > 0 && isSphereRangeIntersected(scene, r, leaf->firstSphere, leaf->numSpheres, t, occluder)) return true;
+			if (leaf->numTriangles > 0 && isTriangleRangeIntersected(scene, r, leaf->firstTriangle, leaf->numTriangles, t, occluder)) return true;
+		}
+		else
+		{
+			const Node* node = &nodes[entry];
+
+			__m256 tEntries;
+			int hitMask = areChildBoxesIntersected(node, rStart, rInvDir, t, &tEntries);
+
+			// push all the hit children (order doesn't matter when any collision will do)
+			while (hitMask)
+			{
+				stack[stackSize++] = node->children[_tzcnt_u32(hitMask)];
+				hitMask &= hitMask - 1;
+			}
+		}
+	}
+
+	return false;
+}
+
+// test to see if collision between ray and any object in the scene's 8-wide BVH (or its compressed version) happens before time t
+bool isBVH8Intersected(const Scene* scene, const Ray* r, float* t, Intersection* intersect)
+{
+	if (scene->numBVH8Nodes == 0) return false;
+
+	if (scene->accelerator == Scene::QBVH8) return isWideBVHIntersected(scene, scene->qbvh8Nodes, r, t, intersect);
+	return isWideBVHIntersected(scene, scene->bvh8Nodes, r, t, intersect);
+}
+
+
+// short-circuiting version of 8-wide BVH intersection test that only returns true/false
+bool isBVH8Intersected(const Scene* scene, const Ray* r, float t, Occluder* occluder)
+{
+	if (scene->numBVH8Nodes == 0) return false;
+
+	if (scene->accelerator == Scene::QBVH8) return isWideBVHIntersected(scene, scene->qbvh8Nodes, r, t, occluder);
+	return isWideBVHIntersected(scene, scene->bvh8Nodes, r, t, occluder);
+}
+
+// move a ray into an instance's object space (the direction isn't renormalised, so collision times are the same in both spaces)
+static __forceinline Ray toInstanceSpace(const Instance* instance, const Ray* r)
+{
+	Ray local = { toInstanceSpace(instance, r->start), toInstanceSpace(instance, r->dir) };
+	return local;
+}
 
-		//two edges of the triangle, as world coord offsets
-		Vector8 e1 = p2 - p1;
-		Vector8 e2 = p3 - p1;
 
-		// vector perpendicular to the ray's direction and the second edge of the triangle
-		Vector8 h = cross(rDir, e2);
+// test to see if collision between ray and any instanced model happens before time t
+// the top level hierarchy is walked in the same way as the BVH, and each instance's model's BVH is searched with the ray in object space
+bool isInstanceIntersected(const Scene* scene, const Ray* r, float* t, Intersection* intersect)
+{
+	if (scene->numTLASNodes == 0) return false;
 
-		//position calculations
-		//determinant of above vector and the first edge of the triangle
-		__m256 det = dot(e1, h);
+	float tInitial = *t;
+	Vector invDir = inverseDirection(r->dir);
 
-		//if (det > -EPSILON && det < EPSILON) //dont know if it needs inverting, done this without inverting// prob need to invert all but top statement
-		__m256 detBetweenEpsilons = (det > negEpsilons)&(det < epsilons);
+	// nodes still to be visited (and the time at which the ray enters them)
+	unsigned int stack[BVH_MAX_DEPTH + 1];
+	float stackEntry[BVH_MAX_DEPTH + 1];
+	int stackSize = 0;
 
-		__m256 invDet = ones / det;
+	if (!isBoxIntersected(scene->tlasNodes[0].bounds, r->start, invDir, *t, &stackEntry[0])) return false;
+	stack[stackSize++] = 0;
 
-		// distance vector between start of ray and first point of triangle
-		Vector8 s = rStart - p1;
+	while (stackSize > 0)
+	{
+		--stackSize;
+
+		// skip nodes that are further away than a collision found since they were pushed
+		if (stackEntry[stackSize] >= *t) continue;
+
+		const TLASNode* node = &scene->tlasNodes[stack[stackSize]];
+
+		if (node->numInstances > 0)
+		{
+			// leaf: search each instance's model
+			for (unsigned int i = node->firstInstance; i < node->firstInstance + node->numInstances; ++i)
+			{
+				const Instance* instance = &scene->instanceContainer[i];
+				Ray local = toInstanceSpace(instance, r);
+
+				if (isBVHIntersected(instance->model, &local, t, intersect)) intersect->instance = instance;
+			}
+		}
+		else
+		{
+			// interior: push the children that are hit, further one first (so the nearer one is visited next)
+			float tLeft, tRight;
+			bool hitLeft = isBoxIntersected(scene->tlasNodes[node->left].bounds, r->start, invDir, *t, &tLeft);
+			bool hitRight = isBoxIntersected(scene->tlasNodes[node->right].bounds, r->start, invDir, *t, &tRight);
+
+			if (hitLeft && hitRight && tLeft < tRight)
+			{
+				stackEntry[stackSize] = tRight; stack[stackSize++] = node->right;
+				stackEntry[stackSize] = tLeft; stack[stackSize++] = node->left;
+			}
+			else
+			{
+				if (hitLeft) { stackEntry[stackSize] = tLeft; stack[stackSize++] = node->left; }
+				if (hitRight) { stackEntry[stackSize] = tRight; stack[stackSize++] = node->right; }
+			}
+		}
+	}
 
-		// barycentric coord u (i.e. p2 in coordinate system based around triangle's extents)
-		__m256 u = invDet * dot(s, h);
+	return *t < tInitial;
+}
 
-		// barycentric coord v (i.e. p3)
-		Vector8 q = cross(s, e1);
-		__m256 v = invDet * dot(q, rDir);
 
-		// find point of intersection
-		__m256 t0 = invDet * dot(e2, q);
+// short-circuiting version of instance intersection test that only returns true/false
+bool isInstanceIntersected(const Scene* scene, const Ray* r, float t)
+{
+	if (scene->numTLASNodes == 0) return false;
 
-		//if (u < 0.0f || u > 1.0f)
-		__m256 uOutside1OR0 = (u > zeros) | (u < ones);
+	Vector invDir = inverseDirection(r->dir);
 
-		//if (v < 0.0f || u + v > 1.0f)
-		__m256 vUnder0ORuvOver1 = (v > zeros) | ((u + v) < ones);
+	// nodes still to be visited
+	unsigned int stack[BVH_MAX_DEPTH + 1];
+	int stackSize = 0;
+	float tEntry;
 
-		//if (t0 > EPSILON && t0 < t)
-		__m256 t0WithinEpsilont = (t0 > epsilons) & (t0 < ts);
+	if (!isBoxIntersected(scene->tlasNodes[0].bounds, r->start, invDir, t, &tEntry)) return false;
+	stack[stackSize++] = 0;
 
-		__m256 success = _mm256_andnot_ps((detBetweenEpsilons & uOutside1OR0 & vUnder0ORuvOver1), t0WithinEpsilont);
+	while (stackSize > 0)
+	{
+		const TLASNode* node = &scene->tlasNodes[stack[--stackSize]];
+
+		if (node->numInstances > 0)
+		{
+			for (unsigned int i = node->firstInstance; i < node->firstInstance + node->numInstances; ++i)
+			{
+				const Instance* instance = &scene->instanceContainer[i];
+				Ray local = toInstanceSpace(instance, r);
+
+				if (isBVHIntersected(instance->model, &local, t)) return true;
+			}
+		}
+		else
+		{
+			if (isBoxIntersected(scene->tlasNodes[node->right].bounds, r->start, invDir, t, &tEntry)) stack[stackSize++] = node->right;
+			if (isBoxIntersected(scene->tlasNodes[node->left].bounds, r->start, invDir, t, &tEntry)) stack[stackSize++] = node->left;
+		}
+	}
+
+	return false;
+}
 
-		if (_mm256_movemask_ps(success)) return true;
+// test to see if collision between ray and a single (previously found) occluder happens before time t
+// (uses the range tests on a range of one, so the answer is always the same as when the occluder was found)
+bool isOccluderIntersected(const Scene* scene, const Ray* r, float t, const Occluder* occluder)
+{
+	switch (occluder->type)
+	{
+	case Occluder::SPHERE:
+		return isSphereRangeIntersected(scene, r, occluder->index, 1, t, NULL);
+	case Occluder::TRIANGLE:
+		return isTriangleRangeIntersected(scene, r, occluder->index, 1, t, NULL);
 	}
+
 	return false;
 }
 
@@ -417,7 +898,8 @@ void calculateIntersectionResponse(const Scene* scene, const Ray* viewRay, Inter
 		intersect->material = &scene->materialContainer[intersect->sphere->materialId];
 		break;
 	case Intersection::TRIANGLE:
-		intersect->normal = intersect->triangle->normal;
+		// normals of instanced triangles are in object space
+		intersect->normal = intersect->instance == NULL ? intersect->triangle->normal : normalise(fromInstanceSpace(intersect->instance, intersect->triangle->normal));
 		intersect->material = &scene->materialContainer[intersect->triangle->materialId];
 	}
 
@@ -444,21 +926,50 @@ bool objectIntersection(const Scene* scene, const Ray* viewRay, Intersection* in
 
 	// no intersection found by default
 	intersect->objectType = Intersection::NONE;
+	intersect->instance = NULL;
 
-	// search for sphere collisions, storing closest one found
-	int index = -1;
-	if (isSphereIntersected(scene, viewRay, &t, &index))
+	switch (scene->accelerator)
 	{
-		intersect->objectType = Intersection::SPHERE;
-		intersect->sphere = &scene->sphereContainer[index];
+	case Scene::BVH:
+	case Scene::LBVH:
+		// search the BVH for the closest collision
+		isBVHIntersected(scene, viewRay, &t, intersect);
+		break;
+	case Scene::BVH8:
+	case Scene::QBVH8:
+		// search the 8-wide BVH for the closest collision
+		isBVH8Intersected(scene, viewRay, &t, intersect);
+		break;
+	case Scene::GRID:
+		// walk the grid's cells for the closest collision
+		isGridIntersected(scene, viewRay, &t, intersect);
+		break;
+	case Scene::LINEAR:
+	{
+		// search for sphere collisions, storing closest one found
+		int index = -1;
+		if (isSphereIntersected(scene, viewRay, &t, &index))
+		{
+			intersect->objectType = Intersection::SPHERE;
+			intersect->sphere = &scene->sphereContainer[index];
+		}
+
+		// search for triangle collisions, storing closest one found
+		if (isTriangleIntersected(scene, viewRay, &t, &index))
+		{
+			intersect->objectType = Intersection::TRIANGLE;
+			intersect->triangle = &scene->triangleContainer[index];
+		}
+		break;
+	}
 	}
 
-	// search for triangle collisions, storing closest one found
-	if (isTriangleIntersected(scene, viewRay, &t, &index))
+	// instanced models are searched last (so only closer collisions than the above are tested)
+	if (scene->numInstances > 0)
 	{
-		intersect->objectType = Intersection::TRIANGLE;
-		intersect->triangle = &scene->triangleContainer[index];
+		isInstanceIntersected(scene, viewRay, &t, intersect);
 	}
+
 	// nothing detected, return false
 	if (intersect->objectType == Intersection::NONE)
 	{
@@ -7,6 +7,8 @@
 
 #include "Scene.h"
 #include "SceneObjects.h"
+#include "PrimitivesSIMD.h"
+#include "Cpu.h"
 
 // all pertinant information about an intersection of a ray with an object
 typedef struct Intersection
@@ -26,14 +28,49 @@ typedef struct Intersection
 		struct Sphere* sphere;
 		struct Triangle* triangle;
 	};
+
+	const struct Instance* instance;					// instance the object belongs to (NULL if the object isn't part of an instanced model)
 } Intersection;
 
+// the primitive that stopped a short-circuiting test (e.g. the object that put a point in shadow)
+typedef struct Occluder
+{
+	enum { NONE, SPHERE, TRIANGLE } type;
+	unsigned int index;									// index in the scene's sphereContainer or triangleContainer
+} Occluder;
+
+// fill in an occluder (if one is wanted), for short-circuiting tests to return when they find a collision
+inline bool sphereOccluder(Occluder* occluder, const unsigned int index)
+{
+	if (occluder != NULL)
+	{
+		occluder->type = Occluder::SPHERE;
+		occluder->index = index;
+	}
+	return true;
+}
+
+inline bool triangleOccluder(Occluder* occluder, const unsigned int index)
+{
+	if (occluder != NULL)
+	{
+		occluder->type = Occluder::TRIANGLE;
+		occluder->index = index;
+	}
+	return true;
+}
+
+// use the (4, 8, or 16 wide) intersection kernels for an instruction set from now on
+// the sphere, triangle, BVH, and instance tests below all go through them (the packet and 8-wide BVH tests are AVX2 only)
+void selectIntersectionKernels(const InstructionSet isa);
+
 // test to see if collision between ray and a plane happens before time t (equivalent to distance)
 // updates closest collision time (/distance) if collision occurs
 bool isSphereIntersected(const Scene* scene, const Ray* r, float* t, int* index);
 
 // short circuiting version of the above
-bool isSphereIntersected(const Scene* scene, const Ray* r, float t);
+// (all of the short circuiting tests fill in the occluder, if one is given, with the primitive they stopped at)
+bool isSphereIntersected(const Scene* scene, const Ray* r, float t, Occluder* occluder = NULL);
 
 // test to see if collision between ray and a triangle happens before time t (equivalent to distance)
 // updates closest collision time (/distance) if collision occurs
@@ -42,7 +79,54 @@ bool isSphereIntersected(const Scene* scene, const Ray* r, float t);
 bool isTriangleIntersected(const Scene* scene, const Ray* r, float* t, int* index);
 
 // short circuiting version of triangle intersections
-bool isTriangleIntersected(const Scene* scene,const Ray* r, float t);
+bool isTriangleIntersected(const Scene* scene,const Ray* r, float t, Occluder* occluder = NULL);
+
+// test a contiguous range of the scene's spheres (e.g. a BVH leaf, or a grid cell) for the closest collision before time t
+// updates closest collision time (/distance) and the sphere's index if collision occurs
+bool isSphereRangeIntersected(const Scene* scene, const Ray* r, unsigned int first, unsigned int count, float* t, int* index);
+
+// short circuiting version of sphere range intersections
+bool isSphereRangeIntersected(const Scene* scene, const Ray* r, unsigned int first, unsigned int count, float t, Occluder* occluder = NULL);
+
+// test a contiguous range of the scene's triangles for the closest collision before time t
+bool isTriangleRangeIntersected(const Scene* scene, const Ray* r, unsigned int first, unsigned int count, float* t, int* index);
+
+// short circuiting version of triangle range intersections
+bool isTriangleRangeIntersected(const Scene* scene, const Ray* r, unsigned int first, unsigned int count, float t, Occluder* occluder = NULL);
+
+// test to see if collision between ray and any object in the scene's BVH happens before time t
+// updates closest collision time (/distance) and intersection's object if collision occurs
+bool isBVHIntersected(const Scene* scene, const Ray* r, float* t, Intersection* intersect);
+
+// short circuiting version of BVH intersections
+bool isBVHIntersected(const Scene* scene, const Ray* r, float t, Occluder* occluder = NULL);
+
+// test to see if collision between ray and any object in the scene's 8-wide BVH happens before time t
+// updates closest collision time (/distance) and intersection's object if collision occurs
+bool isBVH8Intersected(const Scene* scene, const Ray* r, float* t, Intersection* intersect);
+
+// short circuiting version of 8-wide BVH intersections
+bool isBVH8Intersected(const Scene* scene, const Ray* r, float t, Occluder* occluder = NULL);
+
+// test to see if collision between ray and any instanced model happens before time t
+// updates closest collision time (/distance) and intersection's object and instance if collision occurs
+bool isInstanceIntersected(const Scene* scene, const Ray* r, float* t, Intersection* intersect);
+
+// short circuiting version of instance intersections
+bool isInstanceIntersected(const Scene* scene, const Ray* r, float t);
+
+// test to see if collision between ray and a single (previously found) occluder happens before time t
+bool isOccluderIntersected(const Scene* scene, const Ray* r, float t, const Occluder* occluder);
+
+// find the closest collision for each of a packet of (up to 8) rays that start close together and head in similar directions (e.g. neighbouring primary rays)
+// only for scenes with a binary BVH (and without instances)
+// fills in an intersection for each ray, and returns a mask of the rays that hit something
+int packetIntersection(const Scene* scene, const Ray* rays, const unsigned int count, Intersection* intersects);
+
+// test a packet of (up to 8) shadow rays that all start from the same point (e.g. towards 8 lights) against the scene at once
+// only for scenes with the linear or binary BVH accelerators (and without instances)
+// returns a mask of the rays (of those in mask) that collide with something before their own time t, and fills in what they hit if occluders isn't NULL
+int shadowPacketIntersection(const Scene* scene, const Point& start, const Vector8& rDir, const __m256 ts, int mask, Occluder* occluders = NULL);
 
 // calculate collision normal, viewProjection, object's material, and test to see if inside collision object
 void calculateIntersectionResponse(const Scene* scene, const Ray* viewRay, Intersection* intersect); 
@@ -0,0 +1,6 @@
+// 8 wide (AVX2) versions of the intersection kernels (the default)
+// (range tests can read up to 7 floats past the end of a range, which the extra vector on the end of each SoA array covers)
+
+#include "IntersectionKernelsSIMD.h"
+
+const IntersectionKernels avx2Kernels = intersectionKernels<8>();
@@ -0,0 +1,6 @@
+// 16 wide (AVX-512) versions of the intersection kernels
+// (the ends of arrays and ranges are read with masked loads, so nothing past them is ever read)
+
+#include "IntersectionKernelsSIMD.h"
+
+const IntersectionKernels avx512Kernels = intersectionKernels<16>();
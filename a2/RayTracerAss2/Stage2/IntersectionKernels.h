@@ -0,0 +1,33 @@
+// the ray/primitive intersection kernels, compiled once for each instruction set (see Cpu.h)
+// every version gives exactly the same answers, they only differ in how many primitives they test at once
+// (Intersection.cpp picks one set of them at startup, and Benchmark.cpp times them against each other)
+
+#ifndef __INTERSECTION_KERNELS_H
+#define __INTERSECTION_KERNELS_H
+
+#include "Scene.h"
+#include "Intersection.h"
+#include "Cpu.h"
+
+typedef struct IntersectionKernels
+{
+	// every sphere / triangle in the scene (for the linear accelerator)
+	// the closest collision versions update t and index, the short-circuiting ones fill in the occluder (if there is one)
+	bool (*spheres)(const Scene* scene, const Ray* r, float* t, int* index);
+	bool (*spheresShort)(const Scene* scene, const Ray* r, float t, Occluder* occluder);
+	bool (*triangles)(const Scene* scene, const Ray* r, float* t, int* index);
+	bool (*trianglesShort)(const Scene* scene, const Ray* r, float t, Occluder* occluder);
+
+	// a contiguous range of spheres / triangles (i.e. a BVH leaf)
+	bool (*sphereRange)(const Scene* scene, const Ray* r, unsigned int first, unsigned int count, float* t, int* index);
+	bool (*sphereRangeShort)(const Scene* scene, const Ray* r, unsigned int first, unsigned int count, float t, Occluder* occluder);
+	bool (*triangleRange)(const Scene* scene, const Ray* r, unsigned int first, unsigned int count, float* t, int* index);
+	bool (*triangleRangeShort)(const Scene* scene, const Ray* r, unsigned int first, unsigned int count, float t, Occluder* occluder);
+} IntersectionKernels;
+
+// 4, 8, and 16 wide versions (in IntersectionSSE42.cpp, IntersectionAVX2.cpp, and IntersectionAVX512.cpp, all made from IntersectionKernelsSIMD.h)
+extern const IntersectionKernels sse42Kernels;
+extern const IntersectionKernels avx2Kernels;
+extern const IntersectionKernels avx512Kernels;
+
+#endif // __INTERSECTION_KERNELS_H
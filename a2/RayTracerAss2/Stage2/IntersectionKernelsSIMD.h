@@ -0,0 +1,269 @@
+// the sphere and triangle intersection kernels, written once against SimdVector.h's width-generic types
+// each of IntersectionSSE42.cpp, IntersectionAVX2.cpp, and IntersectionAVX512.cpp includes this and makes the table for its own width
+// (so this should only be included by them, as everything here has to be compiled for the right instruction set)
+
+#ifndef __INTERSECTION_KERNELS_SIMD_H
+#define __INTERSECTION_KERNELS_SIMD_H
+
+#include <intrin.h>
+#include "IntersectionKernels.h"
+#include "SimdVector.h"
+#include "Constants.h"
+
+// index of the first set bit of a (non-zero) mask of lanes
+static __forceinline unsigned int firstLane(const int mask)
+{
+	unsigned long lane;
+	_BitScanForward(&lane, mask);
+	return lane;
+}
+
+
+// the two collision times of a ray with Width spheres (starting at i in the SoA arrays)
+// returns which lanes are before end and have a real solution
+// see: http://en.wikipedia.org/wiki/Line-sphere_intersection (and the original scalar version in Primitives.h)
+template <int Width>
+static __forceinline SimdMask<Width> sphereCollisionTimes(const Scene* scene, const unsigned int i, const unsigned int end, const SimdInt<Width> ijs,
+	const SimdVector<Width>& rStart, const SimdVector<Width>& rDir, SimdFloat<Width>* t0s, SimdFloat<Width>* t1s)
+{
+	SimdVector<Width> pos(SimdFloat<Width>::load((const float*)scene->spherePosX + i, end - i), SimdFloat<Width>::load((const float*)scene->spherePosY + i, end - i),
+		SimdFloat<Width>::load((const float*)scene->spherePosZ + i, end - i));
+	SimdFloat<Width> sizes = SimdFloat<Width>::load((const float*)scene->sphereSize + i, end - i);
+
+	// Vector dist = pos - r.start;
+	SimdVector<Width> dist = pos - rStart;
+
+	// float B = r.dir * dist;
+	SimdFloat<Width> Bs = dot(rDir, dist);
+
+	// float D = B * B - dist * dist + size * size;
+	SimdFloat<Width> Ds = Bs * Bs - dot(dist, dist) + sizes * sizes;
+
+	// calculate both intersection times(/distances) (sqrt of negative D is NaN, but those lanes aren't valid anyway)
+	SimdFloat<Width> sqrtDs = sqrt(Ds);
+	*t0s = Bs - sqrtDs;
+	*t1s = Bs + sqrtDs;
+
+	return (ijs < SimdInt<Width>::broadcast(end)) & (Ds >= SimdFloat<Width>::broadcast(0.0f));
+}
+
+
+// the collision time of a ray with Width triangles (starting at i in the SoA arrays)
+// returns which lanes are before end and are hit closer than ts
+// based on: https://en.wikipedia.org/wiki/M%C3%B6ller%E2%80%93Trumbore_intersection_algorithm
+template <int Width>
+static __forceinline SimdMask<Width> triangleCollisionTimes(const Scene* scene, const unsigned int i, const unsigned int end, const SimdInt<Width> ijs,
+	const SimdVector<Width>& rStart, const SimdVector<Width>& rDir, const SimdFloat<Width> ts, SimdFloat<Width>* t0)
+{
+	typedef SimdFloat<Width> Floats;
+
+	const Floats epsilons = Floats::broadcast(EPSILON);
+	const Floats zeros = Floats::broadcast(0.0f);
+	const Floats ones = Floats::broadcast(1.0f);
+	const unsigned int n = end - i;
+
+	// first point of the triangle, and the two edges from it (precomputed when the SoA copies are made)
+	SimdVector<Width> p1(Floats::load((const float*)scene->triangle1X + i, n), Floats::load((const float*)scene->triangle1Y + i, n), Floats::load((const float*)scene->triangle1Z + i, n));
+	SimdVector<Width> e1(Floats::load((const float*)scene->triangleEdge1X + i, n), Floats::load((const float*)scene->triangleEdge1Y + i, n), Floats::load((const float*)scene->triangleEdge1Z + i, n));
+	SimdVector<Width> e2(Floats::load((const float*)scene->triangleEdge2X + i, n), Floats::load((const float*)scene->triangleEdge2Y + i, n), Floats::load((const float*)scene->triangleEdge2Z + i, n));
+
+	// vector perpendicular to the ray's direction and the second edge, and its determinant with the first edge
+	SimdVector<Width> h = cross(rDir, e2);
+	Floats det = dot(e1, h);
+
+	// if (det > -EPSILON && det < EPSILON) the ray is parallel to the triangle
+	SimdMask<Width> detBetweenEpsilons = (det > Floats::broadcast(-EPSILON)) & (det < epsilons);
+
+	Floats invDet = ones / det;
+
+	// barycentric coords u and v, and the point of intersection
+	SimdVector<Width> s = rStart - p1;
+	Floats u = invDet * dot(s, h);
+	SimdVector<Width> q = cross(s, e1);
+	Floats v = invDet * dot(q, rDir);
+	*t0 = invDet * dot(e2, q);
+
+	// inside the triangle (i.e. u >= 0, v >= 0, and u + v <= 1), before end, and (t0 > EPSILON && t0 < t)
+	return andNot((ijs < SimdInt<Width>::broadcast(end)) & (u >= zeros) & (v >= zeros) & ((u + v) <= ones) & (*t0 > epsilons) & (*t0 < ts), detBetweenEpsilons);
+}
+
+
+// test a contiguous range of spheres for collisions before time t (updating t and index if one is found)
+// ranges don't start on Width sphere boundaries, so the SoA arrays are read with unaligned loads and lanes past the end are masked off
+template <int Width>
+static bool isSphereRangeIntersectedSIMD(const Scene* scene, const Ray* r, unsigned int first, unsigned int count, float* t, int* index)
+{
+	SimdVector<Width> rStart(r->start.x, r->start.y, r->start.z);
+	SimdVector<Width> rDir(r->dir.x, r->dir.y, r->dir.z);
+
+	const SimdFloat<Width> epsilons = SimdFloat<Width>::broadcast(EPSILON);
+	const SimdFloat<Width> tInitials = SimdFloat<Width>::broadcast(*t);
+	const SimdInt<Width> widths = SimdInt<Width>::broadcast(Width);
+
+	// best ts found so far and associated sphere indexes
+	SimdFloat<Width> ts = tInitials;
+	SimdInt<Width> indexes = SimdInt<Width>::broadcast(-1);
+
+	// current corresponding index
+	SimdInt<Width> ijs = SimdInt<Width>::sequence(first);
+
+	for (unsigned int i = first; i < first + count; i += Width)
+	{
+		SimdFloat<Width> t0s, t1s;
+		SimdMask<Width> valid = sphereCollisionTimes(scene, i, first + count, ijs, rStart, rDir, &t0s, &t1s);
+
+		// check to see if either of the two sphere collision points are closer than time parameter
+		SimdMask<Width> t1GreaterThanEpsilonAndSmallerThanTs = valid & (t1s > epsilons) & (t1s < ts);
+		SimdMask<Width> t0GreaterThanEpsilonAndSmallerThanTs = valid & (t0s > epsilons) & (t0s < ts);
+
+		// select best ts and corresponding indexes
+		ts = select(t1GreaterThanEpsilonAndSmallerThanTs, t1s, ts);
+		ts = select(t0GreaterThanEpsilonAndSmallerThanTs, t0s, ts);
+		indexes = select(t1GreaterThanEpsilonAndSmallerThanTs | t0GreaterThanEpsilonAndSmallerThanTs, ijs, indexes);
+
+		ijs = ijs + widths;
+	}
+
+	// nothing closer found
+	if (!(ts < tInitials).bits()) return false;
+
+	// extract the best t and corresponding sphere index
+	selectMinimumAndIndex(ts, indexes, t, index);
+
+	return true;
+}
+
+
+// short-circuiting version of sphere range intersection test
+template <int Width>
+static bool isSphereRangeIntersectedSIMD(const Scene* scene, const Ray* r, unsigned int first, unsigned int count, float t, Occluder* occluder)
+{
+	SimdVector<Width> rStart(r->start.x, r->start.y, r->start.z);
+	SimdVector<Width> rDir(r->dir.x, r->dir.y, r->dir.z);
+
+	const SimdFloat<Width> epsilons = SimdFloat<Width>::broadcast(EPSILON);
+	const SimdFloat<Width> ts = SimdFloat<Width>::broadcast(t);
+	const SimdInt<Width> widths = SimdInt<Width>::broadcast(Width);
+
+	SimdInt<Width> ijs = SimdInt<Width>::sequence(first);
+
+	for (unsigned int i = first; i < first + count; i += Width)
+	{
+		SimdFloat<Width> t0s, t1s;
+		SimdMask<Width> valid = sphereCollisionTimes(scene, i, first + count, ijs, rStart, rDir, &t0s, &t1s);
+
+		// if any are successful, short-circuit
+		int mask = (valid & (((t0s > epsilons) & (t0s < ts)) | ((t1s > epsilons) & (t1s < ts)))).bits();
+		if (mask) return sphereOccluder(occluder, i + firstLane(mask));
+
+		ijs = ijs + widths;
+	}
+
+	return false;
+}
+
+
+// test a contiguous range of triangles for collisions before time t (updating t and index if one is found)
+template <int Width>
+static bool isTriangleRangeIntersectedSIMD(const Scene* scene, const Ray* r, unsigned int first, unsigned int count, float* t, int* index)
+{
+	SimdVector<Width> rStart(r->start.x, r->start.y, r->start.z);
+	SimdVector<Width> rDir(r->dir.x, r->dir.y, r->dir.z);
+
+	const SimdFloat<Width> tInitials = SimdFloat<Width>::broadcast(*t);
+	const SimdInt<Width> widths = SimdInt<Width>::broadcast(Width);
+
+	// best ts found so far and associated triangle indexes
+	SimdFloat<Width> ts = tInitials;
+	SimdInt<Width> indexes = SimdInt<Width>::broadcast(-1);
+
+	// current corresponding index
+	SimdInt<Width> ijs = SimdInt<Width>::sequence(first);
+
+	for (unsigned int i = first; i < first + count; i += Width)
+	{
+		SimdFloat<Width> t0;
+		SimdMask<Width> success = triangleCollisionTimes(scene, i, first + count, ijs, rStart, rDir, ts, &t0);
+
+		// select best ts and corresponding triangle indexes
+		ts = select(success, t0, ts);
+		indexes = select(success, ijs, indexes);
+
+		ijs = ijs + widths;
+	}
+
+	// nothing closer found
+	if (!(ts < tInitials).bits()) return false;
+
+	// extract the best t and corresponding triangle index
+	selectMinimumAndIndex(ts, indexes, t, index);
+
+	return true;
+}
+
+
+// short-circuiting version of triangle range intersection test
+template <int Width>
+static bool isTriangleRangeIntersectedSIMD(const Scene* scene, const Ray* r, unsigned int first, unsigned int count, float t, Occluder* occluder)
+{
+	SimdVector<Width> rStart(r->start.x, r->start.y, r->start.z);
+	SimdVector<Width> rDir(r->dir.x, r->dir.y, r->dir.z);
+
+	const SimdFloat<Width> ts = SimdFloat<Width>::broadcast(t);
+	const SimdInt<Width> widths = SimdInt<Width>::broadcast(Width);
+
+	SimdInt<Width> ijs = SimdInt<Width>::sequence(first);
+
+	for (unsigned int i = first; i < first + count; i += Width)
+	{
+		SimdFloat<Width> t0;
+		int mask = triangleCollisionTimes(scene, i, first + count, ijs, rStart, rDir, ts, &t0).bits();
+		if (mask) return triangleOccluder(occluder, i + firstLane(mask));
+
+		ijs = ijs + widths;
+	}
+
+	return false;
+}
+
+
+// the whole scene versions (for the linear accelerator) are the range versions over every sphere / triangle
+// (the padding lanes at the end of the SoA arrays are masked off, so there's no need to clamp indexes to the real spheres / triangles)
+template <int Width>
+static bool isSphereIntersectedSIMD(const Scene* scene, const Ray* r, float* t, int* index)
+{
+	return isSphereRangeIntersectedSIMD<Width>(scene, r, 0, scene->numSpheres, t, index);
+}
+
+template <int Width>
+static bool isSphereIntersectedSIMD(const Scene* scene, const Ray* r, float t, Occluder* occluder)
+{
+	return isSphereRangeIntersectedSIMD<Width>(scene, r, 0, scene->numSpheres, t, occluder);
+}
+
+template <int Width>
+static bool isTriangleIntersectedSIMD(const Scene* scene, const Ray* r, float* t, int* index)
+{
+	return isTriangleRangeIntersectedSIMD<Width>(scene, r, 0, scene->numTriangles, t, index);
+}
+
+template <int Width>
+static bool isTriangleIntersectedSIMD(const Scene* scene, const Ray* r, float t, Occluder* occluder)
+{
+	return isTriangleRangeIntersectedSIMD<Width>(scene, r, 0, scene->numTriangles, t, occluder);
+}
+
+
+// table of all of the kernels for one width
+template <int Width>
+static IntersectionKernels intersectionKernels()
+{
+	IntersectionKernels kernels =
+	{
+		isSphereIntersectedSIMD<Width>, isSphereIntersectedSIMD<Width>, isTriangleIntersectedSIMD<Width>, isTriangleIntersectedSIMD<Width>,
+		isSphereRangeIntersectedSIMD<Width>, isSphereRangeIntersectedSIMD<Width>, isTriangleRangeIntersectedSIMD<Width>, isTriangleRangeIntersectedSIMD<Width>
+	};
+	return kernels;
+}
+
+#endif // __INTERSECTION_KERNELS_SIMD_H
@@ -0,0 +1,6 @@
+// 4 wide (SSE4.2) versions of the intersection kernels, for CPUs without AVX2
+// (range tests can read up to 3 floats past the end of a range, which the extra vector on the end of each SoA array covers)
+
+#include "IntersectionKernelsSIMD.h"
+
+const IntersectionKernels sse42Kernels = intersectionKernels<4>();
@@ -0,0 +1,391 @@
+// linear bounding volume hierarchy construction (Morton code order, built in parallel)
+// see: https://research.nvidia.com/sites/default/files/publications/karras2012hpg_paper.pdf
+// see: https://developer.nvidia.com/blog/thinking-parallel-part-iii-tree-construction-gpu/
+
+#define NOMINMAX			// stop windows.h breaking std::min and std::max
+#include <windows.h>
+#include "BVH.h"
+#include <cstring>
+
+// Morton codes have 10 bits per axis, and are sorted 10 bits at a time
+const int MORTON_BITS = 10;
+const int RADIX_BITS = 10;
+const int RADIX_SIZE = 1 << RADIX_BITS;
+const int RADIX_PASSES = 3;		// (has to be odd, so that the sorted results end up in keysSorted/valuesSorted)
+
+
+// everything shared by the worker threads during a build
+typedef struct LBVHState
+{
+	Scene* scene;
+	unsigned int numPrimitives;
+	unsigned int threadCount;
+
+	// per thread results that have to be combined between phases
+	AABB* threadBounds;						// bounds of each thread's centroids
+	unsigned int* histograms;				// radix sort digit counts for each thread (RADIX_SIZE per thread)
+	unsigned int* threadSpheres;			// number of spheres in each thread's part of the sorted primitives
+
+	Point* centroids;						// centre of each primitive (spheres then triangles)
+	unsigned int* keys, *keysSorted;		// Morton codes (sorted back and forth between the two)
+	unsigned int* values, *valuesSorted;	// primitive indexes (sorted along with the keys)
+
+	Sphere* spheres;						// spheres in Morton order
+	Triangle* triangles;					// triangles in Morton order
+
+	BVHNode* nodes;							// output nodes (internal nodes first, then one leaf per primitive)
+	unsigned int* parents;					// parent of each node
+	volatile unsigned int* visits;			// number of children that have finished their bounds (for each internal node)
+
+	// simple barrier so that all the phases can run on the same threads
+	volatile unsigned int barrierCount;
+	volatile unsigned int barrierGeneration;
+} LBVHState;
+
+
+// ---- helpers ----
+
+// wait until every thread reaches the barrier
+static void waitForOtherThreads(LBVHState* state)
+{
+	unsigned int generation = state->barrierGeneration;
+
+	if (InterlockedIncrement(&state->barrierCount) == state->threadCount)
+	{
+		// last one here, so reset and let everyone go
+		state->barrierCount = 0;
+		InterlockedIncrement(&state->barrierGeneration);
+	}
+	else
+	{
+		while (state->barrierGeneration == generation)
+		{
+			Sleep(0);
+		}
+	}
+}
+
+// first item of a thread's share of count items
+inline unsigned int chunkStart(unsigned int count, unsigned int threadIndex, unsigned int threadCount)
+{
+	return (unsigned int)((unsigned long long)count * threadIndex / threadCount);
+}
+
+// spread the bottom 10 bits of a value out so there are two zero bits between each of them
+inline unsigned int expandBits(unsigned int v)
+{
+	v = (v * 0x00010001u) & 0xFF0000FFu;
+	v = (v * 0x00000101u) & 0x0F00F00Fu;
+	v = (v * 0x00000011u) & 0xC30C30C3u;
+	v = (v * 0x00000005u) & 0x49249249u;
+	return v;
+}
+
+// 30-bit Morton code for a point (within the given bounds)
+inline unsigned int mortonCode(const Point& p, const AABB& bounds)
+{
+	const float scale = float(1 << MORTON_BITS);
+	const unsigned int maxValue = (1 << MORTON_BITS) - 1;
+
+	Vector extent = bounds.max - bounds.min;
+	unsigned int x = std::min((unsigned int)std::max((p.x - bounds.min.x) / std::max(extent.x, FLT_MIN) * scale, 0.0f), maxValue);
+	unsigned int y = std::min((unsigned int)std::max((p.y - bounds.min.y) / std::max(extent.y, FLT_MIN) * scale, 0.0f), maxValue);
+	unsigned int z = std::min((unsigned int)std::max((p.z - bounds.min.z) / std::max(extent.z, FLT_MIN) * scale, 0.0f), maxValue);
+
+	return (expandBits(x) << 2) | (expandBits(y) << 1) | expandBits(z);
+}
+
+// number of leading zero bits of a (non-zero) value
+// (with bsr rather than lzcnt, which isn't on every CPU that has AVX2, and runs as bsr on CPUs without it)
+inline int leadingZeros(const unsigned int value)
+{
+	unsigned long index;
+	_BitScanReverse(&index, value);
+	return 31 - (int)index;
+}
+
+// length of the common prefix of two sorted keys (keys that match are told apart by their positions)
+// returns -1 if j is outside the keys
+inline int commonPrefix(const unsigned int* keys, unsigned int count, int i, int j)
+{
+	if (j < 0 || j >= (int)count) return -1;
+
+	if (keys[i] == keys[j]) return 32 + leadingZeros(i ^ j);
+
+	return leadingZeros(keys[i] ^ keys[j]);
+}
+
+
+// ---- building ----
+
+// find the children of internal node i (see Karras' paper, figure 4)
+static void buildInternalNode(LBVHState* state, int i)
+{
+	const unsigned int* keys = state->keysSorted;
+	unsigned int count = state->numPrimitives;
+
+	// direction of the node's range (from i)
+	int d = commonPrefix(keys, count, i, i + 1) > commonPrefix(keys, count, i, i - 1) ? 1 : -1;
+
+	// find the other end of the range, first doubling then binary searching
+	int minPrefix = commonPrefix(keys, count, i, i - d);
+	int maxLength = 2;
+	while (commonPrefix(keys, count, i, i + maxLength * d) > minPrefix)
+	{
+		maxLength *= 2;
+	}
+
+	int length = 0;
+	for (int t = maxLength / 2; t >= 1; t /= 2)
+	{
+		if (commonPrefix(keys, count, i, i + (length + t) * d) > minPrefix) length += t;
+	}
+
+	int j = i + length * d;
+
+	// binary search for where the range splits
+	int nodePrefix = commonPrefix(keys, count, i, j);
+	int split = 0;
+	for (int t = (length + 1) / 2; ; t = (t + 1) / 2)
+	{
+		if (commonPrefix(keys, count, i, i + (split + t) * d) > nodePrefix) split += t;
+		if (t == 1) break;
+	}
+
+	int gamma = i + split * d + std::min(d, 0);
+
+	// children that only cover one primitive are leaves (which come after the count - 1 internal nodes)
+	BVHNode& node = state->nodes[i];
+	node.left = std::min(i, j) == gamma ? count - 1 + gamma : gamma;
+	node.right = std::max(i, j) == gamma + 1 ? count + gamma : gamma + 1;
+	node.firstSphere = node.numSpheres = 0;
+	node.firstTriangle = node.numTriangles = 0;
+
+	state->parents[node.left] = i;
+	state->parents[node.right] = i;
+	state->visits[i] = 0;
+}
+
+
+// work out bounds from the leaves up
+// the second child to finish works out its parent's bounds, so every node is done once all of its children are done
+static void buildBoundsUpwards(LBVHState* state, unsigned int leafIndex)
+{
+	if (leafIndex == 0) return;		// only one primitive, so the root is the leaf
+
+	unsigned int nodeIndex = state->parents[leafIndex];
+	while (InterlockedIncrement(&state->visits[nodeIndex]) == 2)
+	{
+		BVHNode& node = state->nodes[nodeIndex];
+		node.bounds = state->nodes[node.left].bounds;
+		growBox(node.bounds, state->nodes[node.right].bounds);
+
+		if (nodeIndex == 0) break;
+		nodeIndex = state->parents[nodeIndex];
+	}
+}
+
+
+// thread pool job for building
+// every thread works through the same phases on its own share of the primitives, waiting for the others between phases
+static void buildLBVHJob(void* inData, const unsigned int threadIndex)
+{
+	LBVHState* state = (LBVHState*)inData;
+	Scene* scene = state->scene;
+	const unsigned int t = threadIndex, threadCount = state->threadCount;
+	const unsigned int count = state->numPrimitives;
+	const unsigned int begin = chunkStart(count, t, threadCount), end = chunkStart(count, t + 1, threadCount);
+
+	// find the centroids (and their bounds)
+	AABB bounds = emptyBox();
+	for (unsigned int i = begin; i < end; ++i)
+	{
+		state->centroids[i] = i < scene->numSpheres ? scene->sphereContainer[i].pos : centroid(triangleBounds(scene->triangleContainer[i - scene->numSpheres]));
+		growBox(bounds, state->centroids[i]);
+	}
+	state->threadBounds[t] = bounds;
+
+	waitForOtherThreads(state);
+
+	// work out the Morton codes (relative to the bounds of all the centroids)
+	bounds = emptyBox();
+	for (unsigned int i = 0; i < threadCount; ++i)
+	{
+		if (state->threadBounds[i].min.x <= state->threadBounds[i].max.x) growBox(bounds, state->threadBounds[i]);
+	}
+
+	for (unsigned int i = begin; i < end; ++i)
+	{
+		state->keys[i] = mortonCode(state->centroids[i], bounds);
+		state->values[i] = i;
+	}
+
+	waitForOtherThreads(state);
+
+	// radix sort the codes, least significant digit first
+	unsigned int* keys = state->keys, *keysSorted = state->keysSorted;
+	unsigned int* values = state->values, *valuesSorted = state->valuesSorted;
+	unsigned int* histogram = state->histograms + t * RADIX_SIZE;
+
+	for (int pass = 0; pass < RADIX_PASSES; ++pass)
+	{
+		const int shift = pass * RADIX_BITS;
+
+		// count the digits in this thread's share
+		memset(histogram, 0, sizeof(unsigned int) * RADIX_SIZE);
+		for (unsigned int i = begin; i < end; ++i)
+		{
+			histogram[(keys[i] >> shift) & (RADIX_SIZE - 1)]++;
+		}
+
+		waitForOtherThreads(state);
+
+		// where this thread's keys go: after all smaller digits, and after the same digit from earlier threads
+		unsigned int offsets[RADIX_SIZE];
+		unsigned int total = 0;
+		for (int digit = 0; digit < RADIX_SIZE; ++digit)
+		{
+			for (unsigned int i = 0; i < threadCount; ++i)
+			{
+				if (i == t) offsets[digit] = total;
+				total += state->histograms[i * RADIX_SIZE + digit];
+			}
+		}
+
+		// scatter (keeping this thread's keys in order, so the sort is stable)
+		for (unsigned int i = begin; i < end; ++i)
+		{
+			unsigned int position = offsets[(keys[i] >> shift) & (RADIX_SIZE - 1)]++;
+			keysSorted[position] = keys[i];
+			valuesSorted[position] = values[i];
+		}
+
+		waitForOtherThreads(state);
+
+		std::swap(keys, keysSorted);
+		std::swap(values, valuesSorted);
+	}
+
+	// there are an odd number of passes, so the sorted results end up in keysSorted and valuesSorted
+
+	// count the spheres in this thread's share of the sorted primitives
+	unsigned int numSpheres = 0;
+	for (unsigned int i = begin; i < end; ++i)
+	{
+		if (state->valuesSorted[i] < scene->numSpheres) numSpheres++;
+	}
+	state->threadSpheres[t] = numSpheres;
+
+	waitForOtherThreads(state);
+
+	// copy the primitives into Morton order and make a leaf for each one
+	unsigned int sphere = 0;
+	for (unsigned int i = 0; i < t; ++i)
+	{
+		sphere += state->threadSpheres[i];
+	}
+
+	for (unsigned int i = begin; i < end; ++i)
+	{
+		unsigned int index = state->valuesSorted[i];
+		BVHNode& leaf = state->nodes[count - 1 + i];
+
+		leaf.left = leaf.right = 0;
+		leaf.firstSphere = sphere;
+		leaf.firstTriangle = i - sphere;
+
+		if (index < scene->numSpheres)
+		{
+			state->spheres[sphere++] = scene->sphereContainer[index];
+			leaf.bounds = sphereBounds(scene->sphereContainer[index]);
+			leaf.numSpheres = 1;
+			leaf.numTriangles = 0;
+		}
+		else
+		{
+			state->triangles[leaf.firstTriangle] = scene->triangleContainer[index - scene->numSpheres];
+			leaf.bounds = triangleBounds(scene->triangleContainer[index - scene->numSpheres]);
+			leaf.numSpheres = 0;
+			leaf.numTriangles = 1;
+		}
+	}
+
+	// ... and the internal nodes
+	const unsigned int internalBegin = chunkStart(count - 1, t, threadCount), internalEnd = chunkStart(count - 1, t + 1, threadCount);
+	for (unsigned int i = internalBegin; i < internalEnd; ++i)
+	{
+		buildInternalNode(state, i);
+	}
+
+	waitForOtherThreads(state);
+
+	// fill in the internal nodes' bounds
+	for (unsigned int i = begin; i < end; ++i)
+	{
+		buildBoundsUpwards(state, count - 1 + i);
+	}
+
+	// replace the scene's primitives with the Morton ordered versions
+	const unsigned int sphereBegin = chunkStart(scene->numSpheres, t, threadCount), sphereEnd = chunkStart(scene->numSpheres, t + 1, threadCount);
+	memcpy(scene->sphereContainer + sphereBegin, state->spheres + sphereBegin, sizeof(Sphere) * (sphereEnd - sphereBegin));
+
+	const unsigned int triangleBegin = chunkStart(scene->numTriangles, t, threadCount), triangleEnd = chunkStart(scene->numTriangles, t + 1, threadCount);
+	memcpy(scene->triangleContainer + triangleBegin, state->triangles + triangleBegin, sizeof(Triangle) * (triangleEnd - triangleBegin));
+}
+
+
+// build a linear BVH over all of the scene's spheres and triangles using the pool's threads
+void buildLBVH(Scene& scene, ThreadPool* pool)
+{
+	const unsigned int threadCount = pool->threadCount;
+	unsigned int numPrimitives = scene.numSpheres + scene.numTriangles;
+	unsigned int numNodes = numPrimitives == 0 ? 0 : 2 * numPrimitives - 1;
+
+	// reuse the nodes from the last build if there are the right number of them (so rebuilding every frame doesn't allocate)
+	if (scene.numBVHNodes != numNodes)
+	{
+		delete[] scene.bvhNodes;
+		scene.bvhNodes = numNodes == 0 ? NULL : new BVHNode[numNodes]();		// (zeroed, as interior nodes don't use all of their fields)
+		scene.numBVHNodes = numNodes;
+	}
+
+	if (numPrimitives == 0) return;
+
+	LBVHState state;
+	state.scene = &scene;
+	state.numPrimitives = numPrimitives;
+	state.threadCount = threadCount;
+	state.threadBounds = new AABB[threadCount];
+	state.histograms = new unsigned int[threadCount * RADIX_SIZE];
+	state.threadSpheres = new unsigned int[threadCount];
+	state.centroids = new Point[numPrimitives];
+	state.keys = new unsigned int[numPrimitives];
+	state.keysSorted = new unsigned int[numPrimitives];
+	state.values = new unsigned int[numPrimitives];
+	state.valuesSorted = new unsigned int[numPrimitives];
+	state.spheres = new Sphere[scene.numSpheres];
+	state.triangles = new Triangle[scene.numTriangles];
+	state.nodes = scene.bvhNodes;
+	state.parents = new unsigned int[numNodes];
+	state.visits = new unsigned int[numPrimitives];
+	state.barrierCount = 0;
+	state.barrierGeneration = 0;
+
+	runThreadPool(pool, buildLBVHJob, &state);
+
+	scene.bvhBuildCost = bvhCost(scene);
+
+	// clean up
+	delete[] state.threadBounds;
+	delete[] state.histograms;
+	delete[] state.threadSpheres;
+	delete[] state.centroids;
+	delete[] state.keys;
+	delete[] state.keysSorted;
+	delete[] state.values;
+	delete[] state.valuesSorted;
+	delete[] state.spheres;
+	delete[] state.triangles;
+	delete[] state.parents;
+	delete[] (unsigned int*)state.visits;
+}
@@ -0,0 +1,63 @@
+// alias table construction (Vose's method)
+
+#include "LightSampling.h"
+#include <vector>
+
+
+// build the alias table for picking the scene's lights in proportion to their power
+// every slot is picked with the same probability, and then picks either its own light or its alias, so picking a light takes constant time
+// lights with more than the average power fill up the slots of those with less
+void buildLightAliasTable(Scene& scene)
+{
+	unsigned int n = scene.numLights;
+
+	scene.lightAliasProbability = new float[n];
+	scene.lightAlias = new unsigned int[n];
+
+	double totalPower = 0.0;
+	for (unsigned int i = 0; i < n; ++i)
+	{
+		const Colour& intensity = scene.lightContainer[i].intensity;
+		totalPower += intensity.red + intensity.green + intensity.blue;
+	}
+	scene.invLightPower = (float) (1.0 / totalPower);
+
+	// each light's power relative to the average (so slots are full at 1)
+	std::vector<double> scaled(n);
+	std::vector<unsigned int> small, large;
+	for (unsigned int i = 0; i < n; ++i)
+	{
+		const Colour& intensity = scene.lightContainer[i].intensity;
+		scaled[i] = (intensity.red + intensity.green + intensity.blue) * n / totalPower;
+		if (scaled[i] < 1.0) small.push_back(i);
+		else large.push_back(i);
+	}
+
+	// top up each underfull slot with the rest of an overfull one
+	while (!small.empty() && !large.empty())
+	{
+		unsigned int less = small.back();
+		unsigned int more = large.back();
+		small.pop_back();
+		large.pop_back();
+
+		scene.lightAliasProbability[less] = (float) scaled[less];
+		scene.lightAlias[less] = more;
+
+		scaled[more] -= 1.0 - scaled[less];
+		if (scaled[more] < 1.0) small.push_back(more);
+		else large.push_back(more);
+	}
+
+	// whatever is left is full (or only seems not to be because of rounding)
+	for (unsigned int i : large)
+	{
+		scene.lightAliasProbability[i] = 1.0f;
+		scene.lightAlias[i] = i;
+	}
+	for (unsigned int i : small)
+	{
+		scene.lightAliasProbability[i] = 1.0f;
+		scene.lightAlias[i] = i;
+	}
+}
@@ -0,0 +1,24 @@
+// picking lights at random (in proportion to how bright they are), so that each hit only has to apply a few of them
+
+#ifndef __LIGHT_SAMPLING_H
+#define __LIGHT_SAMPLING_H
+
+#include "Scene.h"
+
+// build the alias table for picking the scene's lights in proportion to their power (the sum of their intensity's channels)
+void buildLightAliasTable(Scene& scene);
+
+// pick a light using a random number in [0, 1), and the probability that it was picked
+// the whole part of u * numLights picks a slot of the table, and the fraction picks between the slot's own light and its alias
+inline unsigned int sampleLight(const Scene* scene, const float u, float& probability)
+{
+	float slot = u * scene->numLights;
+	unsigned int i = std::min((unsigned int) slot, scene->numLights - 1);
+	unsigned int light = slot - i < scene->lightAliasProbability[i] ? i : scene->lightAlias[i];
+
+	const Colour& intensity = scene->lightContainer[light].intensity;
+	probability = (intensity.red + intensity.green + intensity.blue) * scene->invLightPower;
+	return light;
+}
+
+#endif // __LIGHT_SAMPLING_H
@@ -0,0 +1,83 @@
+// light tree construction
+// like the top level hierarchy, a simple median split is plenty for a few hundred lights
+
+#include "LightTree.h"
+#include "BVH.h"
+#include <algorithm>
+
+// leaves have this many (or fewer) lights
+const unsigned int LIGHT_TREE_LEAF_SIZE = 8;
+
+
+// recursively build the node for the lights in lightTreeIndexes[begin, end), returns the index of the node
+static unsigned int buildLightTreeNode(Scene& scene, unsigned int begin, unsigned int end)
+{
+	unsigned int nodeIndex = scene.numLightTreeNodes++;
+	LightTreeNode& node = scene.lightTreeNodes[nodeIndex];
+	unsigned int* indexes = scene.lightTreeIndexes;
+	const Light* lights = scene.lightContainer;
+
+	// bounds and total intensity of the lights in this node
+	AABB bounds = emptyBox();
+	node.intensity = Colour(0.0f, 0.0f, 0.0f);
+	for (unsigned int i = begin; i < end; ++i)
+	{
+		growBox(bounds, lights[indexes[i]].pos);
+		node.intensity += lights[indexes[i]].intensity;
+	}
+
+	// (the sphere around the box, which is a bit bigger than it needs to be but is quick to test against)
+	node.centre = centroid(bounds);
+	node.radius = 0.5f * sqrtf((bounds.max - bounds.min).dot());
+
+	node.firstLight = begin;
+	node.numLights = end - begin;
+
+	if (end - begin <= LIGHT_TREE_LEAF_SIZE)
+	{
+		node.left = node.right = 0;
+		return nodeIndex;
+	}
+
+	// split in half along the axis the lights are most spread out along
+	Vector extent = bounds.max - bounds.min;
+	int axis = extent.x > extent.y && extent.x > extent.z ? 0 : (extent.y > extent.z ? 1 : 2);
+	unsigned int middle = (begin + end) / 2;
+
+	std::nth_element(indexes + begin, indexes + middle, indexes + end, [axis, lights](unsigned int a, unsigned int b)
+	{
+		const Point& posA = lights[a].pos;
+		const Point& posB = lights[b].pos;
+		return axis == 0 ? posA.x < posB.x : (axis == 1 ? posA.y < posB.y : posA.z < posB.z);
+	});
+
+	// (node is a reference into the array, so don't use it after the children are built)
+	unsigned int left = buildLightTreeNode(scene, begin, middle);
+	unsigned int right = buildLightTreeNode(scene, middle, end);
+
+	LightTreeNode& parent = scene.lightTreeNodes[nodeIndex];
+	parent.left = left;
+	parent.right = right;
+
+	return nodeIndex;
+}
+
+
+// build the light tree over all of the scene's lights
+void buildLightTree(Scene& scene)
+{
+	scene.numLightTreeNodes = 0;
+	scene.lightTreeNodes = NULL;
+	scene.lightTreeIndexes = NULL;
+
+	if (scene.numLights == 0) return;
+
+	scene.lightTreeIndexes = new unsigned int[scene.numLights];
+	for (unsigned int i = 0; i < scene.numLights; ++i)
+	{
+		scene.lightTreeIndexes[i] = i;
+	}
+
+	scene.lightTreeNodes = new LightTreeNode[2 * scene.numLights - 1];
+	buildLightTreeNode(scene, 0, scene.numLights);
+}
@@ -0,0 +1,26 @@
+// hierarchy over the scene's lights, so that whole clusters of lights that can't add much to a point can be skipped at once
+
+#ifndef __LIGHT_TREE_H
+#define __LIGHT_TREE_H
+
+#include "Scene.h"
+
+// the tree is split down the middle, so is never deeper than this (which is plenty for 2^32 lights), so traversal stacks can be fixed size
+const int LIGHT_TREE_MAX_DEPTH = 33;
+
+// a single node of the light tree
+// every node has a (contiguous) range of lightTreeIndexes, interior nodes split theirs between two children
+typedef struct LightTreeNode
+{
+	Point centre;								// sphere around the positions of every light below this node
+	float radius;
+	Colour intensity;							// total intensity of every light below this node
+	unsigned int left, right;					// child node indexes (both 0 for leaves, as nothing points back at the root)
+	unsigned int firstLight, numLights;			// range of lightTreeIndexes below this node
+} LightTreeNode;
+
+// build the light tree over all of the scene's lights
+// the lights themselves aren't reordered (the tree has its own list of light indexes), so it can be built at any time
+void buildLightTree(Scene& scene);
+
+#endif // __LIGHT_TREE_H
@@ -2,52 +2,297 @@
 Ray tracing tutorial of http://www.codermind.com/articles/Raytracer-in-C++-Introduction-What-is-ray-tracing.html
 It is free to use for educational purpose and cannot be redistributed outside of the tutorial pages. */
 
+#define NOMINMAX			// stop windows.h breaking std::min and std::max
+#include <windows.h>
 #include "Lighting.h"
 #include "Colour.h"
 #include "Intersection.h"
 #include "Texturing.h"
+#include "Grid.h"
+#include "PrimitivesSIMD.h"
+#include "LightTree.h"
+#include "LightSampling.h"
+#include "Cpu.h"
+#include "MathSIMD.h"
 
-// test to see if light ray collides with any of the scene's objects
+// each rendering thread's last occluder of each light, and counts of how useful they were
+typedef struct ShadowCache
+{
+	Occluder* occluders;				// indexed by light (NULL if the thread hasn't set up a cache)
+	unsigned int numOccluders;
+	unsigned long long shadowRays, cacheTests, cacheHits;
+} ShadowCache;
+
+// each rendering thread's counts of how many lights the light tree let it skip
+typedef struct LightCullCounts
+{
+	unsigned long long lights, culledLights;	// lights that could have been applied, and how many of them were skipped
+	double culledBound, output;					// most the skipped lights could have added, and what was added (summed over all hits and channels)
+} LightCullCounts;
+
+// each rendering thread's sums for estimating the variance of picking lights at random
+typedef struct LightSampleCounts
+{
+	unsigned long long hits;
+	double variance, squaredEstimate;			// estimated variance of each hit's lighting, and the square of the lighting itself (summed over all hits)
+} LightSampleCounts;
+
+static __declspec(thread) ShadowCache shadowCache;
+static __declspec(thread) LightCullCounts lightCullCounts;
+static __declspec(thread) LightSampleCounts lightSampleCounts;
+
+// totals from all of the frames that each thread has merged
+static volatile long long totalShadowRays, totalCacheTests, totalCacheHits;
+static volatile long long totalLights, totalCulledLights;
+static volatile double totalCulledBound, totalOutput;
+static volatile long long totalSampledHits;
+static volatile double totalVariance, totalSquaredEstimate;
+
+
+// add to a total shared between threads (there's no interlocked add for doubles, so swap in the new value when nothing else has changed it)
+static void addTotal(volatile double* total, const double value)
+{
+	volatile LONG64* bits = (volatile LONG64*) total;
+	LONG64 before, after;
+	do
+	{
+		before = *bits;
+		double sum = *(double*) &before + value;
+		after = *(LONG64*) &sum;
+	} while (InterlockedCompareExchange64(bits, after, before) != before);
+}
+
+
+// empty the calling thread's cache, and zero its counts
+static void resetThreadLighting()
+{
+	for (unsigned int i = 0; i < shadowCache.numOccluders; ++i)
+	{
+		shadowCache.occluders[i].type = Occluder::NONE;
+	}
+
+	shadowCache.shadowRays = shadowCache.cacheTests = shadowCache.cacheHits = 0;
+	lightCullCounts.lights = lightCullCounts.culledLights = 0;
+	lightCullCounts.culledBound = lightCullCounts.output = 0.0;
+	lightSampleCounts.hits = 0;
+	lightSampleCounts.variance = lightSampleCounts.squaredEstimate = 0.0;
+}
+
+
+// set up the calling thread's cache of the last object to block each light (and its light culling counts)
+void initThreadLighting(const Scene* scene)
+{
+	shadowCache.occluders = new Occluder[scene->numLights];
+	shadowCache.numOccluders = scene->numLights;
+	resetThreadLighting();
+}
+
+
+// add the calling thread's counts to the totals, and start again with an empty cache
+void mergeThreadLighting()
+{
+	InterlockedExchangeAdd64(&totalShadowRays, shadowCache.shadowRays);
+	InterlockedExchangeAdd64(&totalCacheTests, shadowCache.cacheTests);
+	InterlockedExchangeAdd64(&totalCacheHits, shadowCache.cacheHits);
+
+	InterlockedExchangeAdd64(&totalLights, lightCullCounts.lights);
+	InterlockedExchangeAdd64(&totalCulledLights, lightCullCounts.culledLights);
+	addTotal(&totalCulledBound, lightCullCounts.culledBound);
+	addTotal(&totalOutput, lightCullCounts.output);
+
+	InterlockedExchangeAdd64(&totalSampledHits, lightSampleCounts.hits);
+	addTotal(&totalVariance, lightSampleCounts.variance);
+	addTotal(&totalSquaredEstimate, lightSampleCounts.squaredEstimate);
+
+	// (the objects might move before the next frame)
+	resetThreadLighting();
+}
+
+
+// clean up the calling thread's cache
+void freeThreadLighting()
+{
+	delete[] shadowCache.occluders;
+	shadowCache.occluders = NULL;
+}
+
+
+void getShadowCacheStats(unsigned long long* shadowRays, unsigned long long* cacheTests, unsigned long long* cacheHits)
+{
+	*shadowRays = totalShadowRays;
+	*cacheTests = totalCacheTests;
+	*cacheHits = totalCacheHits;
+}
+
+
+void getLightCullStats(unsigned long long* lights, unsigned long long* culledLights, double* errorBound)
+{
+	*lights = totalLights;
+	*culledLights = totalCulledLights;
+	*errorBound = totalOutput > 0.0 ? totalCulledBound / totalOutput : 0.0;
+}
+
+
+void getLightSampleStats(unsigned long long* hits, double* variance, double* relativeError)
+{
+	*hits = totalSampledHits;
+	*variance = totalSampledHits > 0 ? totalVariance / totalSampledHits : 0.0;
+	*relativeError = totalSquaredEstimate > 0.0 ? sqrt(totalVariance / totalSquaredEstimate) : 0.0;
+}
+
+
+// search the scene for anything blocking a light ray (after its cached occluder, if any, has been tried)
 // short-circuits when first intersection discovered, because no matter what the object will be in shadow
-bool isInShadow(const Scene* scene, const Ray* lightRay, const float lightDist)
+// (and whatever blocks it goes in the occluder, if there is one)
+static bool isSceneInShadow(const Scene* scene, const Ray* lightRay, const float t, Occluder* occluder)
 {
-	float t = lightDist;
+	// search the instanced models
+	if (scene->numInstances > 0 && isInstanceIntersected(scene, lightRay, t)) return true;
+
+	// search the acceleration structure (if there is one)
+	if (scene->accelerator == Scene::BVH || scene->accelerator == Scene::LBVH) return isBVHIntersected(scene, lightRay, t, occluder);
+	if (scene->accelerator == Scene::BVH8 || scene->accelerator == Scene::QBVH8) return isBVH8Intersected(scene, lightRay, t, occluder);
+	if (scene->accelerator == Scene::GRID) return isGridIntersected(scene, lightRay, t, occluder);
 
 	// search for sphere collision
-	if (isSphereIntersected(scene, lightRay, t)) return true;
+	if (isSphereIntersected(scene, lightRay, t, occluder)) return true;
 	
 	// search for triangle collision
-	if (isTriangleIntersected(scene, lightRay, t))return true;
+	if (isTriangleIntersected(scene, lightRay, t, occluder))return true;
 
 	// not in shadow
 	return false;
 }
 
 
-// apply diffuse lighting with respect to material's colouring
-Colour applyDiffuse(const Ray* lightRay, const Light* currentLight, const Intersection* intersect)
+// test to see if light ray collides with any of the scene's objects
+// neighbouring points tend to be shadowed by the same object, so whatever blocked the last shadow ray towards the same light is tried first
+// (and the cache is updated with whatever blocks this one)
+bool isInShadow(const Scene* scene, const Ray* lightRay, const float lightDist, const unsigned int lightIndex)
+{
+	float t = lightDist;
+
+	Occluder* occluder = NULL;
+	if (shadowCache.occluders != NULL)
+	{
+		occluder = &shadowCache.occluders[lightIndex];
+		shadowCache.shadowRays++;
+
+		if (occluder->type != Occluder::NONE)
+		{
+			shadowCache.cacheTests++;
+			if (isOccluderIntersected(scene, lightRay, t, occluder))
+			{
+				shadowCache.cacheHits++;
+				return true;
+			}
+
+			// forget it (the search below puts back whatever blocks this ray, if anything does)
+			occluder->type = Occluder::NONE;
+		}
+	}
+
+	return isSceneInShadow(scene, lightRay, t, occluder);
+}
+
+
+// test 8 light rays from the same point at once, given each lane's cached occluder (or NULL if the thread has no cache)
+// each ray still tries its cached occluder first, then the rest go through the scene together
+// (only the linear and binary BVH accelerators have a packet test, so anything else tests the rays one at a time)
+static int areOccludersInShadow(const Scene* scene, const Point& start, const Vector8& dirs, const __m256 dists, int mask, Occluder* occluders)
+{
+	int shadowed = 0;
+	unsigned long lane;
+	Ray lightRay = { start };
+
+	if (occluders != NULL)
+	{
+		for (int remaining = mask; _BitScanForward(&lane, remaining); remaining &= remaining - 1)
+		{
+			shadowCache.shadowRays++;
+			if (occluders[lane].type == Occluder::NONE) continue;
+
+			shadowCache.cacheTests++;
+			lightRay.dir = { dirs.xs.m256_f32[lane], dirs.ys.m256_f32[lane], dirs.zs.m256_f32[lane] };
+			if (isOccluderIntersected(scene, &lightRay, dists.m256_f32[lane], &occluders[lane]))
+			{
+				shadowCache.cacheHits++;
+				shadowed |= 1 << lane;
+			}
+			else
+			{
+				occluders[lane].type = Occluder::NONE;
+			}
+		}
+	}
+
+	int remaining = mask & ~shadowed;
+	if (remaining == 0) return shadowed;
+
+	if (scene->numInstances > 0 || (scene->accelerator != Scene::LINEAR && scene->accelerator != Scene::BVH && scene->accelerator != Scene::LBVH))
+	{
+		for (; _BitScanForward(&lane, remaining); remaining &= remaining - 1)
+		{
+			lightRay.dir = { dirs.xs.m256_f32[lane], dirs.ys.m256_f32[lane], dirs.zs.m256_f32[lane] };
+			if (isSceneInShadow(scene, &lightRay, dists.m256_f32[lane], occluders != NULL ? &occluders[lane] : NULL)) shadowed |= 1 << lane;
+		}
+		return shadowed;
+	}
+
+	return shadowed | shadowPacketIntersection(scene, start, dirs, dists, remaining, occluders);
+}
+
+
+// test 8 light rays from the same point (towards lights firstLight to firstLight + 7) at once, returns a mask of those (of the ones in mask) in shadow
+int areInShadow(const Scene* scene, const Point& start, const Vector8& dirs, const __m256 dists, int mask, const unsigned int firstLight)
 {
-	Colour output;
+	Occluder* occluders = shadowCache.occluders != NULL ? &shadowCache.occluders[firstLight] : NULL;
 
+	return areOccludersInShadow(scene, start, dirs, dists, mask, occluders);
+}
+
+
+// test 8 light rays from the same point (towards lights[0] to lights[7], which can be any of the scene's lights) at once
+// (the lanes' cached occluders are gathered up, so the rays can still be tested as a packet, then put back)
+int areInShadow(const Scene* scene, const Point& start, const Vector8& dirs, const __m256 dists, int mask, const unsigned int* lights)
+{
+	if (shadowCache.occluders == NULL) return areOccludersInShadow(scene, start, dirs, dists, mask, NULL);
+
+	Occluder occluders[8];
+	unsigned long lane;
+	for (int remaining = mask; _BitScanForward(&lane, remaining); remaining &= remaining - 1) occluders[lane] = shadowCache.occluders[lights[lane]];
+
+	int shadowed = areOccludersInShadow(scene, start, dirs, dists, mask, occluders);
+
+	for (int remaining = mask; _BitScanForward(&lane, remaining); remaining &= remaining - 1) shadowCache.occluders[lights[lane]] = occluders[lane];
+
+	return shadowed;
+}
+
+
+// colour of the material at the intersection (before lighting)
+static Colour materialColour(const Intersection* intersect)
+{
 	switch (intersect->material->type)
 	{
-	case Material::GOURAUD:
-		output = intersect->material->diffuse;
-		break;
 	case Material::CHECKERBOARD:
-		output = applyCheckerboard(intersect);
-		break;
+		return applyCheckerboard(intersect);
 	case Material::CIRCLES:
-		output = applyCircles(intersect);
-		break;
+		return applyCircles(intersect);
 	case Material::WOOD:
-		output = applyWood(intersect);
-		break;
+		return applyWood(intersect);
+	default:
+		return intersect->material->diffuse;
 	}
+}
+
 
+// apply diffuse lighting with respect to material's colouring
+Colour applyDiffuse(const Ray* lightRay, const Light* currentLight, const Intersection* intersect)
+{
 	float lambert = lightRay->dir * intersect->normal;
 
-	return lambert * currentLight->intensity * output;
+	return lambert * currentLight->intensity * materialColour(intersect);
 }
 
 
@@ -58,60 +303,395 @@ Colour applyDiffuse(const Ray* lightRay, const Light* currentLight, const Inters
 Colour applySpecular(const Ray* lightRay, const Light* currentLight, const float fLightProjection, const Ray* viewRay, const Intersection* intersect)
 {
 	Vector blinnDir = lightRay->dir - viewRay->dir;
-	float blinn = invsqrtf(blinnDir.dot()) * std::max(fLightProjection - intersect->viewProjection, 0.0f);
-	blinn = powf(blinn, intersect->material->power);
+	float blinn = mathInvsqrtf(blinnDir.dot()) * std::max(fLightProjection - intersect->viewProjection, 0.0f);
+	blinn = mathPowf(blinn, intersect->material->power);
 
 	return blinn * intersect->material->specular * currentLight->intensity;
 }
 
 
-// apply diffuse and specular lighting contributions for all lights in scene taking shadowing into account
-Colour applyLighting(const Scene* scene, const Ray* viewRay, const Intersection* intersect)
+// add the diffuse and specular lighting from a single light (unless it's shadowed)
+// diffuse is the material's colour at the intersection (the same for every light, so worked out once by the caller)
+static __forceinline void applyLight(const Scene* scene, const Ray* viewRay, const Intersection* intersect, const Colour& diffuse, const unsigned int j, Colour& output)
 {
-	// colour to return (starts as black)
-	Colour output(0.0f, 0.0f, 0.0f);
+	// get reference to current light
+	const Light* currentLight = &scene->lightContainer[j];
 
 	// same starting point for each light ray
 	Ray lightRay = { intersect->pos };
 
-	// loop through all the lights
-	for (unsigned int j = 0; j < scene->numLights; ++j)
+	// light ray direction need to equal the normalised vector in the direction of the current light
+	// as we need to reuse all the intermediate components for other calculations, 
+	// we calculate the normalised vector by hand instead of using the normalise function
+	lightRay.dir = currentLight->pos - intersect->pos;
+	float angleBetweenLightAndNormal = lightRay.dir * intersect->normal;
+
+	// skip this light if it's behind the object (ie. both light and normal pointing in the same direction)
+	if (angleBetweenLightAndNormal <= 0.0f)
 	{
-		// get reference to current light
-		const Light* currentLight = &scene->lightContainer[j];
+		return;
+	}
+
+	// distance to light from intersection point (and it's inverse)
+	float lightDist = sqrtf(lightRay.dir.dot());
+	float invLightDist = 1.0f / lightDist;
+
+	// light ray projection
+	float lightProjection = invLightDist * angleBetweenLightAndNormal;
 
-		// light ray direction need to equal the normalised vector in the direction of the current light
-		// as we need to reuse all the intermediate components for other calculations, 
-		// we calculate the normalised vector by hand instead of using the normalise function
-		lightRay.dir = currentLight->pos - intersect->pos;
-		float angleBetweenLightAndNormal = lightRay.dir * intersect->normal;
+	// normalise the light direction
+	lightRay.dir = lightRay.dir * invLightDist;
 
-		// skip this light if it's behind the object (ie. both light and normal pointing in the same direction)
-		if (angleBetweenLightAndNormal <= 0.0f)
+	// only apply lighting from this light if not in shadow of some other object
+	if (!isInShadow(scene, &lightRay, lightDist, j))
+	{
+		// add diffuse lighting from colour / texture (same as applyDiffuse())
+		float lambert = lightRay.dir * intersect->normal;
+		output += lambert * currentLight->intensity * diffuse;
+
+		// add specular lighting
+		output += applySpecular(&lightRay, currentLight, lightProjection, viewRay, intersect);
+	}
+}
+
+
+// cosine of the smallest angle between a direction and any direction into a cone
+// (given the cosine of the angle between the direction and the cone's axis, and the cosine and sine of the cone's half angle)
+static __forceinline float coneCos(const float cosTheta, const float cosAlpha, const float sinAlpha)
+{
+	// theta less than alpha means the direction is inside the cone, otherwise it's cos(theta - alpha)
+	if (cosTheta >= cosAlpha) return 1.0f;
+
+	float sinTheta = sqrtf(std::max(1.0f - cosTheta * cosTheta, 0.0f));
+	return cosTheta * cosAlpha + sinTheta * sinAlpha;
+}
+
+
+// what applying lights 8 at a time needs to know about the intersection (the same for every group of lights, so set up once)
+// and the lighting added so far (one sum per lane)
+typedef struct LightingSIMD
+{
+	Vector8 normal, viewDir;
+	__m256 viewProjections, powers;
+	__m256 diffuseReds, diffuseGreens, diffuseBlues;
+	__m256 specularReds, specularGreens, specularBlues;
+	__m256 reds, greens, blues;
+} LightingSIMD;
+
+static __forceinline LightingSIMD initLightingSIMD(const Ray* viewRay, const Intersection* intersect, const Colour& diffuse)
+{
+	const Colour& specular = intersect->material->specular;
+
+	LightingSIMD lighting;
+	lighting.normal = Vector8(intersect->normal.x, intersect->normal.y, intersect->normal.z);
+	lighting.viewDir = Vector8(viewRay->dir.x, viewRay->dir.y, viewRay->dir.z);
+	lighting.viewProjections = _mm256_set1_ps(intersect->viewProjection);
+	lighting.powers = _mm256_set1_ps(intersect->material->power);
+	lighting.diffuseReds = _mm256_set1_ps(diffuse.red);
+	lighting.diffuseGreens = _mm256_set1_ps(diffuse.green);
+	lighting.diffuseBlues = _mm256_set1_ps(diffuse.blue);
+	lighting.specularReds = _mm256_set1_ps(specular.red);
+	lighting.specularGreens = _mm256_set1_ps(specular.green);
+	lighting.specularBlues = _mm256_set1_ps(specular.blue);
+	lighting.reds = lighting.greens = lighting.blues = _mm256_setzero_ps();
+	return lighting;
+}
+
+// add the diffuse and specular lighting from a group of (up to) 8 lights at once, the same sums as applyLight()
+// mask has the lanes that hold lights, and the shadow rays towards the ones in front of the surface are cast as a packet with areInShadow
+// (which is given the light directions, distances, and mask of lanes to test)
+template <typename ShadowTest>
+static __forceinline void applyLightGroup(const Intersection* intersect, LightingSIMD& lighting, const Vector8& lightPos,
+	const __m256 lightReds, const __m256 lightGreens, const __m256 lightBlues, int mask, ShadowTest areInShadow)
+{
+	const __m256 zeros = _mm256_setzero_ps();
+	const __m256 ones = _mm256_set1_ps(1.0f);
+
+	// each lane's bit (for turning a mask of lanes back into a vector)
+	const __m256i laneBits = _mm256_setr_epi32(1, 2, 4, 8, 16, 32, 64, 128);
+
+	// direction to each light (not normalised yet)
+	Vector8 lightDir = lightPos - Vector8(intersect->pos.x, intersect->pos.y, intersect->pos.z);
+	__m256 angleBetweenLightAndNormals = dot(lightDir, lighting.normal);
+
+	// skip lights behind the object
+	mask &= _mm256_movemask_ps(angleBetweenLightAndNormals > zeros);
+	if (mask == 0) return;
+
+	// distance to each light (and its inverse), light ray projection, and normalised light direction
+	__m256 lightDists = _mm256_sqrt_ps(dot(lightDir, lightDir));
+	__m256 invLightDists = ones / lightDists;
+	__m256 lightProjections = invLightDists * angleBetweenLightAndNormals;
+	lightDir = lightDir * invLightDists;
+
+	// drop the lights that are in the shadow of some other object
+	mask &= ~areInShadow(lightDir, lightDists, mask);
+	if (mask == 0) return;
+
+	__m256 lit = _mm256_castsi256_ps(_mm256_cmpeq_epi32(_mm256_and_si256(_mm256_set1_epi32(mask), laneBits), laneBits));
+
+	// diffuse lighting from colour / texture
+	__m256 lamberts = dot(lightDir, lighting.normal);
+
+	// specular lighting (Blinn)
+	Vector8 blinnDir = lightDir - lighting.viewDir;
+	__m256 blinnDots = dot(blinnDir, blinnDir);
+	__m256 blinns;
+	if (mathAccuracy == MATH_FAST)
+	{
+		blinns = fastRsqrt(SimdFloat<8>{ blinnDots }).v * _mm256_max_ps(lightProjections - lighting.viewProjections, zeros);
+		blinns = fastPow(SimdFloat<8>{ blinns }, SimdFloat<8>{ lighting.powers }).v;
+	}
+	else
+	{
+		blinns = (ones / _mm256_sqrt_ps(blinnDots)) * _mm256_max_ps(lightProjections - lighting.viewProjections, zeros);
+		blinns = simdPow(blinns, lighting.powers);
+	}
+
+	lighting.reds = lighting.reds + (lit & (lamberts * lightReds * lighting.diffuseReds + blinns * lighting.specularReds * lightReds));
+	lighting.greens = lighting.greens + (lit & (lamberts * lightGreens * lighting.diffuseGreens + blinns * lighting.specularGreens * lightGreens));
+	lighting.blues = lighting.blues + (lit & (lamberts * lightBlues * lighting.diffuseBlues + blinns * lighting.specularBlues * lightBlues));
+}
+
+
+// add the diffuse and specular lighting from all of the scene's lights, 8 at a time using the SoA copies of the lights
+static Colour applyLightsSIMD(const Scene* scene, const Ray* viewRay, const Intersection* intersect, const Colour& diffuse)
+{
+	LightingSIMD lighting = initLightingSIMD(viewRay, intersect, diffuse);
+
+	// the last 8 are padded with copies of the last light, which mustn't be applied again
+	const int lastMask = (1 << (scene->numLights - (scene->numLightsSIMD - 1) * 8)) - 1;
+
+	for (unsigned int i = 0; i < scene->numLightsSIMD; ++i)
+	{
+		int mask = i == scene->numLightsSIMD - 1 ? lastMask : 0xFF;
+
+		applyLightGroup(intersect, lighting, Vector8(scene->posX[i], scene->posY[i], scene->posZ[i]), scene->red[i], scene->green[i], scene->blue[i], mask,
+			[&](const Vector8& dirs, const __m256 dists, int mask) { return areInShadow(scene, intersect->pos, dirs, dists, mask, i * 8); });
+	}
+
+	return Colour(horizontalSum(lighting.reds), horizontalSum(lighting.greens), horizontalSum(lighting.blues));
+}
+
+
+// the diffuse and specular lighting from a light tree leaf's lights (all at once, as a leaf has at most 8)
+// the leaf's lights aren't next to each other in the SoA copies, so they're gathered from them
+static Colour applyLeafLightsSIMD(const Scene* scene, const Intersection* intersect, const LightTreeNode* leaf, LightingSIMD& lighting)
+{
+	lighting.reds = lighting.greens = lighting.blues = _mm256_setzero_ps();
+
+	// each lane's light (lanes past the end of the leaf use light 0, but are masked off)
+	unsigned int lights[8] = { 0 };
+	for (unsigned int i = 0; i < leaf->numLights; ++i) lights[i] = scene->lightTreeIndexes[leaf->firstLight + i];
+	const __m256i indexes = _mm256_loadu_si256((const __m256i*) lights);
+
+	Vector8 lightPos(_mm256_i32gather_ps((const float*) scene->posX, indexes, 4), _mm256_i32gather_ps((const float*) scene->posY, indexes, 4),
+		_mm256_i32gather_ps((const float*) scene->posZ, indexes, 4));
+	__m256 lightReds = _mm256_i32gather_ps((const float*) scene->red, indexes, 4);
+	__m256 lightGreens = _mm256_i32gather_ps((const float*) scene->green, indexes, 4);
+	__m256 lightBlues = _mm256_i32gather_ps((const float*) scene->blue, indexes, 4);
+
+	applyLightGroup(intersect, lighting, lightPos, lightReds, lightGreens, lightBlues, (1 << leaf->numLights) - 1,
+		[&](const Vector8& dirs, const __m256 dists, int mask) { return areInShadow(scene, intersect->pos, dirs, dists, mask, lights); });
+
+	return Colour(horizontalSum(lighting.reds), horizontalSum(lighting.greens), horizontalSum(lighting.blues));
+}
+
+
+// most that a cluster of lights can add to the intersection (summed over the three channels)
+// there's no fall off with distance, so this is the cluster's total intensity times the best case of the lambert and blinn terms over the cone
+// of directions towards the sphere around the cluster, and is zero when the whole cluster is behind the surface (so those lights would all have been skipped anyway)
+// the angle between the normal and the blinn vector is at least half the angle between the light and the reflected view ray, which bounds the blinn term
+static float clusterBound(const LightTreeNode* node, const Intersection* intersect, const Colour& diffuse, const Vector& reflected)
+{
+	Vector toCentre = node->centre - intersect->pos;
+	float distSquared = toCentre.dot();
+
+	// inside the sphere, so the light could be in any direction
+	if (distSquared <= node->radius * node->radius)
+	{
+		return node->intensity.red * (diffuse.red + intersect->material->specular.red) +
+			node->intensity.green * (diffuse.green + intersect->material->specular.green) +
+			node->intensity.blue * (diffuse.blue + intersect->material->specular.blue);
+	}
+
+	float invDist = invsqrtf(distSquared);
+	float sinAlpha = node->radius * invDist;
+	float cosAlpha = sqrtf(1.0f - sinAlpha * sinAlpha);
+
+	float lambert = coneCos((toCentre * intersect->normal) * invDist, cosAlpha, sinAlpha);
+	if (lambert <= 0.0f) return 0.0f;
+
+	// cos(angle / 2) from cos(angle)
+	float blinn = sqrtf(std::max(0.5f + 0.5f * coneCos((toCentre * reflected) * invDist, cosAlpha, sinAlpha), 0.0f));
+	blinn = powf(blinn, intersect->material->power);
+
+	const Colour& specular = intersect->material->specular;
+	return node->intensity.red * (lambert * diffuse.red + blinn * specular.red) +
+		node->intensity.green * (lambert * diffuse.green + blinn * specular.green) +
+		node->intensity.blue * (lambert * diffuse.blue + blinn * specular.blue);
+}
+
+
+// apply the lights in the scene's light tree, skipping clusters that can't add more than the scene's threshold of what the lights so far have added
+// the brightest looking clusters are visited first, so that the colour builds up quickly and more of the rest can be skipped
+static Colour applyLightTree(const Scene* scene, const Ray* viewRay, const Intersection* intersect)
+{
+	Colour output(0.0f, 0.0f, 0.0f);
+	Colour diffuse = materialColour(intersect);
+	Vector reflected = viewRay->dir - (intersect->normal * intersect->viewProjection * 2.0f);
+
+	// (for applying each leaf's lights 8 at a time)
+	LightingSIMD lighting;
+	if (instructionSet >= ISA_AVX2) lighting = initLightingSIMD(viewRay, intersect, diffuse);
+
+	// stack of nodes still to visit (and their bounds)
+	const LightTreeNode* stack[LIGHT_TREE_MAX_DEPTH + 1];
+	float bounds[LIGHT_TREE_MAX_DEPTH + 1];
+	int stackSize = 0;
+
+	const LightTreeNode* nodes = scene->lightTreeNodes;
+	stack[stackSize] = &nodes[0];
+	bounds[stackSize++] = clusterBound(&nodes[0], intersect, diffuse, reflected);
+
+	while (stackSize > 0)
+	{
+		const LightTreeNode* node = stack[--stackSize];
+		float bound = bounds[stackSize];
+
+		// every light in the cluster is behind the surface
+		if (bound <= 0.0f) continue;
+
+		// skip the cluster
+		if (bound < scene->lightCullThreshold * (output.red + output.green + output.blue))
 		{
+			lightCullCounts.culledLights += node->numLights;
+			lightCullCounts.culledBound += bound;
 			continue;
 		}
 
-		// distance to light from intersection point (and it's inverse)
-		float lightDist = sqrtf(lightRay.dir.dot());
-		float invLightDist = 1.0f / lightDist;
+		// (8 at a time needs AVX2, so older CPUs apply the leaf's lights one at a time)
+		if (node->left == 0)
+		{
+			if (instructionSet < ISA_AVX2)
+			{
+				for (unsigned int i = 0; i < node->numLights; ++i)
+				{
+					applyLight(scene, viewRay, intersect, diffuse, scene->lightTreeIndexes[node->firstLight + i], output);
+				}
+			}
+			else
+			{
+				output += applyLeafLightsSIMD(scene, intersect, node, lighting);
+			}
+			continue;
+		}
 
-		// light ray projection
-		float lightProjection = invLightDist * angleBetweenLightAndNormal;
+		// push the child with the bigger bound last, so it gets visited first
+		const LightTreeNode* left = &nodes[node->left];
+		const LightTreeNode* right = &nodes[node->right];
+		float leftBound = clusterBound(left, intersect, diffuse, reflected);
+		float rightBound = clusterBound(right, intersect, diffuse, reflected);
+		if (leftBound > rightBound)
+		{
+			std::swap(left, right);
+			std::swap(leftBound, rightBound);
+		}
+		stack[stackSize] = left;
+		bounds[stackSize++] = leftBound;
+		stack[stackSize] = right;
+		bounds[stackSize++] = rightBound;
+	}
 
-		// normalise the light direction
-		lightRay.dir = lightRay.dir * invLightDist;
+	lightCullCounts.lights += scene->numLights;
+	lightCullCounts.output += output.red + output.green + output.blue;
 
-		// only apply lighting from this light if not in shadow of some other object
-		if (!isInShadow(scene, &lightRay, lightDist))
-		{
-			// add diffuse lighting from colour / texture
-			output += applyDiffuse(&lightRay, currentLight, intersect);
+	return output;
+}
 
-			// add specular lighting
-			output += applySpecular(&lightRay, currentLight, lightProjection, viewRay, intersect);
-		}
+
+// random numbers for picking lights, seeded from the hit position so that images don't depend on which thread rendered what
+// (a hash of the position's bits to start, then a PCG style step and output permutation for each number)
+static __forceinline unsigned int seedRandom(const Point& pos)
+{
+	const unsigned int* bits = (const unsigned int*) &pos;
+	unsigned int seed = bits[0] * 0x9E3779B1u ^ bits[1] * 0x85EBCA77u ^ bits[2] * 0xC2B2AE3Du;
+	seed ^= seed >> 16;
+	seed *= 0x7FEB352Du;
+	seed ^= seed >> 15;
+	return seed;
+}
+
+static __forceinline float nextRandom(unsigned int& state)
+{
+	state = state * 747796405u + 2891336453u;
+	unsigned int word = ((state >> ((state >> 28) + 4)) ^ state) * 277803737u;
+	word ^= word >> 22;
+
+	// top 24 bits, so the result is always less than 1
+	return (word >> 8) * (1.0f / 16777216.0f);
+}
+
+
+// apply scene->lightSamples lights picked at random (in proportion to their power), each scaled by one over the chance of picking it
+// so that on average it's the same as applying all of the lights
+// the spread of the picked lights' (scaled) contributions gives an estimate of the variance of the result
+static Colour applyLightSamples(const Scene* scene, const Ray* viewRay, const Intersection* intersect)
+{
+	Colour output(0.0f, 0.0f, 0.0f);
+	Colour diffuse = materialColour(intersect);
+
+	unsigned int random = seedRandom(intersect->pos);
+	const unsigned int samples = scene->lightSamples;
+	const float invSamples = 1.0f / samples;
+	float sum = 0.0f, sumSquared = 0.0f;
+
+	for (unsigned int i = 0; i < samples; ++i)
+	{
+		float probability;
+		unsigned int j = sampleLight(scene, nextRandom(random), probability);
+
+		Colour light(0.0f, 0.0f, 0.0f);
+		applyLight(scene, viewRay, intersect, diffuse, j, light);
+
+		float scale = 1.0f / probability;
+		output += (scale * invSamples) * light;
+
+		float estimate = scale * (light.red + light.green + light.blue);
+		sum += estimate;
+		sumSquared += estimate * estimate;
 	}
 
+	// variance of the mean of the picked lights (the sample variance over the number of samples), which needs at least two of them
+	float mean = sum * invSamples;
+	if (samples > 1)
+	{
+		float variance = std::max(sumSquared - sum * mean, 0.0f) / (samples - 1);
+		lightSampleCounts.variance += variance * invSamples;
+	}
+	lightSampleCounts.squaredEstimate += mean * mean;
+	lightSampleCounts.hits++;
+
 	return output;
 }
+
+
+// apply diffuse and specular lighting contributions for all lights in scene taking shadowing into account
+Colour applyLighting(const Scene* scene, const Ray* viewRay, const Intersection* intersect)
+{
+	if (scene->lightSamples > 0) return applyLightSamples(scene, viewRay, intersect);
+	if (scene->lightTreeNodes != NULL) return applyLightTree(scene, viewRay, intersect);
+
+	if (scene->numLights == 0) return Colour(0.0f, 0.0f, 0.0f);
+
+	// the 8 lights at a time version needs AVX2, so older CPUs apply them one at a time
+	if (instructionSet < ISA_AVX2)
+	{
+		Colour diffuse = materialColour(intersect);
+		Colour output(0.0f, 0.0f, 0.0f);
+		for (unsigned int j = 0; j < scene->numLights; ++j) applyLight(scene, viewRay, intersect, diffuse, j, output);
+		return output;
+	}
+
+	return applyLightsSIMD(scene, viewRay, intersect, materialColour(intersect));
+}
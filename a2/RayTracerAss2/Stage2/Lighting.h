@@ -8,8 +8,35 @@
 #include "Scene.h"
 #include "Intersection.h"
 
-// test to see if light ray collides with any of the scene's objects
-bool isInShadow(const Scene* scene, const Ray* lightRay, const float lightDist);
+// test to see if light ray (towards the given light) collides with any of the scene's objects
+bool isInShadow(const Scene* scene, const Ray* lightRay, const float lightDist, const unsigned int lightIndex);
+
+// test 8 light rays from the same point (towards lights firstLight to firstLight + 7) at once, returns a mask of those (of the ones in mask) in shadow
+int areInShadow(const Scene* scene, const Point& start, const Vector8& dirs, const __m256 dists, int mask, const unsigned int firstLight);
+
+// the same, but towards lights[0] to lights[7] (any 8 of the scene's lights, e.g. a light tree leaf's)
+int areInShadow(const Scene* scene, const Point& start, const Vector8& dirs, const __m256 dists, int mask, const unsigned int* lights);
+
+// set up (and clean up) the calling thread's cache of the last object to block each light, and its light culling counts
+// shadow rays are tested against the cached object before the rest of the scene (so rendering threads should always set one up)
+// (done once for each thread, which then keeps its cache from one frame to the next)
+void initThreadLighting(const Scene* scene);
+void freeThreadLighting();
+
+// add the calling thread's counts to the totals, and empty its cache, ready for the next frame (at the end of each frame)
+void mergeThreadLighting();
+
+// number of shadow rays, how many of them had a cached object to try, and how many were blocked by it (totals from all merged frames)
+void getShadowCacheStats(unsigned long long* shadowRays, unsigned long long* cacheTests, unsigned long long* cacheHits);
+
+// number of lights that could have been applied, and how many of them the light tree skipped (totals from all merged frames)
+// errorBound is the most the skipped lights could have added, as a fraction of all the lighting that was applied
+void getLightCullStats(unsigned long long* lights, unsigned long long* culledLights, double* errorBound);
+
+// number of hits that picked lights at random, the average estimated variance of their lighting (summed over the channels),
+// and the square root of the total variance relative to the total squared lighting
+// (the variance is only estimated with 2 or more lights at each hit, so both are 0 with 1)
+void getLightSampleStats(unsigned long long* hits, double* variance, double* relativeError);
 
 // apply diffuse lighting with respect to material's colouring
 Colour applyDiffuse(const Ray* lightRay, const Light* currentLight, const Intersection* intersect);
@@ -18,6 +45,8 @@ Colour applyDiffuse(const Ray* lightRay, const Light* currentLight, const Inters
 Colour applySpecular(const Ray* lightRay, const Light* currentLight, const float fLightProjection, const Ray* viewRay, const Intersection* intersect);
 
 // apply diffuse and specular lighting contributions for all lights in scene taking shadowing into account
+// with a light tree, clusters of lights that can't add more than scene->lightCullThreshold of the colour so far are skipped
+// with light sampling, only scene->lightSamples lights picked at random are applied (and scaled up to make up for the rest)
 Colour applyLighting(const Scene* scene, const Ray* viewRay, const Intersection* intersect); 
 
 
@@ -0,0 +1,5 @@
+// which versions of the maths functions shading and texturing use (see MathSIMD.h)
+
+#include "MathSIMD.h"
+
+MathAccuracy mathAccuracy = MATH_EXACT;
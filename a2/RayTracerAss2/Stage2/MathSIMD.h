@@ -0,0 +1,161 @@
+// fast replacements for the maths library functions that shading and texturing use (exp, log, pow, sin, cos, and 1 / sqrt)
+// (geometry, e.g. normalise(), always uses the maths library, as a ray that moves slightly can fall through the gap between two triangles)
+// each one is written once against SimdVector.h's types, so works 4, 8, or 16 wide, and the scalar versions just use one lane of the 4 wide ones
+// they're only used when mathAccuracy is MATH_FAST (-fastMath), as they trade accuracy for speed (up to about 1e-4 relative error, see each function)
+// (otherwise the scalar code uses the maths library, and the 8 wide lighting uses the more accurate simdPow() from PrimitivesSIMD.h)
+
+#ifndef __MATH_SIMD_H
+#define __MATH_SIMD_H
+
+#include <cmath>
+#include "SimdVector.h"
+
+// which versions of the maths functions to use
+typedef enum MathAccuracy { MATH_EXACT, MATH_FAST } MathAccuracy;
+
+extern MathAccuracy mathAccuracy;
+
+
+// ---- any width ----
+
+// 2^x (anything outside [-126, 127] is clamped to it)
+// Taylor series of e^r for r in [-ln(2) / 2, ln(2) / 2], so less than 6e-5 relative error
+template <int Width>
+__forceinline SimdFloat<Width> fastExp2(SimdFloat<Width> x)
+{
+	typedef SimdFloat<Width> Floats;
+
+	x = minimum(maximum(x, Floats::broadcast(-126.0f)), Floats::broadcast(127.0f));
+
+	// 2^x = 2^n * e^(r ln 2), with n the nearest whole number
+	Floats n = round(x);
+	Floats r = (x - n) * Floats::broadcast(0.693147181f);
+
+	Floats p = Floats::broadcast(1.0f / 24.0f);
+	p = p * r + Floats::broadcast(1.0f / 6.0f);
+	p = p * r + Floats::broadcast(0.5f);
+	p = p * r + Floats::broadcast(1.0f);
+	p = p * r + Floats::broadcast(1.0f);
+
+	// 2^n made directly from its exponent bits
+	return p * asFloat((toInt(n) + SimdInt<Width>::broadcast(127)) << 23);
+}
+
+// e^x (as fastExp2())
+template <int Width>
+__forceinline SimdFloat<Width> fastExp(const SimdFloat<Width> x)
+{
+	return fastExp2(x * SimdFloat<Width>::broadcast(1.44269504f));
+}
+
+// base 2 logarithm (of positive, normal numbers)
+// ln(m) = 2 atanh((m - 1) / (m + 1)) for the mantissa m in [sqrt(1/2), sqrt(2)), so less than 2e-7 absolute error
+template <int Width>
+__forceinline SimdFloat<Width> fastLog2(const SimdFloat<Width> x)
+{
+	typedef SimdFloat<Width> Floats;
+	typedef SimdInt<Width> Ints;
+
+	// split into exponent and a mantissa in [1, 2), then move the mantissa to [sqrt(1/2), sqrt(2)) so that it's close to 1
+	Ints bits = asInt(x);
+	Floats exponents = toFloat((bits >> 23) - Ints::broadcast(127));
+	Floats mantissas = asFloat((bits & Ints::broadcast(0x007FFFFF)) | Ints::broadcast(0x3F800000));
+
+	SimdMask<Width> bigs = mantissas > Floats::broadcast(1.41421356f);
+	mantissas = select(bigs, mantissas * Floats::broadcast(0.5f), mantissas);
+	exponents = select(bigs, exponents + Floats::broadcast(1.0f), exponents);
+
+	Floats s = (mantissas - Floats::broadcast(1.0f)) / (mantissas + Floats::broadcast(1.0f));
+	Floats s2 = s * s;
+	Floats p = Floats::broadcast(1.0f / 7.0f);
+	p = p * s2 + Floats::broadcast(1.0f / 5.0f);
+	p = p * s2 + Floats::broadcast(1.0f / 3.0f);
+	p = p * s2 + Floats::broadcast(1.0f);
+
+	// 2 / ln(2) turns 2 atanh into a base 2 logarithm
+	return s * p * Floats::broadcast(2.88539008f) + exponents;
+}
+
+// natural logarithm (as fastLog2())
+template <int Width>
+__forceinline SimdFloat<Width> fastLog(const SimdFloat<Width> x)
+{
+	return fastLog2(x) * SimdFloat<Width>::broadcast(0.693147181f);
+}
+
+// x^y (for x >= 0, and 0 when x is 0)
+// the logarithm's error gets multiplied by y, so this is about 1e-4 relative error at a power of 60 (the usual specular power)
+template <int Width>
+__forceinline SimdFloat<Width> fastPow(const SimdFloat<Width> x, const SimdFloat<Width> y)
+{
+	return select(x > SimdFloat<Width>::broadcast(0.0f), fastExp2(y * fastLog2(x)), SimdFloat<Width>::broadcast(0.0f));
+}
+
+// sin(x + quadrant * pi / 2)
+// x is reduced to r in [-pi / 4, pi / 4] (in two steps, so that it stays accurate for the sort of angles a scene has),
+// then the Taylor series of sin(r) or cos(r) are used, so less than 4e-5 absolute error
+template <int Width>
+__forceinline SimdFloat<Width> sinQuadrant(const SimdFloat<Width> x, const int quadrant)
+{
+	typedef SimdFloat<Width> Floats;
+	typedef SimdInt<Width> Ints;
+
+	Floats q = round(x * Floats::broadcast(0.636619772f));
+	Floats r = (x - q * Floats::broadcast(1.57079637f)) - q * Floats::broadcast(-4.37113900e-8f);
+	Floats r2 = r * r;
+
+	Floats sins = Floats::broadcast(1.0f / 120.0f);
+	sins = sins * r2 + Floats::broadcast(-1.0f / 6.0f);
+	sins = sins * r2 * r + r;
+
+	Floats coss = Floats::broadcast(-1.0f / 720.0f);
+	coss = coss * r2 + Floats::broadcast(1.0f / 24.0f);
+	coss = coss * r2 + Floats::broadcast(-0.5f);
+	coss = coss * r2 + Floats::broadcast(1.0f);
+
+	// sin(r), cos(r), -sin(r), -cos(r) for each quadrant
+	Ints quadrants = toInt(q) + Ints::broadcast(quadrant);
+	Floats values = select(Ints::broadcast(0) < (quadrants & Ints::broadcast(1)), coss, sins);
+	return asFloat(asInt(values) ^ ((quadrants & Ints::broadcast(2)) << 30));
+}
+
+template <int Width>
+__forceinline SimdFloat<Width> fastSin(const SimdFloat<Width> x)
+{
+	return sinQuadrant(x, 0);
+}
+
+template <int Width>
+__forceinline SimdFloat<Width> fastCos(const SimdFloat<Width> x)
+{
+	return sinQuadrant(x, 1);
+}
+
+// 1 / sqrt(x) (for x > 0)
+// the hardware estimate with one step of Newton's method, so less than 1e-6 relative error
+template <int Width>
+__forceinline SimdFloat<Width> fastRsqrt(const SimdFloat<Width> x)
+{
+	typedef SimdFloat<Width> Floats;
+
+	Floats y = rsqrtEstimate(x);
+	return y * (Floats::broadcast(1.5f) - Floats::broadcast(0.5f) * x * y * y);
+}
+
+
+// ---- scalar versions (one lane of the 4 wide ones) ----
+
+__forceinline float fastExpf(const float x) { return _mm_cvtss_f32(fastExp(SimdFloat<4>::broadcast(x)).v); }
+__forceinline float fastPowf(const float x, const float y) { return _mm_cvtss_f32(fastPow(SimdFloat<4>::broadcast(x), SimdFloat<4>::broadcast(y)).v); }
+__forceinline float fastSinf(const float x) { return _mm_cvtss_f32(fastSin(SimdFloat<4>::broadcast(x)).v); }
+__forceinline float fastCosf(const float x) { return _mm_cvtss_f32(fastCos(SimdFloat<4>::broadcast(x)).v); }
+__forceinline float fastInvsqrtf(const float x) { return _mm_cvtss_f32(fastRsqrt(SimdFloat<4>::broadcast(x)).v); }
+
+// the maths library, or the fast versions (depending on mathAccuracy)
+__forceinline float mathExpf(const float x) { return mathAccuracy == MATH_FAST ? fastExpf(x) : expf(x); }
+__forceinline float mathPowf(const float x, const float y) { return mathAccuracy == MATH_FAST ? fastPowf(x, y) : powf(x, y); }
+__forceinline float mathSinf(const float x) { return mathAccuracy == MATH_FAST ? fastSinf(x) : sinf(x); }
+__forceinline float mathCosf(const float x) { return mathAccuracy == MATH_FAST ? fastCosf(x) : cosf(x); }
+__forceinline float mathInvsqrtf(const float x) { return mathAccuracy == MATH_FAST ? fastInvsqrtf(x) : 1.0f / sqrtf(x); }
+
+#endif // __MATH_SIMD_H
@@ -56,6 +56,7 @@ struct Vector8
 __forceinline Vector8 operator - (const Vector8& v1, const Vector8& v2) { return { v1.xs - v2.xs, v1.ys - v2.ys, v1.zs - v2.zs }; }
 __forceinline Vector8 operator + (const Vector8& v1, const Vector8& v2) { return { v1.xs + v2.xs, v1.ys + v2.ys, v1.zs + v2.zs }; }
 __forceinline Vector8 operator * (const Vector8& v1, const Vector8& v2) { return { v1.xs * v2.xs, v1.ys * v2.ys, v1.zs * v2.zs }; }
+__forceinline Vector8 operator * (const Vector8& v, const __m256 c) { return { v.xs * c, v.ys * c, v.zs * c }; }
 
 __forceinline Vector8 cross(const Vector8& v1, const Vector8& v2)
 {
@@ -77,6 +78,107 @@ __forceinline __m256i select(__m256i cond, __m256i ifTrue, __m256i ifFalse)
 	return _mm256_or_si256(_mm256_and_si256(cond, ifTrue), _mm256_andnot_si256(cond, ifFalse));
 }
 
+// helper function to find "horizontal" minimum (and corresponding index value from another vector)
+__forceinline void selectMinimumAndIndex(__m256 values, __m256i indexes, float* min, int* index)
+{
+	// find min of elements 1&2, 3&4, 5&6, and 7&8
+	__m256 minNeighbours = _mm256_min_ps(values, _mm256_permute_ps(values, 0x31));
+	// find min of min(1,2)&min(5,6) and min(3,4)&min(7,8)
+	__m256 minNeighbours2 = _mm256_min_ps(minNeighbours, _mm256_permute2f128_ps(minNeighbours, minNeighbours, 0x05));
+	// find final minimum 
+	__m256 mins = _mm256_min_ps(minNeighbours2, _mm256_permute_ps(minNeighbours2, 0x02));
+
+	// find all elements that match our minimum
+	__m256i matchingTs = _mm256_castps_si256(_mm256_set1_ps(mins.m256_f32[0]) != values);
+	// set all other elements to be MAX_INT (-1 but unsigned)
+	__m256i matchingIndexes = matchingTs | indexes;
+
+	// find minimum of remaining indexes (so smallest index will be chosen) using that same technique as above but with heaps of ugly casts
+	__m256i minIndexNeighbours = _mm256_min_epu32(matchingIndexes, _mm256_castps_si256(_mm256_permute_ps(_mm256_castsi256_ps(matchingIndexes), 0x31)));
+	__m256i minIndexNeighbours2 = _mm256_min_epu32(minIndexNeighbours, _mm256_castps_si256(_mm256_permute2f128_ps(
+		_mm256_castsi256_ps(minIndexNeighbours), _mm256_castsi256_ps(minIndexNeighbours), 0x05)));
+	__m256i minIndex = _mm256_min_epu32(minIndexNeighbours2, _mm256_castps_si256(_mm256_permute_ps(_mm256_castsi256_ps(minIndexNeighbours2), 0x02)));
+
+	// "return" minimum and associated index through reference parameters
+	*min = mins.m256_f32[0];
+	*index = minIndex.m256i_i32[0];
+}
+
+// sum of all 8 elements
+__forceinline float horizontalSum(__m256 values)
+{
+	__m128 sums = _mm_add_ps(_mm256_castps256_ps128(values), _mm256_extractf128_ps(values, 1));
+	sums = _mm_add_ps(sums, _mm_movehl_ps(sums, sums));
+	sums = _mm_add_ss(sums, _mm_shuffle_ps(sums, sums, 0x55));
+	return _mm_cvtss_f32(sums);
+}
+
+
+// ---- replacements for the maths library (there's no SIMD logf / expf / powf in the intrinsics) ----
+// these use the same polynomials as the Cephes library's single precision functions, so the logarithm and exponential are within a couple of ulps
+// of the real thing (the power loses a bit more for big powers, as the logarithm's error gets multiplied, e.g. about 1e-5 relative error at a power of 60)
+
+// 8 base 2 logarithms (of positive, normal numbers)
+__forceinline __m256 simdLog2(__m256 x)
+{
+	const __m256 ones = _mm256_set1_ps(1.0f);
+
+	// split into exponent and a mantissa in [1, 2), then move the mantissa to [sqrt(1/2), sqrt(2)) so that it's close to 1
+	__m256i bits = _mm256_castps_si256(x);
+	__m256 exponents = _mm256_cvtepi32_ps(_mm256_sub_epi32(_mm256_srli_epi32(bits, 23), _mm256_set1_epi32(127)));
+	__m256 mantissas = _mm256_castsi256_ps(_mm256_or_si256(_mm256_and_si256(bits, _mm256_set1_epi32(0x007FFFFF)), _mm256_set1_epi32(0x3F800000)));
+
+	__m256 bigs = mantissas > _mm256_set1_ps(1.41421356f);
+	mantissas = select(bigs, mantissas * _mm256_set1_ps(0.5f), mantissas);
+	exponents = exponents + (bigs & ones);
+
+	// ln(1 + f) = f - f^2 / 2 + f^3 * P(f)
+	__m256 f = mantissas - ones;
+	__m256 f2 = f * f;
+	__m256 p = _mm256_set1_ps(7.0376836292e-2f);
+	p = p * f + _mm256_set1_ps(-1.1514610310e-1f);
+	p = p * f + _mm256_set1_ps(1.1676998740e-1f);
+	p = p * f + _mm256_set1_ps(-1.2420140846e-1f);
+	p = p * f + _mm256_set1_ps(1.4249322787e-1f);
+	p = p * f + _mm256_set1_ps(-1.6668057665e-1f);
+	p = p * f + _mm256_set1_ps(2.0000714765e-1f);
+	p = p * f + _mm256_set1_ps(-2.4999993993e-1f);
+	p = p * f + _mm256_set1_ps(3.3333331174e-1f);
+	__m256 logs = f + (p * f * f2 - _mm256_set1_ps(0.5f) * f2);
+
+	return logs * _mm256_set1_ps(1.44269504f) + exponents;
+}
+
+// 8 powers of 2 (anything outside [-126, 127] is clamped to it)
+__forceinline __m256 simdExp2(__m256 x)
+{
+	x = _mm256_min_ps(_mm256_max_ps(x, _mm256_set1_ps(-126.0f)), _mm256_set1_ps(127.0f));
+
+	// 2^x = 2^n * e^(r ln 2), with n the nearest whole number and r in [-0.5, 0.5]
+	__m256 n = _mm256_round_ps(x, _MM_FROUND_TO_NEAREST_INT | _MM_FROUND_NO_EXC);
+	__m256 r = (x - n) * _mm256_set1_ps(0.693147181f);
+
+	// e^r = 1 + r + r^2 * P(r)
+	__m256 p = _mm256_set1_ps(1.9875691500e-4f);
+	p = p * r + _mm256_set1_ps(1.3981999507e-3f);
+	p = p * r + _mm256_set1_ps(8.3334519073e-3f);
+	p = p * r + _mm256_set1_ps(4.1665795894e-2f);
+	p = p * r + _mm256_set1_ps(1.6666665459e-1f);
+	p = p * r + _mm256_set1_ps(5.0000001201e-1f);
+	__m256 exps = p * r * r + r + _mm256_set1_ps(1.0f);
+
+	// 2^n made directly from its exponent bits
+	__m256 scales = _mm256_castsi256_ps(_mm256_slli_epi32(_mm256_add_epi32(_mm256_cvtps_epi32(n), _mm256_set1_epi32(127)), 23));
+
+	return exps * scales;
+}
+
+// 8 x^y (for x >= 0, and 0 when x is 0)
+__forceinline __m256 simdPow(__m256 x, __m256 y)
+{
+	return simdExp2(y * simdLog2(x)) & (x > _mm256_setzero_ps());
+}
+
 
 #endif
 
@@ -11,9 +11,27 @@ It is free to use for educational purpose and cannot be redistributed outside of
 #include "Lighting.h"
 #include "Intersection.h"
 #include "ImageIO.h"
+#include "BVH.h"
+#include "Grid.h"
+#include "Instance.h"
+#include "LightTree.h"
+#include "LightSampling.h"
+#include "Cache.h"
+#include "Benchmark.h"
+#include "Frustum.h"
+#include "Camera.h"
+#include "Tonemap.h"
+#include "Cpu.h"
+#include "MathSIMD.h"
 
 unsigned int buffer[MAX_WIDTH * MAX_HEIGHT];
 
+// the linear colour of every pixel of the last frame rendered (the buffer is this, tonemapped)
+HDRFrame frame;
+
+// how to colourise each block of the frame when it's tonemapped (by which thread rendered it, or 7 for not at all)
+unsigned char blockColourMasks[MAX_WIDTH * MAX_HEIGHT];
+
 // reflect the ray from an object
 Ray calculateReflection(const Ray* viewRay, const Intersection* intersect)
 {
@@ -61,7 +79,8 @@ Ray calculateRefraction(const Ray* viewRay, const Intersection* intersect, float
 
 
 // follow a single ray until it's final destination (or maximum number of steps reached)
-Colour traceRay(const Scene* scene, Ray viewRay)
+// the ray's first intersection can be passed in if it has already been found (i.e. by tracing a packet of primary rays)
+Colour traceRay(const Scene* scene, Ray viewRay, const Intersection* firstIntersect = NULL)
 {
 	Colour output(0.0f, 0.0f, 0.0f); 								// colour value to be output
 	float currentRefractiveIndex = DEFAULT_REFRACTIVE_INDEX;		// current refractive index
@@ -73,7 +92,12 @@ Colour traceRay(const Scene* scene, Ray viewRay)
 	{
 		// check for intersections between the view ray and any of the objects in the scene
 		// exit the loop if no intersection found
-		if (!objectIntersection(scene, &viewRay, &intersect)) break;
+		if (level == 0 && firstIntersect != NULL)
+		{
+			intersect = *firstIntersect;
+			if (intersect.objectType == Intersection::NONE) break;
+		}
+		else if (!objectIntersection(scene, &viewRay, &intersect)) break;
 
 		// calculate response to collision: ie. get normal at point of collision and material of object
 		calculateIntersectionResponse(scene, &viewRay, &intersect);
@@ -110,11 +134,272 @@ Colour traceRay(const Scene* scene, Ray viewRay)
 	return output;
 }
 
+// ---- wavefront rendering ----
+
+// a ray waiting to be traced in a stream (with everything traceRay() would otherwise keep in its loop)
+typedef struct StreamRay
+{
+	Ray ray;
+	float coef;						// amount of ray left to transmit (including the sample's share of its pixel)
+	float refractiveIndex;			// current refractive index
+	unsigned int pixel;				// pixel (within the block) the ray adds to
+} StreamRay;
+
+// every ray of a block, one bounce at a time (one per thread, reused for each block)
+typedef struct RayStream
+{
+	unsigned int maxRays;
+	StreamRay* rays, *nextRays;		// rays being traced, and the rays they spawn for the next bounce
+	Intersection* intersects;		// closest intersection for each ray being traced
+	unsigned int* keys, *keysSorted;				// sort keys of the spawned rays (sorted back and forth between the two)
+	unsigned int* indexes, *indexesSorted;			// spawned ray indexes (sorted along with the keys)
+	Colour* colours;				// colour of each pixel of the block
+} RayStream;
+
+// stream rays are sorted by the cell (of a 16x16x16 grid) that they start in, and the octant they head towards
+const int STREAM_CELL_BITS = 4;
+const int STREAM_RADIX_BITS = 8;
+const int STREAM_RADIX_SIZE = 1 << STREAM_RADIX_BITS;
+const int STREAM_RADIX_PASSES = 2;	// (has to be even, so that the sorted results end up back in keys/indexes)
+
+// make space for a block's rays (all of the samples of all of its pixels)
+void initRayStream(RayStream* stream, const int blockSize, const int aaLevel)
+{
+	stream->maxRays = blockSize * blockSize * aaLevel * aaLevel;
+	stream->rays = (StreamRay*)_aligned_malloc(sizeof(StreamRay) * stream->maxRays, 64);
+	stream->nextRays = (StreamRay*)_aligned_malloc(sizeof(StreamRay) * stream->maxRays, 64);
+	stream->intersects = (Intersection*)_aligned_malloc(sizeof(Intersection) * stream->maxRays, 64);
+	stream->keys = (unsigned int*)_aligned_malloc(sizeof(unsigned int) * stream->maxRays, 64);
+	stream->keysSorted = (unsigned int*)_aligned_malloc(sizeof(unsigned int) * stream->maxRays, 64);
+	stream->indexes = (unsigned int*)_aligned_malloc(sizeof(unsigned int) * stream->maxRays, 64);
+	stream->indexesSorted = (unsigned int*)_aligned_malloc(sizeof(unsigned int) * stream->maxRays, 64);
+	stream->colours = (Colour*)_aligned_malloc(sizeof(Colour) * blockSize * blockSize, 64);
+}
+
+void freeRayStream(RayStream* stream)
+{
+	_aligned_free(stream->rays);
+	_aligned_free(stream->nextRays);
+	_aligned_free(stream->intersects);
+	_aligned_free(stream->keys);
+	_aligned_free(stream->keysSorted);
+	_aligned_free(stream->indexes);
+	_aligned_free(stream->indexesSorted);
+	_aligned_free(stream->colours);
+}
+
+// spread the low bits of a cell coordinate out so they can be interleaved with the other axes
+inline unsigned int spreadCellBits(unsigned int x)
+{
+	x = (x | (x << 4)) & 0x0C3;
+	x = (x | (x << 2)) & 0x249;
+	return x;
+}
+
+// reorder the spawned rays so that rays starting near each other and heading the same way are traced together
+// (the key is the ray's octant, then the Morton order of its cell within the bounds of all the rays' starting points)
+void sortRayStream(RayStream* stream, const unsigned int numRays, const Point& boundsMin, const Point& boundsMax)
+{
+	const float cells = float(1 << STREAM_CELL_BITS);
+	const unsigned int maxCell = (1 << STREAM_CELL_BITS) - 1;
+	const Vector extent = boundsMax - boundsMin;
+	const Vector scale = { extent.x > 0.0f ? cells / extent.x : 0.0f, extent.y > 0.0f ? cells / extent.y : 0.0f, extent.z > 0.0f ? cells / extent.z : 0.0f };
+
+	for (unsigned int i = 0; i < numRays; ++i)
+	{
+		const Ray& ray = stream->nextRays[i].ray;
+		unsigned int cellX = (std::min)((unsigned int)((ray.start.x - boundsMin.x) * scale.x), maxCell);
+		unsigned int cellY = (std::min)((unsigned int)((ray.start.y - boundsMin.y) * scale.y), maxCell);
+		unsigned int cellZ = (std::min)((unsigned int)((ray.start.z - boundsMin.z) * scale.z), maxCell);
+		unsigned int octant = (ray.dir.x < 0.0f ? 4 : 0) | (ray.dir.y < 0.0f ? 2 : 0) | (ray.dir.z < 0.0f ? 1 : 0);
+
+		stream->keys[i] = (octant << (3 * STREAM_CELL_BITS)) | (spreadCellBits(cellX) << 2) | (spreadCellBits(cellY) << 1) | spreadCellBits(cellZ);
+		stream->indexes[i] = i;
+	}
+
+	// radix sort the keys, least significant digit first
+	unsigned int* keys = stream->keys, *keysSorted = stream->keysSorted;
+	unsigned int* indexes = stream->indexes, *indexesSorted = stream->indexesSorted;
+	for (int pass = 0; pass < STREAM_RADIX_PASSES; ++pass)
+	{
+		const int shift = pass * STREAM_RADIX_BITS;
+
+		unsigned int offsets[STREAM_RADIX_SIZE] = { 0 };
+		for (unsigned int i = 0; i < numRays; ++i)
+		{
+			offsets[(keys[i] >> shift) & (STREAM_RADIX_SIZE - 1)]++;
+		}
+
+		unsigned int total = 0;
+		for (int digit = 0; digit < STREAM_RADIX_SIZE; ++digit)
+		{
+			unsigned int count = offsets[digit];
+			offsets[digit] = total;
+			total += count;
+		}
+
+		for (unsigned int i = 0; i < numRays; ++i)
+		{
+			unsigned int position = offsets[(keys[i] >> shift) & (STREAM_RADIX_SIZE - 1)]++;
+			keysSorted[position] = keys[i];
+			indexesSorted[position] = indexes[i];
+		}
+
+		std::swap(keys, keysSorted);
+		std::swap(indexes, indexesSorted);
+	}
+
+	// gather the rays into sorted order, ready to be traced
+	for (unsigned int i = 0; i < numRays; ++i)
+	{
+		stream->rays[i] = stream->nextRays[indexes[i]];
+	}
+}
+
+// render a block by tracing all of its rays as a stream, a bounce at a time, rather than following each ray to its end
+// all of the stream's rays are intersected together before any of them are shaded, and the reflected and refracted rays
+// are sorted so that rays that will visit the same parts of the scene are traced one after the other
+// the view rays are intersected with viewScene (a culled copy of the scene, or just the scene itself)
+// (lineRays is space for the view rays of a line of the block, and the block's colours end up in tile)
+void renderBlockWavefront(const Scene* scene, const Scene* viewScene, RayStream* stream, const int xMin, const int xMax, const int yMin, const int yMax, const int aaLevel,
+	const Camera* camera, ViewRays8* lineRays, const bool packets, HDRTile* tile)
+{
+	const int blockWidth = xMax - xMin;
+	const unsigned int samples = aaLevel * aaLevel;
+	const float sampleRatio = 1.0f / samples;
+	const Colour& skybox = scene->materialContainer[scene->skyboxMaterialId].diffuse;
+
+	// generate the view rays for all sub-locations of all pixels (in the same order as renderSection() traces them), a line of the block at a time
+	unsigned int numRays = 0;
+	for (int y = yMin; y < yMax; ++y)
+	{
+		viewRayLine(camera, xMin, y, blockWidth, lineRays);
+
+		for (int x = xMin; x < xMax; ++x)
+		{
+			const unsigned int pixel = (y - yMin) * blockWidth + (x - xMin);
+			stream->colours[pixel] = Colour(0.0f, 0.0f, 0.0f);
+
+			for (unsigned int sample = 0; sample < samples; ++sample)
+			{
+				StreamRay& streamRay = stream->rays[numRays++];
+				streamRay.ray = primaryRay(camera, lineRays, (x - xMin) * samples + sample);
+				streamRay.coef = sampleRatio;
+				streamRay.refractiveIndex = DEFAULT_REFRACTIVE_INDEX;
+				streamRay.pixel = pixel;
+			}
+		}
+	}
+
+	for (int level = 0; level < MAX_RAYS_CAST && numRays > 0; ++level)
+	{
+		// find the closest intersection for every ray in the stream
+		// (neighbouring view rays can be intersected as packets)
+		if (level == 0 && packets)
+		{
+			for (unsigned int i = 0; i < numRays; i += 8)
+			{
+				Ray viewRays[8];
+				const unsigned int count = (std::min)(8u, numRays - i);
+				for (unsigned int j = 0; j < count; ++j)
+				{
+					viewRays[j] = stream->rays[i + j].ray;
+				}
+
+				packetIntersection(scene, viewRays, count, &stream->intersects[i]);
+			}
+		}
+		else
+		{
+			for (unsigned int i = 0; i < numRays; ++i)
+			{
+				if (!objectIntersection(level == 0 ? viewScene : scene, &stream->rays[i].ray, &stream->intersects[i])) stream->intersects[i].objectType = Intersection::NONE;
+			}
+		}
+
+		// shade the intersections, and collect the rays they spawn (and the bounds of where they start)
+		unsigned int numNextRays = 0;
+		Point boundsMin = { FLT_MAX, FLT_MAX, FLT_MAX }, boundsMax = { -FLT_MAX, -FLT_MAX, -FLT_MAX };
+		for (unsigned int i = 0; i < numRays; ++i)
+		{
+			StreamRay& streamRay = stream->rays[i];
+			Intersection& intersect = stream->intersects[i];
+
+			// rays that don't hit anything read from the environment map
+			if (intersect.objectType == Intersection::NONE)
+			{
+				if (streamRay.coef > 0.0f) stream->colours[streamRay.pixel] += streamRay.coef * skybox;
+				continue;
+			}
+
+			// calculate response to collision: ie. get normal at point of collision and material of object
+			calculateIntersectionResponse(scene, &streamRay.ray, &intersect);
+
+			// apply the diffuse and specular lighting 
+			if (!intersect.insideObject) stream->colours[streamRay.pixel] += streamRay.coef * applyLighting(scene, &streamRay.ray, &intersect);
+
+			// if object has reflection or refraction component, spawn a ray for the next bounce
+			StreamRay nextRay = streamRay;
+			if (intersect.material->reflection)
+			{
+				nextRay.ray = calculateReflection(&streamRay.ray, &intersect);
+				nextRay.coef *= intersect.material->reflection;
+			}
+			else if (intersect.material->refraction)
+			{
+				nextRay.ray = calculateRefraction(&streamRay.ray, &intersect, &nextRay.refractiveIndex);
+				nextRay.coef *= intersect.material->refraction;
+			}
+			else
+			{
+				continue;
+			}
+
+			stream->nextRays[numNextRays++] = nextRay;
+			boundsMin = { (std::min)(boundsMin.x, nextRay.ray.start.x), (std::min)(boundsMin.y, nextRay.ray.start.y), (std::min)(boundsMin.z, nextRay.ray.start.z) };
+			boundsMax = { (std::max)(boundsMax.x, nextRay.ray.start.x), (std::max)(boundsMax.y, nextRay.ray.start.y), (std::max)(boundsMax.z, nextRay.ray.start.z) };
+		}
+
+		// sort the spawned rays into the stream for the next bounce
+		numRays = numNextRays;
+		sortRayStream(stream, numRays, boundsMin, boundsMax);
+	}
+
+	// rays still going after the maximum number of bounces read from the environment map
+	for (unsigned int i = 0; i < numRays; ++i)
+	{
+		if (stream->rays[i].coef > 0.0f) stream->colours[stream->rays[i].pixel] += stream->rays[i].coef * skybox;
+	}
+
+	// store the pixels' colours in the tile
+	for (int y = yMin; y < yMax; ++y)
+	{
+		for (int x = xMin; x < xMax; ++x)
+		{
+			setTileColour(tile, x - xMin, y - yMin, stream->colours[(y - yMin) * blockWidth + (x - xMin)]);
+		}
+	}
+}
+
+
+// each rendering thread's space for its blocks (set up once, and reused for every block of every run)
+typedef struct RenderContext
+{
+	ViewRays8* lineRays;				// the view rays of a line of a block
+	RayStream stream;					// the rays of a block (with wavefront)
+	Scene culled;						// the culled copy of the scene (with frustumCull)
+} RenderContext;
+
+
 // render a section of the scene at given width and height and anti-aliasing level
-void renderSection(Scene* scene, const int width, const int height, const int aaLevel, const int blockSize, unsigned int* out, const unsigned int colourMask, unsigned int* currentBlockShared)
+// with packets, each line of a block is traced as packets of 8 primary rays (only without anti-aliasing, and the scene must support packets)
+// with wavefront, each block is traced as a stream of rays, one bounce at a time (see renderBlockWavefront())
+// with frustumCull, each block's view rays are only tested against the spheres and triangles inside the block's frustum
+void renderSection(Scene* scene, const int width, const int height, const int aaLevel, const int blockSize, unsigned int* out, const unsigned int colourMask, unsigned int* currentBlockShared,
+	RenderContext* context, const bool packets, const bool wavefront, const bool frustumCull)
 {
-	// angle between each successive ray cast (per pixel, anti-aliasing uses a fraction of this)
-	const float dirStepSize = 1.0f / (0.5f * width / tanf(PIOVER180 * 0.5f * scene->cameraFieldOfView));
+	// the camera's rotation and the angle between each successive ray cast (per pixel, anti-aliasing uses a fraction of this)
+	const Camera camera = initCamera(scene, width, aaLevel);
 
 	// calculate exactly how many blocks are needed (and deal with cases where the blockSize doesn't exactly divide)
 	unsigned int blocksWide = (width - 1) / blockSize + 1;
@@ -124,6 +409,11 @@ void renderSection(Scene* scene, const int width, const int height, const int aa
 	// current block index
 	unsigned int currentBlock;
 
+	// this thread's space for its blocks
+	ViewRays8* lineRays = context->lineRays;
+	RayStream* stream = &context->stream;
+	Scene* culled = &context->culled;
+
 	while ((currentBlock = InterlockedIncrement(currentBlockShared)) < blocksTotal)
 	{
 		// block x,y position
@@ -131,65 +421,109 @@ void renderSection(Scene* scene, const int width, const int height, const int aa
 		const int by = currentBlock / blocksWide;
 
 		// block coordinates (making sure not to exceed image bounds with non-divisible block sizes)
+		// (the image runs from -width / 2 up to width - width / 2, so odd sizes still get their last column and row)
 		const int xMin = bx * blockSize - width / 2;
-		const int xMax = (std::min)(xMin + blockSize, width / 2);
+		const int xMax = (std::min)(xMin + blockSize, width - width / 2);
 		const int yMin = by * blockSize - height / 2;
-		const int yMax = (std::min)(yMin + blockSize, height / 2);
+		const int yMax = (std::min)(yMin + blockSize, height - height / 2);
 
-		// calculate the array location of the start of the block
-		unsigned int* outBlock = buffer + width * by * blockSize + bx * blockSize;
+		// the block's part of the frame (where its colours go before they're tonemapped into the image)
+		HDRTile tile = frameTile(&frame, bx * blockSize, by * blockSize);
 
-		// jump required to get to the start of the next line of the block
-		unsigned int outJump = width - (xMax - xMin);
+		// find the spheres and triangles the block's view rays could hit
+		if (frustumCull)
+		{
+			Frustum frustum = blockFrustum(&camera, xMin, xMax, yMin, yMax);
+			cullScene(scene, &frustum, culled);
+		}
 
-		// loop through all the pixels
-		for (int y = yMin; y < yMax; ++y)
+		// trace all of the block's rays together
+		if (wavefront)
+		{
+			renderBlockWavefront(scene, frustumCull ? culled : scene, stream, xMin, xMax, yMin, yMax, aaLevel, &camera, lineRays, packets, &tile);
+		}
+		// loop through all the pixels (8 at a time)
+		else if (packets)
 		{
-			for (int x = xMin; x < xMax; ++x)
+			for (int y = yMin; y < yMax; ++y)
 			{
-				Colour output(0.0f, 0.0f, 0.0f);
+				viewRayLine(&camera, xMin, y, xMax - xMin, lineRays);
 
-				// calculate multiple samples for each pixel
-				const float sampleStep = 1.0f / aaLevel, sampleRatio = 1.0f / (aaLevel * aaLevel);
-
-				// loop through all sub-locations within the pixel
-				for (float fragmentx = float(x); fragmentx < x + 1.0f; fragmentx += sampleStep) //1.0f / aaLevel)
+				for (int x = xMin; x < xMax; x += 8)
 				{
-					for (float fragmenty = float(y); fragmenty < y + 1.0f; fragmenty += sampleStep) //1.0f / aaLevel)
-					{
-						// direction of default forward facing ray
-						Vector dir = { fragmentx * dirStepSize, fragmenty * dirStepSize, 1.0f };
+					// find the first intersection of all the rays together
+					Ray viewRays[8];
+					Intersection intersects[8];
+					const int count = (std::min)(8, xMax - x);
 
-						// rotated direction of ray
-						Vector rotatedDir = {
-							dir.x * cosf(scene->cameraRotation) - dir.z * sinf(scene->cameraRotation),
-							dir.y,
-							dir.x * sinf(scene->cameraRotation) + dir.z * cosf(scene->cameraRotation) };
+					for (int i = 0; i < count; ++i)
+					{
+						viewRays[i] = primaryRay(&camera, lineRays, x - xMin + i);
+					}
 
-						// view ray starting from camera position and heading in rotated (normalised) direction
-						Ray viewRay = { scene->cameraPosition, normalise(rotatedDir) };
+					packetIntersection(scene, viewRays, count, intersects);
 
-						// follow ray and add proportional of the result to the final pixel colour
-						output += sampleRatio * traceRay(scene, viewRay);
+					// then follow each ray on its own
+					for (int i = 0; i < count; ++i)
+					{
+						// store the final colour value in the tile
+						setTileColour(&tile, x - xMin + i, y - yMin, traceRay(scene, viewRays[i], &intersects[i]));
 					}
 				}
+			}
+		}
+		// loop through all the pixels (with the view rays of each line of the block made up front)
+		else
+		{
+			for (int y = yMin; y < yMax; ++y)
+			{
+				viewRayLine(&camera, xMin, y, xMax - xMin, lineRays);
 
-				// colour the pixel
-				output.colourise(colourMask);
+				for (int x = xMin; x < xMax; ++x)
+				{
+					Colour output(0.0f, 0.0f, 0.0f);
 
-				// store saturated final colour value in image buffer
-				*outBlock++ = output.convertToPixel(scene->exposure);
-			}
+					// calculate multiple samples for each pixel
+					const unsigned int samples = aaLevel * aaLevel;
+					const float sampleRatio = 1.0f / samples;
 
-			// move to the start of the next line of the block
-			outBlock += outJump;
+					// loop through all sub-locations within the pixel
+					for (unsigned int sample = 0; sample < samples; ++sample)
+					{
+						// view ray through this sub-location
+						Ray viewRay = primaryRay(&camera, lineRays, (x - xMin) * samples + sample);
+
+						// follow ray and add proportional of the result to the final pixel colour
+						// (finding its first intersection in the culled scene)
+						if (frustumCull)
+						{
+							Intersection firstIntersect;
+							objectIntersection(culled, &viewRay, &firstIntersect);
+							output += sampleRatio * traceRay(scene, viewRay, &firstIntersect);
+						}
+						else
+						{
+							output += sampleRatio * traceRay(scene, viewRay);
+						}
+					}
+
+					// store the final colour value in the tile
+					setTileColour(&tile, x - xMin, y - yMin, output);
+				}
+			}
 		}
+
+		// the block gets tonemapped after all of them are traced (coloured by which thread rendered it)
+		blockColourMasks[currentBlock] = (unsigned char)colourMask;
 	}
+
+	// add this thread's shadow cache and light counts for the run to the totals
+	mergeThreadLighting();
 }
 
 
-// data for threads
-struct ThreadParams
+// data for the rendering job (shared by all of the pool's threads)
+struct RenderParams
 {
 	Scene* scene;
 	int width;
@@ -197,66 +531,180 @@ struct ThreadParams
 	int aaLevel;
 	int blockSize;
 	unsigned int* out;
-	unsigned int colourMask;
+	bool colourise;
 	unsigned int* currentBlockShared;
+	RenderContext* contexts;			// (one for each thread)
+	bool packets;
+	bool wavefront;
+	bool frustumCull;
 };
 
 
-// thread callback for rendering
-DWORD __stdcall renderSectionThread(LPVOID inData)
+// thread pool job for setting up each thread's space for rendering (on the thread itself, as the lighting caches are thread local)
+void initRenderContextJob(void* inData, const unsigned int threadIndex)
 {
-	// cast the void* structure to something useful
-	ThreadParams* params = (ThreadParams*)inData;
+	RenderParams* params = (RenderParams*)inData;
+	RenderContext* context = &params->contexts[threadIndex];
+
+	// (enough view rays for a line of a block)
+	context->lineRays = (ViewRays8*)_aligned_malloc(sizeof(ViewRays8) * ((params->blockSize * params->aaLevel * params->aaLevel + 7) / 8), 64);
+	if (params->wavefront) initRayStream(&context->stream, params->blockSize, params->aaLevel);
+	if (params->frustumCull) initCulledScene(params->scene, &context->culled);
+
+	// this thread's cache of the last object to block each light
+	initThreadLighting(params->scene);
+}
+
+
+// thread pool job for cleaning up each thread's space for rendering
+void freeRenderContextJob(void* inData, const unsigned int threadIndex)
+{
+	RenderParams* params = (RenderParams*)inData;
+	RenderContext* context = &params->contexts[threadIndex];
+
+	_aligned_free(context->lineRays);
+	if (params->wavefront) freeRayStream(&context->stream);
+	if (params->frustumCull) freeCulledScene(&context->culled);
+	freeThreadLighting();
+}
+
+
+// set up (and clean up) every one of the pool's threads for rendering, once before all of the runs (and once after them)
+RenderContext* initRenderContexts(Scene* scene, const int aaLevel, ThreadPool* pool, const int blockSize, const bool wavefront, const bool frustumCull)
+{
+	RenderContext* contexts = new RenderContext[pool->threadCount];
+	RenderParams params = { scene, 0, 0, aaLevel, blockSize, NULL, false, NULL, contexts, false, wavefront, frustumCull };
+	runThreadPool(pool, initRenderContextJob, &params);
+
+	return contexts;
+}
 
-	// call the real render function
-	renderSection(params->scene, params->width, params->height, params->aaLevel, params->blockSize, params->out, params->colourMask, params->currentBlockShared);
+void freeRenderContexts(RenderContext* contexts, ThreadPool* pool, const bool wavefront, const bool frustumCull)
+{
+	RenderParams params = { NULL, 0, 0, 0, 0, NULL, false, NULL, contexts, false, wavefront, frustumCull };
+	runThreadPool(pool, freeRenderContextJob, &params);
 
-	// exit with success
-	ExitThread(NULL);
+	delete[] contexts;
 }
 
 
-// render scene at given width and height and anti-aliasing level using a specified number of threads
-void render(Scene* scene, const int width, const int height, const int aaLevel, const unsigned int threadCount, const int blockSize, const bool colourise)
+// thread pool job for rendering
+void renderSectionJob(void* inData, const unsigned int threadIndex)
+{
+	// cast the void* structure to something useful
+	RenderParams* params = (RenderParams*)inData;
+
+	// call the real render function (colourising with the thread's own colour)
+	renderSection(params->scene, params->width, params->height, params->aaLevel, params->blockSize, params->out, params->colourise ? (threadIndex % 8) : 7, params->currentBlockShared,
+		&params->contexts[threadIndex], params->packets, params->wavefront, params->frustumCull);
+}
+
+
+// data for the tonemapping job (shared by all of the pool's threads)
+struct TonemapParams
+{
+	float exposure;
+	int blockSize;
+	unsigned int* out;
+	unsigned int* currentBlockShared;
+};
+
+
+// thread pool job for tonemapping
+void tonemapSectionJob(void* inData, const unsigned int threadIndex)
 {
-	// reserve space for threads and their parameters
-	HANDLE* threads = new HANDLE[threadCount];
-	ThreadParams* params = new ThreadParams[threadCount];
+	TonemapParams* params = (TonemapParams*)inData;
+
+	tonemapBlocks(&frame, params->exposure, params->blockSize, blockColourMasks, params->currentBlockShared, params->out);
+}
 
+
+// render scene at given width and height and anti-aliasing level using all of the pool's threads
+// then tonemap the whole frame into the buffer (as a separate pass, again shared between all of the threads)
+// (contexts has to have been set up by initRenderContexts() with the same options)
+void render(Scene* scene, const int width, const int height, const int aaLevel, ThreadPool* pool, RenderContext* contexts, const int blockSize, const bool colourise, const bool packets, const bool wavefront, const bool frustumCull)
+{
 	// one less than the current block to render (shared between threads)
 	unsigned int currentBlockShared = -1;
 
-	// loop through all the squares
-	for (unsigned int i = 0; i < threadCount; ++i)
-	{
-		// debug
-		//printf("thread rendering: [%d,%d] (%d,%d)->(%d,%d) => %x\n", bx, by, xMin, yMin, xMax, yMax, out);
+	RenderParams params = { scene, width, height, aaLevel, blockSize, buffer, colourise, &currentBlockShared, contexts, packets, wavefront, frustumCull };
+
+	// returns once all the threads are done
+	runThreadPool(pool, renderSectionJob, &params);
+
+	// every block has been traced, so the tonemapping can start again from the first block
+	currentBlockShared = -1;
+
+	TonemapParams tonemapParams = { scene->exposure, blockSize, buffer, &currentBlockShared };
+	runThreadPool(pool, tonemapSectionJob, &tonemapParams);
+}
 
-		// set up thread parameters
-		params[i] = { scene, width, height, aaLevel, blockSize, buffer, colourise ? (i % 8) : 7, &currentBlockShared };
 
-		// start thread
-		threads[i] = CreateThread(NULL, 0, renderSectionThread, (LPVOID)&params[i], 0, NULL);
-	}
 
-	// wait until all the threads are done
-	if (threadCount <= 64)
+// copy the current spheres and triangles into their (already allocated) SoA SIMD copies
+// used by simdifySceneContainers(), and again whenever objects move, so the copies are updated in place rather than reallocated
+void updateSceneContainersSIMD(Scene& scene)
+{
+	// helper size (so we don't just have 8 everywhere)
+	unsigned int valuesPerVector = sizeof(__m256) / sizeof(float);
+
+	if (scene.numSpheres > 0)
 	{
-		WaitForMultipleObjects(threadCount, threads, TRUE, INFINITE);
+		// initialise SoA structures
+		for (unsigned int i = 0; i < (scene.numSpheresSIMD + 1) * valuesPerVector; ++i)
+		{
+			// don't let the source index extend out of the AoS array
+			// i.e. copy the last value into the extra array slots when numSpheres isn't exactly divisible by 8
+			// pretty lazy way to fix this, but it works
+			int sourceIndex = i < scene.numSpheres ? i : scene.numSpheres - 1;
+
+			scene.spherePosX[i / valuesPerVector].m256_f32[i % valuesPerVector] = scene.sphereContainer[sourceIndex].pos.x;
+			scene.spherePosY[i / valuesPerVector].m256_f32[i % valuesPerVector] = scene.sphereContainer[sourceIndex].pos.y;
+			scene.spherePosZ[i / valuesPerVector].m256_f32[i % valuesPerVector] = scene.sphereContainer[sourceIndex].pos.z;
+			scene.sphereSize[i / valuesPerVector].m256_f32[i % valuesPerVector] = scene.sphereContainer[sourceIndex].size;
+			scene.sphereMaterialId[i / valuesPerVector].m256i_i32[i % valuesPerVector] = scene.sphereContainer[sourceIndex].materialId; 
+		}
 	}
-	else
+
+	if (scene.numTriangles > 0)
 	{
-		for (unsigned int i = 0; i < threadCount; i++) {
-			WaitForSingleObject(threads[i], INFINITE);
+	//initialising SoA
+		for(unsigned int i = 0; i < (scene.numTrianglesSIMD + 1) * valuesPerVector; i++)
+		{
+			int sourceIndex = i < scene.numTriangles ? i : scene.numTriangles - 1;
+
+			//conversions for point 1 of triangle
+			scene.triangle1X[i / valuesPerVector].m256_f32[i%valuesPerVector] = scene.triangleContainer[sourceIndex].p1.x;
+			scene.triangle1Y[i / valuesPerVector].m256_f32[i%valuesPerVector] = scene.triangleContainer[sourceIndex].p1.y;
+			scene.triangle1Z[i / valuesPerVector].m256_f32[i%valuesPerVector] = scene.triangleContainer[sourceIndex].p1.z;
+
+			//edges from point 1 to points 2 and 3 (so the intersection tests don't have to work them out for every ray)
+			Vector edge1 = scene.triangleContainer[sourceIndex].p2 - scene.triangleContainer[sourceIndex].p1;
+			Vector edge2 = scene.triangleContainer[sourceIndex].p3 - scene.triangleContainer[sourceIndex].p1;
+			scene.triangleEdge1X[i / valuesPerVector].m256_f32[i%valuesPerVector] = edge1.x;
+			scene.triangleEdge1Y[i / valuesPerVector].m256_f32[i%valuesPerVector] = edge1.y;
+			scene.triangleEdge1Z[i / valuesPerVector].m256_f32[i%valuesPerVector] = edge1.z;
+			scene.triangleEdge2X[i / valuesPerVector].m256_f32[i%valuesPerVector] = edge2.x;
+			scene.triangleEdge2Y[i / valuesPerVector].m256_f32[i%valuesPerVector] = edge2.y;
+			scene.triangleEdge2Z[i / valuesPerVector].m256_f32[i%valuesPerVector] = edge2.z;
 		}
 	}
-
-	// clean up thread and param storage
-	delete[] params;
-	delete[] threads;
 }
 
 
+// move the scene's spheres for the given frame of a (very simple) animation
+// each sphere bobs up and down by its own radius, out of step with its neighbours
+// (the phase comes from where the sphere is rather than its index, as the BVH builders reorder the spheres)
+void animateScene(Scene& scene, const int frame)
+{
+	for (unsigned int i = 0; i < scene.numSpheres; ++i)
+	{
+		Sphere& sphere = scene.sphereContainer[i];
+		float phase = sphere.pos.x + sphere.pos.z;
+		sphere.pos.y += sphere.size * (sinf(0.5f * frame + phase) - sinf(0.5f * (frame - 1) + phase));
+	}
+}
+
 
 // allocate space fro SoA, and copy values from AoS to SoA 
 void simdifySceneContainers(Scene& scene)
@@ -275,26 +723,12 @@ void simdifySceneContainers(Scene& scene)
 		scene.numSpheresSIMD = (((int)scene.numSpheres) - 1) / valuesPerVector + 1;
 
 		// allocate the correct amount of space at the correct alignment for SIMD operations
-		scene.spherePosX = (__m256*) _aligned_malloc(sizeof(__m256) * scene.numSpheresSIMD, 32);
-		scene.spherePosY = (__m256*) _aligned_malloc(sizeof(__m256) * scene.numSpheresSIMD, 32);
-		scene.spherePosZ = (__m256*) _aligned_malloc(sizeof(__m256) * scene.numSpheresSIMD, 32);
-		scene.sphereSize = (__m256*) _aligned_malloc(sizeof(__m256) * scene.numSpheresSIMD, 32);
-		scene.sphereMaterialId = (__m256i*) _aligned_malloc(sizeof(__m256i) * scene.numSpheresSIMD, 32);
-
-		// initialise SoA structures
-		for (unsigned int i = 0; i < scene.numSpheresSIMD * valuesPerVector; ++i)
-		{
-			// don't let the source index extend out of the AoS array
-			// i.e. copy the last value into the extra array slots when numSpheres isn't exactly divisible by 8
-			// pretty lazy way to fix this, but it works
-			int sourceIndex = i < scene.numSpheres ? i : scene.numSpheres - 1;
-
-			scene.spherePosX[i / valuesPerVector].m256_f32[i % valuesPerVector] = scene.sphereContainer[sourceIndex].pos.x;
-			scene.spherePosY[i / valuesPerVector].m256_f32[i % valuesPerVector] = scene.sphereContainer[sourceIndex].pos.y;
-			scene.spherePosZ[i / valuesPerVector].m256_f32[i % valuesPerVector] = scene.sphereContainer[sourceIndex].pos.z;
-			scene.sphereSize[i / valuesPerVector].m256_f32[i % valuesPerVector] = scene.sphereContainer[sourceIndex].size;
-			scene.sphereMaterialId[i / valuesPerVector].m256i_i32[i % valuesPerVector] = scene.sphereContainer[sourceIndex].materialId; 
-		}
+		// (plus an extra vector of padding, so that BVH leaves can do unaligned loads starting at any sphere)
+		scene.spherePosX = (__m256*) _aligned_malloc(sizeof(__m256) * (scene.numSpheresSIMD + 1), 32);
+		scene.spherePosY = (__m256*) _aligned_malloc(sizeof(__m256) * (scene.numSpheresSIMD + 1), 32);
+		scene.spherePosZ = (__m256*) _aligned_malloc(sizeof(__m256) * (scene.numSpheresSIMD + 1), 32);
+		scene.sphereSize = (__m256*) _aligned_malloc(sizeof(__m256) * (scene.numSpheresSIMD + 1), 32);
+		scene.sphereMaterialId = (__m256i*) _aligned_malloc(sizeof(__m256i) * (scene.numSpheresSIMD + 1), 32);
 	}
 	//soa simd copies of triangles
 	if (scene.numTriangles == 0)
@@ -306,46 +740,20 @@ void simdifySceneContainers(Scene& scene)
 		//more mathemagics for ceilf(whate ver this means :P)
 		scene.numTrianglesSIMD = (((int)scene.numTriangles) - 1) / valuesPerVector + 1;
 		
-		scene.triangle1X = (__m256*) _aligned_malloc(sizeof(__m256) * scene.numTrianglesSIMD, 32);
-		scene.triangle1Y = (__m256*) _aligned_malloc(sizeof(__m256) * scene.numTrianglesSIMD, 32);
-		scene.triangle1Z = (__m256*) _aligned_malloc(sizeof(__m256) * scene.numTrianglesSIMD, 32);
-		scene.triangle2X = (__m256*) _aligned_malloc(sizeof(__m256) * scene.numTrianglesSIMD, 32);
-		scene.triangle2Y = (__m256*) _aligned_malloc(sizeof(__m256) * scene.numTrianglesSIMD, 32);
-		scene.triangle2Z = (__m256*) _aligned_malloc(sizeof(__m256) * scene.numTrianglesSIMD, 32);
-		scene.triangle3X = (__m256*) _aligned_malloc(sizeof(__m256) * scene.numTrianglesSIMD, 32);
-		scene.triangle3Y = (__m256*) _aligned_malloc(sizeof(__m256) * scene.numTrianglesSIMD, 32);
-		scene.triangle3Z = (__m256*) _aligned_malloc(sizeof(__m256) * scene.numTrianglesSIMD, 32);
-		scene.triangleNormalX = (__m256*) _aligned_malloc(sizeof(__m256) * scene.numTrianglesSIMD, 32);
-		scene.triangleNormalY = (__m256*) _aligned_malloc(sizeof(__m256) * scene.numTrianglesSIMD, 32);
-		scene.triangleNormalZ = (__m256*) _aligned_malloc(sizeof(__m256) * scene.numTrianglesSIMD, 32);
-		scene.triangleMaterialId = (__m256i*) _aligned_malloc(sizeof(__m256i) * scene.numTrianglesSIMD, 32);
-
-		//initialising SoA
-		for(unsigned int i = 0; i <scene.numTrianglesSIMD * valuesPerVector; i++)
-		{
-			int sourceIndex = i < scene.numTriangles ? i : scene.numTriangles - 1;
-
-			//conversions for point 1 of triangle
-			scene.triangle1X[i / valuesPerVector].m256_f32[i%valuesPerVector] = scene.triangleContainer[sourceIndex].p1.x;
-			scene.triangle1Y[i / valuesPerVector].m256_f32[i%valuesPerVector] = scene.triangleContainer[sourceIndex].p1.y;
-			scene.triangle1Z[i / valuesPerVector].m256_f32[i%valuesPerVector] = scene.triangleContainer[sourceIndex].p1.z;
-
-			//conversion for point 2 of triangle
-			scene.triangle2X[i / valuesPerVector].m256_f32[i%valuesPerVector] = scene.triangleContainer[sourceIndex].p2.x;
-			scene.triangle2Y[i / valuesPerVector].m256_f32[i%valuesPerVector] = scene.triangleContainer[sourceIndex].p2.y;
-			scene.triangle2Z[i / valuesPerVector].m256_f32[i%valuesPerVector] = scene.triangleContainer[sourceIndex].p2.z;
-
-			//conversion for point 3 of triangle
-			scene.triangle3X[i / valuesPerVector].m256_f32[i%valuesPerVector] = scene.triangleContainer[sourceIndex].p3.x;
-			scene.triangle3Y[i / valuesPerVector].m256_f32[i%valuesPerVector] = scene.triangleContainer[sourceIndex].p3.y;
-			scene.triangle3Z[i / valuesPerVector].m256_f32[i%valuesPerVector] = scene.triangleContainer[sourceIndex].p3.z;
-
-			//conversion for the normal of each triangle
-			scene.triangleNormalX[i / valuesPerVector].m256_f32[i%valuesPerVector] = scene.triangleContainer[sourceIndex].normal.x;
-			scene.triangleNormalY[i / valuesPerVector].m256_f32[i%valuesPerVector] = scene.triangleContainer[sourceIndex].normal.y;
-			scene.triangleNormalZ[i / valuesPerVector].m256_f32[i%valuesPerVector] = scene.triangleContainer[sourceIndex].normal.z;
-		}
+		// extra vector of padding for BVH leaves (same as spheres)
+		scene.triangle1X = (__m256*) _aligned_malloc(sizeof(__m256) * (scene.numTrianglesSIMD + 1), 32);
+		scene.triangle1Y = (__m256*) _aligned_malloc(sizeof(__m256) * (scene.numTrianglesSIMD + 1), 32);
+		scene.triangle1Z = (__m256*) _aligned_malloc(sizeof(__m256) * (scene.numTrianglesSIMD + 1), 32);
+		scene.triangleEdge1X = (__m256*) _aligned_malloc(sizeof(__m256) * (scene.numTrianglesSIMD + 1), 32);
+		scene.triangleEdge1Y = (__m256*) _aligned_malloc(sizeof(__m256) * (scene.numTrianglesSIMD + 1), 32);
+		scene.triangleEdge1Z = (__m256*) _aligned_malloc(sizeof(__m256) * (scene.numTrianglesSIMD + 1), 32);
+		scene.triangleEdge2X = (__m256*) _aligned_malloc(sizeof(__m256) * (scene.numTrianglesSIMD + 1), 32);
+		scene.triangleEdge2Y = (__m256*) _aligned_malloc(sizeof(__m256) * (scene.numTrianglesSIMD + 1), 32);
+		scene.triangleEdge2Z = (__m256*) _aligned_malloc(sizeof(__m256) * (scene.numTrianglesSIMD + 1), 32);
 	}
+	// fill them in
+	updateSceneContainersSIMD(scene);
+
 	//soa simd copies of lights
 	if (scene.numLights == 0)
 	{
@@ -396,6 +804,21 @@ int main(int argc, char* argv[])
 	unsigned int threads = 8;			
 	bool colourise = false;				
 	unsigned int blockSize = 8;		
+	const char* accelerator = "bvh";
+	bool animate = false;
+	const char* cacheDirectory = NULL;
+	bool benchTriangles = false;
+	bool packets = false;
+	bool wavefront = false;
+	bool frustumCull = false;
+	float lightCull = 0.0f;
+	unsigned int lightSamples = 0;
+	const char* isa = NULL;
+	bool benchMath = false;
+	const char* hdrFilename = NULL;
+	const char* reexposeFilename = NULL;
+	bool overrideExposure = false;
+	float exposure = 0.0f;
 
 	// default input / output filenames
 	const char* inputFilename = "../Scenes/cornell.txt";
@@ -438,39 +861,399 @@ int main(int argc, char* argv[])
 		{
 			blockSize = atoi(argv[++i]);
 		}
+		else if (strcmp(argv[i], "-accel") == 0)
+		{
+			accelerator = argv[++i];
+		}
+		else if (strcmp(argv[i], "-animate") == 0)
+		{
+			animate = true;
+		}
+		else if (strcmp(argv[i], "-cache") == 0)
+		{
+			cacheDirectory = argv[++i];
+		}
+		else if (strcmp(argv[i], "-benchTriangles") == 0)
+		{
+			benchTriangles = true;
+		}
+		else if (strcmp(argv[i], "-packets") == 0)
+		{
+			packets = true;
+		}
+		else if (strcmp(argv[i], "-wavefront") == 0)
+		{
+			wavefront = true;
+		}
+		else if (strcmp(argv[i], "-frustumCull") == 0)
+		{
+			frustumCull = true;
+		}
+		else if (strcmp(argv[i], "-lightCull") == 0)
+		{
+			lightCull = (float) atof(argv[++i]);
+		}
+		else if (strcmp(argv[i], "-lightSamples") == 0)
+		{
+			lightSamples = atoi(argv[++i]);
+		}
+		else if (strcmp(argv[i], "-isa") == 0)
+		{
+			isa = argv[++i];
+		}
+		else if (strcmp(argv[i], "-fastMath") == 0)
+		{
+			mathAccuracy = MATH_FAST;
+		}
+		else if (strcmp(argv[i], "-benchMath") == 0)
+		{
+			benchMath = true;
+		}
+		else if (strcmp(argv[i], "-hdr") == 0)
+		{
+			hdrFilename = argv[++i];
+		}
+		else if (strcmp(argv[i], "-reexpose") == 0)
+		{
+			reexposeFilename = argv[++i];
+		}
+		else if (strcmp(argv[i], "-exposure") == 0)
+		{
+			exposure = (float) atof(argv[++i]);
+			overrideExposure = true;
+		}
 		else
 		{
 			fprintf(stderr, "unknown argument: %s\n", argv[i]);
 		}
 	}
 
+	// the frame (and so the image and "-hdr" file) is only fully written by a run, so there has to be at least one
+	if (times < 1)
+	{
+		fprintf(stderr, "-runs must be at least 1 (using 1)\n");
+		times = 1;
+	}
+
 	// nasty (and fragile) kludge to make an ok-ish default output filename (can be overriden with "-output" command line option)
 	sprintf(outputFilenameBuffer, "../Outputs/%s_%dx%dx%d_%s.bmp", (strrchr(inputFilename, '/') + 1), width, height, samples, (strrchr(argv[0], '\\') + 1));
 
-	// read scene file
+	// use the best SIMD instruction set the CPU has (or a lower one, if asked for one, e.g. to compare them)
+	instructionSet = detectInstructionSet();
+	if (isa != NULL)
+	{
+		InstructionSet requested = strcmp(isa, "sse4.2") == 0 ? ISA_SSE42 : strcmp(isa, "avx2") == 0 ? ISA_AVX2 : ISA_AVX512;
+		if (strcmp(isa, instructionSetName(requested)) != 0) fprintf(stderr, "unknown instruction set: %s (using %s)\n", isa, instructionSetName(instructionSet));
+		else if (requested > instructionSet) fprintf(stderr, "this CPU doesn't support %s (using %s)\n", isa, instructionSetName(instructionSet));
+		else instructionSet = requested;
+	}
+	selectIntersectionKernels(instructionSet);
+
+	// time the maths functions instead of rendering (doesn't need a scene)
+	if (benchMath)
+	{
+		benchmarkMath();
+		return 0;
+	}
+
+	// tonemap a frame saved with "-hdr" again (e.g. with a different exposure) instead of rendering (doesn't need a scene)
+	if (reexposeFilename != NULL)
+	{
+		if (!loadHDRFrame(reexposeFilename, &frame))
+		{
+			fprintf(stderr, "Failure when reading the HDR file: %s\n", reexposeFilename);
+			return -1;
+		}
+		if (frame.width > MAX_WIDTH || frame.height > MAX_HEIGHT)
+		{
+			fprintf(stderr, "%s is too big (%dx%d, the most is %dx%d)\n", reexposeFilename, frame.width, frame.height, MAX_WIDTH, MAX_HEIGHT);
+			return -1;
+		}
+
+		// the exposure it was rendered with, unless another one is given
+		if (!overrideExposure)
+		{
+			if (std::isnan(frame.exposure))
+			{
+				fprintf(stderr, "%s doesn't say what exposure it was rendered with (use -exposure)\n", reexposeFilename);
+				return -1;
+			}
+			exposure = frame.exposure;
+		}
+
+		// (which thread rendered each block isn't known any more, so when colourising the blocks are coloured in turn instead)
+		const unsigned int blocksTotal = ((frame.width - 1) / blockSize + 1) * ((frame.height - 1) / blockSize + 1);
+		for (unsigned int i = 0; i < blocksTotal; ++i)
+		{
+			blockColourMasks[i] = colourise ? (i % 8) : 7;
+		}
+
+		Timer tonemapTimer;
+		unsigned int currentBlock = -1;
+		tonemapBlocks(&frame, exposure, blockSize, blockColourMasks, &currentBlock, buffer);
+		tonemapTimer.end();
+
+		// (named after the HDR file, unless there's an "-output")
+		if (outputFilename == outputFilenameBuffer) sprintf(outputFilenameBuffer, "%s.bmp", reexposeFilename);
+		printf("tonemapped %dx%d pixels at exposure %g: %ums\n", frame.width, frame.height, exposure, tonemapTimer.getMilliseconds());
+		write_bmp(outputFilename, buffer, frame.width, frame.height, frame.width);
+		freeHDRFrame(&frame);
+		return 0;
+	}
+
+	// the 8-wide BVHs only have AVX2 versions
+	if (instructionSet < ISA_AVX2 && (strcmp(accelerator, "bvh8") == 0 || strcmp(accelerator, "qbvh8") == 0))
+	{
+		fprintf(stderr, "the %s accelerator needs avx2 (using bvh)\n", accelerator);
+		accelerator = "bvh";
+	}
+
+	// start the worker threads once (every build, run, and frame reuses them, so starting them isn't part of any timing)
+	ThreadPool pool;
+	Timer poolTimer;
+	initThreadPool(&pool, threads);
+	poolTimer.end();
+
+	// read the built scene from the cache (if there's one for this scene file and accelerator), otherwise read the scene file
+	// (the scene starts zeroed, so whatever isn't filled in is NULL rather than whatever was on the stack, which would end up in the cache)
+	// (the linear and grid accelerators are never cached, so there's no point looking)
 	Scene scene;
-	if (!init(inputFilename, scene))
+	memset(&scene, 0, sizeof(Scene));
+	char cacheName[CACHE_NAME_LENGTH];
+	bool useCache = cacheDirectory != NULL && strcmp(accelerator, "linear") != 0 && strcmp(accelerator, "grid") != 0;
+	bool cached = false;
+	Timer loadTimer;
+	if (useCache) useCache = getCacheName(cacheDirectory, inputFilename, accelerator, cacheName);
+	if (useCache)
+	{
+		cached = loadSceneCache(cacheName, scene);
+	}
+	if (!cached && !init(inputFilename, scene))
 	{
 		fprintf(stderr, "Failure when reading the Scene file.\n");
 		return -1;
 	}
+	loadTimer.end();
+
+	// choose the acceleration structure
+	if (strcmp(accelerator, "linear") == 0)
+	{
+		scene.accelerator = Scene::LINEAR;
+	}
+	else if (strcmp(accelerator, "bvh8") == 0)
+	{
+		scene.accelerator = Scene::BVH8;
+	}
+	else if (strcmp(accelerator, "qbvh8") == 0)
+	{
+		scene.accelerator = Scene::QBVH8;
+	}
+	else if (strcmp(accelerator, "lbvh") == 0)
+	{
+		scene.accelerator = Scene::LBVH;
+	}
+	else if (strcmp(accelerator, "grid") == 0)
+	{
+		scene.accelerator = Scene::GRID;
+	}
+	else
+	{
+		if (strcmp(accelerator, "bvh") != 0) fprintf(stderr, "unknown accelerator: %s (using bvh)\n", accelerator);
+		scene.accelerator = Scene::BVH;
+	}
+
+	// a cached scene is already built (and has its SoA copies)
+	Timer buildTimer;
+	if (!cached)
+	{
+		// build the BVH (reorders the spheres and triangles, so has to happen before the SoA copies are made)
+		// the 8-wide BVH is made by collapsing the binary one
+		// (timed separately from rendering)
+		scene.numBVHNodes = scene.numBVH8Nodes = 0;
+		scene.bvhNodes = NULL;
+		scene.qbvh8Nodes = NULL;
+		if (scene.accelerator == Scene::BVH || scene.accelerator == Scene::BVH8 || scene.accelerator == Scene::QBVH8) buildBVH(scene, &pool);
+		if (scene.accelerator == Scene::LBVH) buildLBVH(scene, &pool);
+		if (scene.accelerator == Scene::BVH8 || scene.accelerator == Scene::QBVH8) buildBVH8(scene);
+		if (scene.accelerator == Scene::QBVH8) quantizeBVH8(scene);
+		if (scene.accelerator == Scene::GRID) buildGrid(scene);
+
+		// instanced models always get a BVH of their own, and the top level hierarchy goes over the instances of them
+		for (unsigned int i = 0; i < scene.numModels; ++i)
+		{
+			if (scene.modelContainer[i] != NULL) buildBVH(*scene.modelContainer[i], &pool);
+		}
+		buildTLAS(scene);
+		buildTimer.end();
+
+		// do the SoA things
+		simdifySceneContainers(scene);
+		for (unsigned int i = 0; i < scene.numModels; ++i)
+		{
+			if (scene.modelContainer[i] != NULL) simdifySceneContainers(*scene.modelContainer[i]);
+		}
+
+		// save the built scene for next time (if it's the sort that can be cached)
+		if (useCache && isSceneCacheable(scene) && !saveSceneCache(cacheName, scene))
+		{
+			fprintf(stderr, "couldn't write scene cache %s\n", cacheName);
+		}
+	}
+	else
+	{
+		buildTimer.end();
+	}
+
+	// time the triangle test instead of rendering
+	if (benchTriangles)
+	{
+		if (instructionSet < ISA_AVX2)
+		{
+			fprintf(stderr, "-benchTriangles needs avx2\n");
+			return -1;
+		}
+
+		benchmarkTriangles(scene);
+		return 0;
+	}
+
+	// packets of rays and frustum culling only have AVX2 versions
+	if (instructionSet < ISA_AVX2 && (packets || frustumCull))
+	{
+		fprintf(stderr, "-packets and -frustumCull need avx2 (ignoring)\n");
+		packets = frustumCull = false;
+	}
+
+	// packets of primary rays only work with the binary BVH, and only trace one ray per pixel
+	if (packets && ((scene.accelerator != Scene::BVH && scene.accelerator != Scene::LBVH) || scene.numInstances > 0 || samples != 1))
+	{
+		fprintf(stderr, "-packets needs the bvh or lbvh accelerator, no instances, and 1 sample (ignoring)\n");
+		packets = false;
+	}
+
+	// the culled copies of the scene don't have the instances (and packets find the view rays' intersections their own way)
+	if (frustumCull && (scene.numInstances > 0 || packets))
+	{
+		fprintf(stderr, "-frustumCull doesn't work with instances or -packets (ignoring)\n");
+		frustumCull = false;
+	}
+
+	// picking lights at random replaces applying all of them (culled or not)
+	if (lightSamples > 0 && lightCull > 0.0f)
+	{
+		fprintf(stderr, "-lightCull doesn't work with -lightSamples (ignoring)\n");
+		lightCull = 0.0f;
+	}
+	if (lightSamples > 0 && scene.numLights == 0)
+	{
+		fprintf(stderr, "-lightSamples needs some lights (ignoring)\n");
+		lightSamples = 0;
+	}
+
+	// the light tree and alias table are built every time (they're quick, and aren't cached)
+	scene.numLightTreeNodes = 0;
+	scene.lightTreeNodes = NULL;
+	scene.lightTreeIndexes = NULL;
+	scene.lightCullThreshold = lightCull;
+	if (lightCull > 0.0f) buildLightTree(scene);
+
+	scene.lightSamples = lightSamples;
+	scene.lightAliasProbability = NULL;
+	scene.lightAlias = NULL;
+	if (lightSamples > 0) buildLightAliasTable(scene);
+
+	if (overrideExposure) scene.exposure = exposure;
+
+	// the colours that rendering adds up (kept for "-hdr")
+	initHDRFrame(&frame, width, height);
+	frame.exposure = scene.exposure;
+
+	// the grid keeps its own copies of the objects, so can't follow them when they move
+	if (animate && scene.accelerator == Scene::GRID)
+	{
+		fprintf(stderr, "-animate isn't supported with the grid accelerator (ignoring)\n");
+		animate = false;
+	}
 
-	// do the SoA things
-	simdifySceneContainers(scene);
+	// each thread's space for rendering (set up once, rather than in every run)
+	RenderContext* contexts = initRenderContexts(&scene, samples, &pool, blockSize, wavefront, frustumCull);
 
 	// total time taken to render all runs (used to calculate average)
 	int totalTime = 0;
+	int totalUpdateTime = 0;
 	for (int i = 0; i < times; i++)
 	{
+		// move things between runs (refitting the BVH, or rebuilding the linear BVH, then updating the SoA copies)
+		if (animate && i > 0)
+		{
+			animateScene(scene, i);
+
+			Timer updateTimer;
+			if (scene.accelerator == Scene::LBVH) buildLBVH(scene, &pool);
+			else if (scene.accelerator != Scene::LINEAR) refitBVH(scene);
+			updateSceneContainersSIMD(scene);
+			updateTimer.end();
+			totalUpdateTime += updateTimer.getMilliseconds();
+		}
+
 		Timer timer;															// create timer
-		render(&scene, width, height, samples, threads, blockSize, colourise);	// raytrace scene
+		render(&scene, width, height, samples, &pool, contexts, blockSize, colourise, packets, wavefront, frustumCull);	// raytrace scene
 		timer.end();															// record end time
 		totalTime += timer.getMilliseconds();									// record total time taken
 	}
 
+	freeRenderContexts(contexts, &pool, wavefront, frustumCull);
+
 	// output timing information (times run and average)
 	printf("average time taken (%d run(s)): %ums\n", times, totalTime / times);
+	printf("acceleration structure build time: %ums\n", buildTimer.getMilliseconds());
+	printf("scene load time: %ums%s\n", loadTimer.getMilliseconds(), cached ? " (from cache)" : "");
+	printf("thread pool start time: %ums (%u threads, not included in the other times)\n", poolTimer.getMilliseconds(), threads);
+	printf("SIMD instruction set: %s\n", instructionSetName(instructionSet));
+	if (mathAccuracy == MATH_FAST) printf("maths functions: fast (-fastMath)\n");
+	if (scene.accelerator == Scene::BVH8 || scene.accelerator == Scene::QBVH8)
+	{
+		unsigned int nodeSize = scene.accelerator == Scene::QBVH8 ? sizeof(QBVH8Node) : sizeof(BVH8Node);
+		printf("8-wide BVH node memory: %uKB (%u nodes of %u bytes)\n", scene.numBVH8Nodes * nodeSize / 1024, scene.numBVH8Nodes, nodeSize);
+	}
+	if (scene.numLights > 0)
+	{
+		unsigned long long shadowRays, cacheTests, cacheHits;
+		getShadowCacheStats(&shadowRays, &cacheTests, &cacheHits);
+		printf("shadow occluder cache hit rate: %.1f%% of %llu tries (%.1f%% of %llu shadow rays)\n", cacheTests ? 100.0 * cacheHits / cacheTests : 0.0, cacheTests,
+			shadowRays ? 100.0 * cacheHits / shadowRays : 0.0, shadowRays);
+	}
+	if (scene.lightTreeNodes != NULL)
+	{
+		unsigned long long lights, culledLights;
+		double errorBound;
+		getLightCullStats(&lights, &culledLights, &errorBound);
+		printf("light tree culled %.1f%% of %llu lights (error bound %.3f%% of the lighting)\n", lights ? 100.0 * culledLights / lights : 0.0, lights, 100.0 * errorBound);
+	}
+	if (scene.lightSamples > 0)
+	{
+		unsigned long long hits;
+		double variance, relativeError;
+		getLightSampleStats(&hits, &variance, &relativeError);
+
+		// (estimating the variance needs at least two lights at each hit)
+		if (scene.lightSamples < 2) printf("light sampling variance: n/a (needs 2 or more lights at each hit, %u light at each of %llu hits)\n", scene.lightSamples, hits);
+		else printf("light sampling variance: %.3g per hit (relative standard error %.2f%%, %u light(s) at each of %llu hits)\n", variance, 100.0 * relativeError, scene.lightSamples, hits);
+	}
+	if (animate && times > 1)
+	{
+		printf("average update time (%d frame(s)): %ums\n", times - 1, totalUpdateTime / (times - 1));
+		if (scene.accelerator != Scene::LINEAR) printf("BVH cost after updates: %.2fx its cost when built\n", bvhCostRatio(scene));
+	}
 
 	// output BMP file
 	write_bmp(outputFilename, buffer, width, height, width);
+
+	// output the colours before tonemapping, so the image can be tonemapped again later ("-reexpose")
+	if (hdrFilename != NULL && !saveHDRFrame(hdrFilename, &frame))
+	{
+		fprintf(stderr, "Failure when writing the HDR file: %s\n", hdrFilename);
+	}
+	freeHDRFrame(&frame);
+	freeThreadPool(&pool);
 }
@@ -55,16 +55,12 @@ bool GetMaterial(const Config &sceneFile, Material &currentMat)
 	return true;
 }
 
-bool GetModel(const Config &sceneFile, const Scene& scene, int& triangleIndex)
+// read a model's triangles, scaling and moving them as they're read
+void GetTriangles(const Config &sceneFile, Triangle* triangles, int numTriangles, int materialId, const Vector& offset, float scale)
 {
-	Vector offset = sceneFile.GetByNameAsVector("Center", NullVector);
-	float scale = (float) sceneFile.GetByNameAsFloat("Size", 1);
-	int numTriangles = sceneFile.GetByNameAsInteger("Triangles", 0);
-	int materialId = sceneFile.GetByNameAsInteger("Material.Id", 0);
-
 	for (int i = 0; i < numTriangles; i++)
 	{
-		Triangle& currentTriangle = scene.triangleContainer[triangleIndex + i];
+		Triangle& currentTriangle = triangles[i];
 
 		SimpleString triangleName("Triangle");
 		triangleName.append((unsigned long)i);
@@ -82,6 +78,16 @@ bool GetModel(const Config &sceneFile, const Scene& scene, int& triangleIndex)
 		currentTriangle.p2 = currentTriangle.p2 * scale + offset;
 		currentTriangle.p3 = currentTriangle.p3 * scale + offset;
 	}
+}
+
+bool GetModel(const Config &sceneFile, const Scene& scene, int& triangleIndex)
+{
+	Vector offset = sceneFile.GetByNameAsVector("Center", NullVector);
+	float scale = (float) sceneFile.GetByNameAsFloat("Size", 1);
+	int numTriangles = sceneFile.GetByNameAsInteger("Triangles", 0);
+	int materialId = sceneFile.GetByNameAsInteger("Material.Id", 0);
+
+	GetTriangles(sceneFile, scene.triangleContainer + triangleIndex, numTriangles, materialId, offset, scale);
 
 	// update the triangle index (so the next model's triangles are read into the correct spot)
 	triangleIndex += numTriangles;
@@ -89,6 +95,43 @@ bool GetModel(const Config &sceneFile, const Scene& scene, int& triangleIndex)
 	return true;
 }
 
+// instanced models are read into a scene of their own (in object space, so Center is ignored)
+// Size is still applied, so that the triangle tests' epsilons work the same as for a normal model, and each instance's Size is relative to it
+// the model scene shares the main scene's materials, and gets its BVH built along with the main scene's
+bool GetInstancedModel(const Config &sceneFile, const Scene& scene, Scene*& model)
+{
+	model = new Scene();
+	model->numMaterials = scene.numMaterials;
+	model->materialContainer = scene.materialContainer;
+	model->numTriangles = sceneFile.GetByNameAsInteger("Triangles", 0);
+	model->triangleContainer = new Triangle[model->numTriangles];
+
+	GetTriangles(sceneFile, model->triangleContainer, model->numTriangles, sceneFile.GetByNameAsInteger("Material.Id", 0), NullVector, (float) sceneFile.GetByNameAsFloat("Size", 1));
+
+	return true;
+}
+
+bool GetInstance(const Config &sceneFile, const Scene& scene, Instance &currentInstance)
+{
+	unsigned int modelId = sceneFile.GetByNameAsInteger("Model.Id", 0);
+
+	if (modelId >= scene.numModels || scene.modelContainer[modelId] == NULL)
+	{
+		fprintf(stderr, "Malformed Scene file: Instance Model Id not valid (the model must have Instanced = 1).\n");
+		return false;
+	}
+
+	float rotation = float(sceneFile.GetByNameAsFloat("Rotation", 0.0f)) * PIOVER180;
+
+	currentInstance.model = scene.modelContainer[modelId];
+	currentInstance.center = sceneFile.GetByNameAsPoint("Center", Origin);
+	currentInstance.size = float(sceneFile.GetByNameAsFloat("Size", 1.0f));
+	currentInstance.cosRotation = cosf(rotation);
+	currentInstance.sinRotation = sinf(rotation);
+
+	return true;
+}
+
 bool GetSphere(const Config &sceneFile, const Scene& scene, Sphere &currentSph)
 {
     currentSph.pos = sceneFile.GetByNameAsPoint("Center", Origin); 
@@ -151,9 +194,11 @@ bool init(const char* inputName, Scene& scene)
 	scene.numLights = sceneFile.GetByNameAsInteger("NumberOfLights", 0);
 
 	unsigned int numModels = sceneFile.GetByNameAsInteger("NumberOfModels", 0);
+	scene.numModels = numModels;
+	scene.numInstances = sceneFile.GetByNameAsInteger("NumberOfInstances", 0);
 
 	// calculate the total number of triangles used by all models before allocating
-	// space for the triangle container
+	// space for the triangle container (instanced models have their own)
 	unsigned int numTriangles = 0;
 	for (unsigned int i = 0; i < numModels; ++i)
 	{
@@ -164,7 +209,7 @@ bool init(const char* inputName, Scene& scene)
 			fprintf(stderr, "Malformed Scene file: Missing Model section.\n");
 			return false;
 		}
-		numTriangles += sceneFile.GetByNameAsInteger("Triangles", 0);
+		if (sceneFile.GetByNameAsInteger("Instanced", 0) == 0) numTriangles += sceneFile.GetByNameAsInteger("Triangles", 0);
 	}
 	scene.numTriangles = numTriangles;
 
@@ -172,6 +217,8 @@ bool init(const char* inputName, Scene& scene)
 	scene.sphereContainer = new Sphere[scene.numSpheres];
 	scene.lightContainer = new Light[scene.numLights];
 	scene.triangleContainer = new Triangle[scene.numTriangles];
+	scene.modelContainer = new Scene*[scene.numModels];
+	scene.instanceContainer = new Instance[scene.numInstances];
 
 	// have to read the materials section before the material ids (used for the triangles, 
 	// spheres, and planes) can be turned into pointers to actual materials
@@ -203,7 +250,16 @@ bool init(const char* inputName, Scene& scene)
 			fprintf(stderr, "Malformed Scene file: Missing Model section.\n");
 			return false;
 		}
-		if (!GetModel(sceneFile, scene, triangleIndex))
+		scene.modelContainer[i] = NULL;
+		if (sceneFile.GetByNameAsInteger("Instanced", 0) != 0)
+		{
+			if (!GetInstancedModel(sceneFile, scene, scene.modelContainer[i]))
+			{
+				fprintf(stderr, "Malformed Scene file: Model %d section.\n", i);
+				return false;
+			}
+		}
+		else if (!GetModel(sceneFile, scene, triangleIndex))
 		{
 			fprintf(stderr, "Malformed Scene file: Model %d section.\n", i);
 			return false;
@@ -227,6 +283,22 @@ bool init(const char* inputName, Scene& scene)
 		}
     }
 
+	for (unsigned int i = 0; i < scene.numInstances; ++i)
+	{
+		SimpleString sectionName("Instance");
+		sectionName.append((unsigned long)i);
+		if (sceneFile.SetSection(sectionName) == -1)
+		{
+			fprintf(stderr, "Malformed Scene file: Missing Instance section.\n");
+			return false;
+		}
+		if (!GetInstance(sceneFile, scene, scene.instanceContainer[i]))
+		{
+			fprintf(stderr, "Malformed Scene file: Instance %d section.\n", i);
+			return false;
+		}
+	}
+
 	for (unsigned int i = 0; i < scene.numLights; ++i)
     {   
         Light &currentLight = scene.lightContainer[i];
@@ -39,21 +39,63 @@ typedef struct Scene
 	__m256* sphereSize;
 	__m256i* sphereMaterialId;
 
-	//SIMD triangles hold info for three points and the vector normal, material
+	//SIMD triangles hold info for the first point and the two edges from it (precomputed for the intersection tests)
+	//(hits use the triangle itself for its normal and material, so they aren't copied)
 	unsigned int numTrianglesSIMD;
 	__m256* triangle1X, *triangle1Y, *triangle1Z;
-	__m256* triangle2X, *triangle2Y, *triangle2Z;
-	__m256* triangle3X, *triangle3Y, *triangle3Z;
-	__m256* triangleNormalX, *triangleNormalY, *triangleNormalZ;
-	__m256i* triangleMaterialId;
+	__m256* triangleEdge1X, *triangleEdge1Y, *triangleEdge1Z;
+	__m256* triangleEdge2X, *triangleEdge2Y, *triangleEdge2Z;
 
 	//SIMD lighting
 	unsigned int numLightsSIMD;
 	__m256* posX, *posY, *posZ;
 	__m256* red, *green, *blue;
 
+	// which acceleration structure to use for intersection tests
+	enum { LINEAR, BVH, BVH8, GRID, LBVH, QBVH8 } accelerator;
+
+	// bounding volume hierarchy over all spheres and triangles (from either the SAH or the linear builder)
+	unsigned int numBVHNodes;
+	struct BVHNode* bvhNodes;
+	float bvhBuildCost;				// SAH cost of the BVH when it was built (refitting changes the cost, usually for the worse)
+
+	// 8-wide version of the above
+	unsigned int numBVH8Nodes;
+	struct BVH8Node* bvh8Nodes;
+
+	// compressed version of the above (same number of nodes)
+	struct QBVH8Node* qbvh8Nodes;
+
+	// uniform grid over all spheres and triangles
+	struct Grid* grid;
+
+	// instanced models (each model is its own scene, with triangles in object space and its own BVH)
+	unsigned int numModels;
+	struct Scene** modelContainer;			// indexed by Model section number (NULL for models that aren't instanced)
+	unsigned int numInstances;
+	Instance* instanceContainer;
+
+	// top level hierarchy over the instances
+	unsigned int numTLASNodes;
+	struct TLASNode* tlasNodes;
+
+	// hierarchy over the lights (NULL unless light culling is on)
+	unsigned int numLightTreeNodes;
+	struct LightTreeNode* lightTreeNodes;
+	unsigned int* lightTreeIndexes;			// lightContainer indexes, in the order the tree's leaves refer to them
+	float lightCullThreshold;				// skip clusters of lights that can't add more than this fraction of the colour so far
+
+	// alias table for picking lights at random in proportion to their power (NULL unless light sampling is on)
+	unsigned int lightSamples;				// number of lights to pick at each hit
+	float* lightAliasProbability;			// chance that each slot picks its own light rather than its alias
+	unsigned int* lightAlias;
+	float invLightPower;					// one over the total power of all of the lights
+
 } Scene;
 
 bool init(const char* inputName, Scene& scene);
 
+// allocate the SoA SIMD copies of the scene's spheres, triangles and lights, and fill them in (in Raytrace.cpp)
+void simdifySceneContainers(Scene& scene);
+
 #endif // __SCENE_H
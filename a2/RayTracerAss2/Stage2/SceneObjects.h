@@ -55,4 +55,43 @@ typedef struct Triangle
 	unsigned int materialId;	// material id
 } Triangle;
 
+
+// a copy of a model placed somewhere in the scene
+// the model's triangles (and its BVH) are in object space, rays are moved into object space to test against them
+typedef struct Instance
+{
+	struct Scene* model;		// the instanced model
+	Point center;				// where the model's origin is placed
+	float size;					// (uniform) scale, relative to the model's own Size
+	float cosRotation;			// rotation around the y axis
+	float sinRotation;
+	Point min, max;				// bounds in world space (worked out once the model's BVH is built)
+} Instance;
+
+// move a vector from world space into an instance's object space (and back)
+// the scale is included so that distances along rays are the same in both spaces
+inline Vector toInstanceSpace(const Instance* instance, const Vector& v)
+{
+	Vector result = { instance->cosRotation * v.x - instance->sinRotation * v.z, v.y, instance->sinRotation * v.x + instance->cosRotation * v.z };
+	return result * (1.0f / instance->size);
+}
+
+inline Point toInstanceSpace(const Instance* instance, const Point& p)
+{
+	Vector local = toInstanceSpace(instance, p - instance->center);
+	Point result = { local.x, local.y, local.z };
+	return result;
+}
+
+inline Vector fromInstanceSpace(const Instance* instance, const Vector& v)
+{
+	Vector result = { instance->cosRotation * v.x + instance->sinRotation * v.z, v.y, -instance->sinRotation * v.x + instance->cosRotation * v.z };
+	return result * instance->size;
+}
+
+inline Point fromInstanceSpace(const Instance* instance, const Point& p)
+{
+	return instance->center + fromInstanceSpace(instance, Vector{ p.x, p.y, p.z });
+}
+
 #endif // __SCENE_OBJECTS_H
@@ -0,0 +1,290 @@
+// width-generic versions of the SIMD helpers in PrimitivesSIMD.h, so that a kernel can be written once
+// and compiled for 4 (SSE4.2), 8 (AVX2), or 16 (AVX-512) lanes (see IntersectionKernelsSIMD.h)
+// SimdFloat<Width> is a vector of floats, SimdInt<Width> a vector of (index) ints, and SimdMask<Width> the result of comparing them
+// (a vector of all-ones / all-zeros lanes for 4 and 8 wide, and a mask register for 16 wide)
+
+#ifndef __SIMD_VECTOR_H
+#define __SIMD_VECTOR_H
+
+#include <immintrin.h>
+#include "PrimitivesSIMD.h"
+
+template <int Width> struct SimdFloat;
+template <int Width> struct SimdInt;
+template <int Width> struct SimdMask;
+
+
+// ---- 4 wide (SSE4.2) ----
+
+template <> struct SimdMask<4>
+{
+	__m128 m;
+
+	__forceinline int bits() const { return _mm_movemask_ps(m); }
+};
+
+template <> struct SimdFloat<4>
+{
+	__m128 v;
+
+	static __forceinline SimdFloat<4> broadcast(const float x) { return { _mm_set1_ps(x) }; }
+
+	// the Width floats from p (lanes from count on are whatever comes next, callers mask them off)
+	static __forceinline SimdFloat<4> load(const float* p, const unsigned int count) { return { _mm_loadu_ps(p) }; }
+	__forceinline void store(float* p) const { _mm_storeu_ps(p, v); }
+};
+
+template <> struct SimdInt<4>
+{
+	__m128i v;
+
+	static __forceinline SimdInt<4> broadcast(const int x) { return { _mm_set1_epi32(x) }; }
+
+	// first, first + 1, first + 2, ...
+	static __forceinline SimdInt<4> sequence(const int first) { return { _mm_add_epi32(_mm_set1_epi32(first), _mm_setr_epi32(0, 1, 2, 3)) }; }
+};
+
+__forceinline SimdFloat<4> operator + (const SimdFloat<4> x, const SimdFloat<4> y) { return { _mm_add_ps(x.v, y.v) }; }
+__forceinline SimdFloat<4> operator - (const SimdFloat<4> x, const SimdFloat<4> y) { return { _mm_sub_ps(x.v, y.v) }; }
+__forceinline SimdFloat<4> operator * (const SimdFloat<4> x, const SimdFloat<4> y) { return { _mm_mul_ps(x.v, y.v) }; }
+__forceinline SimdFloat<4> operator / (const SimdFloat<4> x, const SimdFloat<4> y) { return { _mm_div_ps(x.v, y.v) }; }
+__forceinline SimdFloat<4> sqrt(const SimdFloat<4> x) { return { _mm_sqrt_ps(x.v) }; }
+__forceinline SimdFloat<4> minimum(const SimdFloat<4> x, const SimdFloat<4> y) { return { _mm_min_ps(x.v, y.v) }; }
+__forceinline SimdFloat<4> maximum(const SimdFloat<4> x, const SimdFloat<4> y) { return { _mm_max_ps(x.v, y.v) }; }
+__forceinline SimdFloat<4> round(const SimdFloat<4> x) { return { _mm_round_ps(x.v, _MM_FROUND_TO_NEAREST_INT | _MM_FROUND_NO_EXC) }; }
+__forceinline SimdFloat<4> rsqrtEstimate(const SimdFloat<4> x) { return { _mm_rsqrt_ps(x.v) }; }
+
+__forceinline SimdMask<4> operator < (const SimdFloat<4> x, const SimdFloat<4> y) { return { _mm_cmplt_ps(x.v, y.v) }; }
+__forceinline SimdMask<4> operator > (const SimdFloat<4> x, const SimdFloat<4> y) { return { _mm_cmpgt_ps(x.v, y.v) }; }
+__forceinline SimdMask<4> operator <= (const SimdFloat<4> x, const SimdFloat<4> y) { return { _mm_cmple_ps(x.v, y.v) }; }
+__forceinline SimdMask<4> operator >= (const SimdFloat<4> x, const SimdFloat<4> y) { return { _mm_cmpge_ps(x.v, y.v) }; }
+
+__forceinline SimdMask<4> operator & (const SimdMask<4> x, const SimdMask<4> y) { return { _mm_and_ps(x.m, y.m) }; }
+__forceinline SimdMask<4> operator | (const SimdMask<4> x, const SimdMask<4> y) { return { _mm_or_ps(x.m, y.m) }; }
+__forceinline SimdMask<4> andNot(const SimdMask<4> x, const SimdMask<4> y) { return { _mm_andnot_ps(y.m, x.m) }; }
+
+__forceinline SimdInt<4> operator + (const SimdInt<4> x, const SimdInt<4> y) { return { _mm_add_epi32(x.v, y.v) }; }
+__forceinline SimdInt<4> operator - (const SimdInt<4> x, const SimdInt<4> y) { return { _mm_sub_epi32(x.v, y.v) }; }
+__forceinline SimdInt<4> operator & (const SimdInt<4> x, const SimdInt<4> y) { return { _mm_and_si128(x.v, y.v) }; }
+__forceinline SimdInt<4> operator | (const SimdInt<4> x, const SimdInt<4> y) { return { _mm_or_si128(x.v, y.v) }; }
+__forceinline SimdInt<4> operator ^ (const SimdInt<4> x, const SimdInt<4> y) { return { _mm_xor_si128(x.v, y.v) }; }
+__forceinline SimdInt<4> operator << (const SimdInt<4> x, const int bits) { return { _mm_slli_epi32(x.v, bits) }; }
+__forceinline SimdInt<4> operator >> (const SimdInt<4> x, const int bits) { return { _mm_srli_epi32(x.v, bits) }; }
+__forceinline SimdMask<4> operator < (const SimdInt<4> x, const SimdInt<4> y) { return { _mm_castsi128_ps(_mm_cmpgt_epi32(y.v, x.v)) }; }
+
+// conversions (toInt rounds to the nearest whole number), and reinterpreting the bits of one type as the other
+__forceinline SimdInt<4> toInt(const SimdFloat<4> x) { return { _mm_cvtps_epi32(x.v) }; }
+__forceinline SimdFloat<4> toFloat(const SimdInt<4> x) { return { _mm_cvtepi32_ps(x.v) }; }
+__forceinline SimdInt<4> asInt(const SimdFloat<4> x) { return { _mm_castps_si128(x.v) }; }
+__forceinline SimdFloat<4> asFloat(const SimdInt<4> x) { return { _mm_castsi128_ps(x.v) }; }
+
+__forceinline SimdFloat<4> select(const SimdMask<4> cond, const SimdFloat<4> ifTrue, const SimdFloat<4> ifFalse) { return { _mm_blendv_ps(ifFalse.v, ifTrue.v, cond.m) }; }
+__forceinline SimdInt<4> select(const SimdMask<4> cond, const SimdInt<4> ifTrue, const SimdInt<4> ifFalse)
+{
+	return { _mm_castps_si128(_mm_blendv_ps(_mm_castsi128_ps(ifFalse.v), _mm_castsi128_ps(ifTrue.v), cond.m)) };
+}
+
+// "horizontal" minimum, and the smallest index of the lanes that have it
+__forceinline void selectMinimumAndIndex(const SimdFloat<4> values, const SimdInt<4> indexes, float* min, int* index)
+{
+	__m128 mins = _mm_min_ps(values.v, _mm_shuffle_ps(values.v, values.v, _MM_SHUFFLE(2, 3, 0, 1)));
+	mins = _mm_min_ps(mins, _mm_shuffle_ps(mins, mins, _MM_SHUFFLE(1, 0, 3, 2)));
+
+	// set the indexes of the lanes that don't match to MAX_INT (-1 but unsigned)
+	__m128i matchingIndexes = _mm_or_si128(_mm_castps_si128(_mm_cmpneq_ps(mins, values.v)), indexes.v);
+
+	__m128i minIndexes = _mm_min_epu32(matchingIndexes, _mm_shuffle_epi32(matchingIndexes, _MM_SHUFFLE(2, 3, 0, 1)));
+	minIndexes = _mm_min_epu32(minIndexes, _mm_shuffle_epi32(minIndexes, _MM_SHUFFLE(1, 0, 3, 2)));
+
+	*min = _mm_cvtss_f32(mins);
+	*index = _mm_cvtsi128_si32(minIndexes);
+}
+
+
+// ---- 8 wide (AVX2, using the operators and helpers from PrimitivesSIMD.h) ----
+
+template <> struct SimdMask<8>
+{
+	__m256 m;
+
+	__forceinline int bits() const { return _mm256_movemask_ps(m); }
+};
+
+template <> struct SimdFloat<8>
+{
+	__m256 v;
+
+	static __forceinline SimdFloat<8> broadcast(const float x) { return { _mm256_set1_ps(x) }; }
+	static __forceinline SimdFloat<8> load(const float* p, const unsigned int count) { return { _mm256_loadu_ps(p) }; }
+	__forceinline void store(float* p) const { _mm256_storeu_ps(p, v); }
+};
+
+template <> struct SimdInt<8>
+{
+	__m256i v;
+
+	static __forceinline SimdInt<8> broadcast(const int x) { return { _mm256_set1_epi32(x) }; }
+	static __forceinline SimdInt<8> sequence(const int first) { return { _mm256_add_epi32(_mm256_set1_epi32(first), _mm256_setr_epi32(0, 1, 2, 3, 4, 5, 6, 7)) }; }
+};
+
+__forceinline SimdFloat<8> operator + (const SimdFloat<8> x, const SimdFloat<8> y) { return { x.v + y.v }; }
+__forceinline SimdFloat<8> operator - (const SimdFloat<8> x, const SimdFloat<8> y) { return { x.v - y.v }; }
+__forceinline SimdFloat<8> operator * (const SimdFloat<8> x, const SimdFloat<8> y) { return { x.v * y.v }; }
+__forceinline SimdFloat<8> operator / (const SimdFloat<8> x, const SimdFloat<8> y) { return { x.v / y.v }; }
+__forceinline SimdFloat<8> sqrt(const SimdFloat<8> x) { return { _mm256_sqrt_ps(x.v) }; }
+__forceinline SimdFloat<8> minimum(const SimdFloat<8> x, const SimdFloat<8> y) { return { _mm256_min_ps(x.v, y.v) }; }
+__forceinline SimdFloat<8> maximum(const SimdFloat<8> x, const SimdFloat<8> y) { return { _mm256_max_ps(x.v, y.v) }; }
+__forceinline SimdFloat<8> round(const SimdFloat<8> x) { return { _mm256_round_ps(x.v, _MM_FROUND_TO_NEAREST_INT | _MM_FROUND_NO_EXC) }; }
+__forceinline SimdFloat<8> rsqrtEstimate(const SimdFloat<8> x) { return { _mm256_rsqrt_ps(x.v) }; }
+
+__forceinline SimdMask<8> operator < (const SimdFloat<8> x, const SimdFloat<8> y) { return { x.v < y.v }; }
+__forceinline SimdMask<8> operator > (const SimdFloat<8> x, const SimdFloat<8> y) { return { x.v > y.v }; }
+__forceinline SimdMask<8> operator <= (const SimdFloat<8> x, const SimdFloat<8> y) { return { x.v <= y.v }; }
+__forceinline SimdMask<8> operator >= (const SimdFloat<8> x, const SimdFloat<8> y) { return { x.v >= y.v }; }
+
+__forceinline SimdMask<8> operator & (const SimdMask<8> x, const SimdMask<8> y) { return { x.m & y.m }; }
+__forceinline SimdMask<8> operator | (const SimdMask<8> x, const SimdMask<8> y) { return { x.m | y.m }; }
+__forceinline SimdMask<8> andNot(const SimdMask<8> x, const SimdMask<8> y) { return { _mm256_andnot_ps(y.m, x.m) }; }
+
+__forceinline SimdInt<8> operator + (const SimdInt<8> x, const SimdInt<8> y) { return { _mm256_add_epi32(x.v, y.v) }; }
+__forceinline SimdInt<8> operator - (const SimdInt<8> x, const SimdInt<8> y) { return { _mm256_sub_epi32(x.v, y.v) }; }
+__forceinline SimdInt<8> operator & (const SimdInt<8> x, const SimdInt<8> y) { return { _mm256_and_si256(x.v, y.v) }; }
+__forceinline SimdInt<8> operator | (const SimdInt<8> x, const SimdInt<8> y) { return { _mm256_or_si256(x.v, y.v) }; }
+__forceinline SimdInt<8> operator ^ (const SimdInt<8> x, const SimdInt<8> y) { return { _mm256_xor_si256(x.v, y.v) }; }
+__forceinline SimdInt<8> operator << (const SimdInt<8> x, const int bits) { return { _mm256_slli_epi32(x.v, bits) }; }
+__forceinline SimdInt<8> operator >> (const SimdInt<8> x, const int bits) { return { _mm256_srli_epi32(x.v, bits) }; }
+__forceinline SimdMask<8> operator < (const SimdInt<8> x, const SimdInt<8> y) { return { _mm256_castsi256_ps(_mm256_cmpgt_epi32(y.v, x.v)) }; }
+
+__forceinline SimdInt<8> toInt(const SimdFloat<8> x) { return { _mm256_cvtps_epi32(x.v) }; }
+__forceinline SimdFloat<8> toFloat(const SimdInt<8> x) { return { _mm256_cvtepi32_ps(x.v) }; }
+__forceinline SimdInt<8> asInt(const SimdFloat<8> x) { return { _mm256_castps_si256(x.v) }; }
+__forceinline SimdFloat<8> asFloat(const SimdInt<8> x) { return { _mm256_castsi256_ps(x.v) }; }
+
+__forceinline SimdFloat<8> select(const SimdMask<8> cond, const SimdFloat<8> ifTrue, const SimdFloat<8> ifFalse) { return { select(cond.m, ifTrue.v, ifFalse.v) }; }
+__forceinline SimdInt<8> select(const SimdMask<8> cond, const SimdInt<8> ifTrue, const SimdInt<8> ifFalse) { return { select(_mm256_castps_si256(cond.m), ifTrue.v, ifFalse.v) }; }
+
+__forceinline void selectMinimumAndIndex(const SimdFloat<8> values, const SimdInt<8> indexes, float* min, int* index)
+{
+	selectMinimumAndIndex(values.v, indexes.v, min, index);
+}
+
+
+// ---- 16 wide (AVX-512 F, DQ and VL) ----
+
+template <> struct SimdMask<16>
+{
+	__mmask16 m;
+
+	__forceinline int bits() const { return m; }
+};
+
+template <> struct SimdFloat<16>
+{
+	__m512 v;
+
+	static __forceinline SimdFloat<16> broadcast(const float x) { return { _mm512_set1_ps(x) }; }
+
+	// lanes from count on are zero, and nothing past them is read (so there's no need for padding at the ends of arrays)
+	static __forceinline SimdFloat<16> load(const float* p, const unsigned int count)
+	{
+		return { count >= 16 ? _mm512_loadu_ps(p) : _mm512_maskz_loadu_ps((__mmask16)((1u << count) - 1), p) };
+	}
+
+	__forceinline void store(float* p) const { _mm512_storeu_ps(p, v); }
+};
+
+template <> struct SimdInt<16>
+{
+	__m512i v;
+
+	static __forceinline SimdInt<16> broadcast(const int x) { return { _mm512_set1_epi32(x) }; }
+	static __forceinline SimdInt<16> sequence(const int first)
+	{
+		return { _mm512_add_epi32(_mm512_set1_epi32(first), _mm512_setr_epi32(0, 1, 2, 3, 4, 5, 6, 7, 8, 9, 10, 11, 12, 13, 14, 15)) };
+	}
+};
+
+__forceinline SimdFloat<16> operator + (const SimdFloat<16> x, const SimdFloat<16> y) { return { _mm512_add_ps(x.v, y.v) }; }
+__forceinline SimdFloat<16> operator - (const SimdFloat<16> x, const SimdFloat<16> y) { return { _mm512_sub_ps(x.v, y.v) }; }
+__forceinline SimdFloat<16> operator * (const SimdFloat<16> x, const SimdFloat<16> y) { return { _mm512_mul_ps(x.v, y.v) }; }
+__forceinline SimdFloat<16> operator / (const SimdFloat<16> x, const SimdFloat<16> y) { return { _mm512_div_ps(x.v, y.v) }; }
+__forceinline SimdFloat<16> sqrt(const SimdFloat<16> x) { return { _mm512_sqrt_ps(x.v) }; }
+__forceinline SimdFloat<16> minimum(const SimdFloat<16> x, const SimdFloat<16> y) { return { _mm512_min_ps(x.v, y.v) }; }
+__forceinline SimdFloat<16> maximum(const SimdFloat<16> x, const SimdFloat<16> y) { return { _mm512_max_ps(x.v, y.v) }; }
+__forceinline SimdFloat<16> round(const SimdFloat<16> x) { return { _mm512_roundscale_ps(x.v, _MM_FROUND_TO_NEAREST_INT | _MM_FROUND_NO_EXC) }; }
+__forceinline SimdFloat<16> rsqrtEstimate(const SimdFloat<16> x) { return { _mm512_rsqrt14_ps(x.v) }; }
+
+__forceinline SimdMask<16> operator < (const SimdFloat<16> x, const SimdFloat<16> y) { return { _mm512_cmp_ps_mask(x.v, y.v, _CMP_LT_OQ) }; }
+__forceinline SimdMask<16> operator > (const SimdFloat<16> x, const SimdFloat<16> y) { return { _mm512_cmp_ps_mask(x.v, y.v, _CMP_GT_OQ) }; }
+__forceinline SimdMask<16> operator <= (const SimdFloat<16> x, const SimdFloat<16> y) { return { _mm512_cmp_ps_mask(x.v, y.v, _CMP_LE_OQ) }; }
+__forceinline SimdMask<16> operator >= (const SimdFloat<16> x, const SimdFloat<16> y) { return { _mm512_cmp_ps_mask(x.v, y.v, _CMP_GE_OQ) }; }
+
+__forceinline SimdMask<16> operator & (const SimdMask<16> x, const SimdMask<16> y) { return { (__mmask16)(x.m & y.m) }; }
+__forceinline SimdMask<16> operator | (const SimdMask<16> x, const SimdMask<16> y) { return { (__mmask16)(x.m | y.m) }; }
+__forceinline SimdMask<16> andNot(const SimdMask<16> x, const SimdMask<16> y) { return { (__mmask16)(x.m & ~y.m) }; }
+
+__forceinline SimdInt<16> operator + (const SimdInt<16> x, const SimdInt<16> y) { return { _mm512_add_epi32(x.v, y.v) }; }
+__forceinline SimdInt<16> operator - (const SimdInt<16> x, const SimdInt<16> y) { return { _mm512_sub_epi32(x.v, y.v) }; }
+__forceinline SimdInt<16> operator & (const SimdInt<16> x, const SimdInt<16> y) { return { _mm512_and_si512(x.v, y.v) }; }
+__forceinline SimdInt<16> operator | (const SimdInt<16> x, const SimdInt<16> y) { return { _mm512_or_si512(x.v, y.v) }; }
+__forceinline SimdInt<16> operator ^ (const SimdInt<16> x, const SimdInt<16> y) { return { _mm512_xor_si512(x.v, y.v) }; }
+__forceinline SimdInt<16> operator << (const SimdInt<16> x, const int bits) { return { _mm512_slli_epi32(x.v, bits) }; }
+__forceinline SimdInt<16> operator >> (const SimdInt<16> x, const int bits) { return { _mm512_srli_epi32(x.v, bits) }; }
+__forceinline SimdMask<16> operator < (const SimdInt<16> x, const SimdInt<16> y) { return { _mm512_cmplt_epi32_mask(x.v, y.v) }; }
+
+__forceinline SimdInt<16> toInt(const SimdFloat<16> x) { return { _mm512_cvtps_epi32(x.v) }; }
+__forceinline SimdFloat<16> toFloat(const SimdInt<16> x) { return { _mm512_cvtepi32_ps(x.v) }; }
+__forceinline SimdInt<16> asInt(const SimdFloat<16> x) { return { _mm512_castps_si512(x.v) }; }
+__forceinline SimdFloat<16> asFloat(const SimdInt<16> x) { return { _mm512_castsi512_ps(x.v) }; }
+
+__forceinline SimdFloat<16> select(const SimdMask<16> cond, const SimdFloat<16> ifTrue, const SimdFloat<16> ifFalse) { return { _mm512_mask_mov_ps(ifFalse.v, cond.m, ifTrue.v) }; }
+__forceinline SimdInt<16> select(const SimdMask<16> cond, const SimdInt<16> ifTrue, const SimdInt<16> ifFalse) { return { _mm512_mask_mov_epi32(ifFalse.v, cond.m, ifTrue.v) }; }
+
+__forceinline void selectMinimumAndIndex(const SimdFloat<16> values, const SimdInt<16> indexes, float* min, int* index)
+{
+	float minimum = _mm512_reduce_min_ps(values.v);
+	__mmask16 matching = _mm512_cmp_ps_mask(values.v, _mm512_set1_ps(minimum), _CMP_EQ_OQ);
+
+	*min = minimum;
+	*index = (int)_mm512_mask_reduce_min_epu32(matching, indexes.v);
+}
+
+
+// ---- any width ----
+
+// Represent Width vectors in one struct (as Vector8 does for 8)
+template <int Width> struct SimdVector
+{
+	SimdFloat<Width> xs, ys, zs;
+
+	__forceinline SimdVector(float x, float y, float z)
+	{
+		xs = SimdFloat<Width>::broadcast(x);
+		ys = SimdFloat<Width>::broadcast(y);
+		zs = SimdFloat<Width>::broadcast(z);
+	}
+
+	__forceinline SimdVector(SimdFloat<Width> xsIn, SimdFloat<Width> ysIn, SimdFloat<Width> zsIn)
+	{
+		xs = xsIn;
+		ys = ysIn;
+		zs = zsIn;
+	}
+};
+
+template <int Width> __forceinline SimdVector<Width> operator - (const SimdVector<Width>& v1, const SimdVector<Width>& v2)
+{
+	return { v1.xs - v2.xs, v1.ys - v2.ys, v1.zs - v2.zs };
+}
+
+template <int Width> __forceinline SimdVector<Width> cross(const SimdVector<Width>& v1, const SimdVector<Width>& v2)
+{
+	return { v1.ys * v2.zs - v1.zs * v2.ys, v1.zs * v2.xs - v1.xs * v2.zs, v1.xs * v2.ys - v1.ys * v2.xs };
+}
+
+template <int Width> __forceinline SimdFloat<Width> dot(const SimdVector<Width>& v1, const SimdVector<Width>& v2)
+{
+	return v1.xs * v2.xs + v1.ys * v2.ys + v1.zs * v2.zs;
+}
+
+#endif // __SIMD_VECTOR_H
@@ -29,8 +29,18 @@ Colour applyWood(const Intersection* intersect)
 {
 	Point p = (intersect->pos - intersect->material->offset) / intersect->material->size;
 
-	// squiggle up where the point is
-	p = { p.x * cosf(p.y * 0.996f) * sinf(p.z * 1.023f), cosf(p.x) * p.y * sinf(p.z * 1.211f), cosf(p.x * 1.473f) * cosf(p.y * 0.795f) * p.z };
+	// squiggle up where the point is (with the fast maths, all four cosines at once and then both sines)
+	if (mathAccuracy == MATH_FAST)
+	{
+		float coss[4], sins[4];
+		fastCos(SimdFloat<4>{ _mm_setr_ps(p.y * 0.996f, p.x, p.x * 1.473f, p.y * 0.795f) }).store(coss);
+		fastSin(SimdFloat<4>{ _mm_setr_ps(p.z * 1.023f, p.z * 1.211f, 0.0f, 0.0f) }).store(sins);
+		p = { p.x * coss[0] * sins[0], coss[1] * p.y * sins[1], coss[2] * coss[3] * p.z };
+	}
+	else
+	{
+		p = { p.x * cosf(p.y * 0.996f) * sinf(p.z * 1.023f), cosf(p.x) * p.y * sinf(p.z * 1.211f), cosf(p.x * 1.473f) * cosf(p.y * 0.795f) * p.z };
+	}
 
 	int which = int(floorf(sqrtf(p.x*p.x + p.y*p.y + p.z*p.z))) & 1;
 
@@ -0,0 +1,111 @@
+// worker threads that are reused for job after job
+
+#include "ThreadPool.h"
+
+
+// thread callback for the workers: wait for a job, run it, say it's done, and repeat until the pool shuts down
+DWORD __stdcall poolWorkerThread(LPVOID inData)
+{
+	PoolWorker* worker = (PoolWorker*)inData;
+	ThreadPool* pool = worker->pool;
+	unsigned int lastJob = 0;
+
+	EnterCriticalSection(&pool->lock);
+	for (;;)
+	{
+		while (pool->jobNumber == lastJob && !pool->quit)
+		{
+			SleepConditionVariableCS(&pool->jobReady, &pool->lock, INFINITE);
+		}
+		if (pool->quit) break;
+
+		lastJob = pool->jobNumber;
+		ThreadJob job = pool->job;
+		void* data = pool->data;
+
+		// (the lock isn't held while working)
+		LeaveCriticalSection(&pool->lock);
+		job(data, worker->index);
+		EnterCriticalSection(&pool->lock);
+
+		if (--pool->busyCount == 0) WakeConditionVariable(&pool->jobDone);
+	}
+	LeaveCriticalSection(&pool->lock);
+
+	// exit with success
+	ExitThread(NULL);
+}
+
+
+// start threadCount worker threads
+void initThreadPool(ThreadPool* pool, const unsigned int threadCount)
+{
+	pool->threadCount = threadCount;
+	pool->threads = new HANDLE[threadCount];
+	pool->workers = new PoolWorker[threadCount];
+
+	pool->job = NULL;
+	pool->data = NULL;
+
+	InitializeCriticalSection(&pool->lock);
+	InitializeConditionVariable(&pool->jobReady);
+	InitializeConditionVariable(&pool->jobDone);
+	pool->jobNumber = 0;
+	pool->busyCount = 0;
+	pool->quit = false;
+
+	for (unsigned int i = 0; i < threadCount; ++i)
+	{
+		pool->workers[i] = { pool, i };
+		pool->threads[i] = CreateThread(NULL, 0, poolWorkerThread, (LPVOID)&pool->workers[i], 0, NULL);
+	}
+}
+
+// run a job on all of the workers and wait for them to finish it
+void runThreadPool(ThreadPool* pool, ThreadJob job, void* data)
+{
+	EnterCriticalSection(&pool->lock);
+	pool->job = job;
+	pool->data = data;
+	pool->busyCount = pool->threadCount;
+	++pool->jobNumber;
+	LeaveCriticalSection(&pool->lock);
+	WakeAllConditionVariable(&pool->jobReady);
+
+	EnterCriticalSection(&pool->lock);
+	while (pool->busyCount > 0)
+	{
+		SleepConditionVariableCS(&pool->jobDone, &pool->lock, INFINITE);
+	}
+	LeaveCriticalSection(&pool->lock);
+}
+
+// stop the workers and free everything
+void freeThreadPool(ThreadPool* pool)
+{
+	EnterCriticalSection(&pool->lock);
+	pool->quit = true;
+	LeaveCriticalSection(&pool->lock);
+	WakeAllConditionVariable(&pool->jobReady);
+
+	// wait until all the threads are done
+	if (pool->threadCount <= 64)
+	{
+		WaitForMultipleObjects(pool->threadCount, pool->threads, TRUE, INFINITE);
+	}
+	else
+	{
+		for (unsigned int i = 0; i < pool->threadCount; i++) {
+			WaitForSingleObject(pool->threads[i], INFINITE);
+		}
+	}
+
+	for (unsigned int i = 0; i < pool->threadCount; ++i)
+	{
+		CloseHandle(pool->threads[i]);
+	}
+	DeleteCriticalSection(&pool->lock);
+
+	delete[] pool->workers;
+	delete[] pool->threads;
+}
@@ -0,0 +1,206 @@
+// tonemapping
+
+#include <windows.h>
+#include <malloc.h>
+#include <string.h>
+#include <stdio.h>
+#include <ctype.h>
+#include <cmath>
+#include "Tonemap.h"
+#include "MathSIMD.h"
+#include "Cpu.h"
+
+
+void initHDRFrame(HDRFrame* frame, const int width, const int height)
+{
+	frame->width = width;
+	frame->height = height;
+	frame->exposure = NAN;
+	frame->reds = (float*)_aligned_malloc(sizeof(float) * (width * height + 8), 64);
+	frame->greens = (float*)_aligned_malloc(sizeof(float) * (width * height + 8), 64);
+	frame->blues = (float*)_aligned_malloc(sizeof(float) * (width * height + 8), 64);
+
+	// start black, so nothing that tonemaps or saves the frame can see uninitialised memory
+	memset(frame->reds, 0, sizeof(float) * (width * height + 8));
+	memset(frame->greens, 0, sizeof(float) * (width * height + 8));
+	memset(frame->blues, 0, sizeof(float) * (width * height + 8));
+}
+
+void freeHDRFrame(HDRFrame* frame)
+{
+	_aligned_free(frame->reds);
+	_aligned_free(frame->greens);
+	_aligned_free(frame->blues);
+}
+
+
+// 8 channel values (times the exposure) to bytes in [0, 255]
+static __forceinline __m256i tonemapChannel(const __m256 exposed)
+{
+	const __m256 exps = mathAccuracy == MATH_FAST ? fastExp(SimdFloat<8>{ exposed }).v : simdExp2(exposed * _mm256_set1_ps(1.44269504f));
+	const __m256 clamped = _mm256_min_ps(_mm256_max_ps(_mm256_set1_ps(1.0f) - exps, _mm256_setzero_ps()), _mm256_set1_ps(1.0f));
+
+	return _mm256_cvttps_epi32(clamped * _mm256_set1_ps(255.0f));
+}
+
+// turn count colours into pixels (in 0x00BBGGRR format)
+void tonemap(const float* reds, const float* greens, const float* blues, const unsigned int count, const float exposure, const unsigned int colourMask, unsigned int* pixels)
+{
+	if (instructionSet < ISA_AVX2)
+	{
+		for (unsigned int i = 0; i < count; ++i)
+		{
+			Colour colour(reds[i], greens[i], blues[i]);
+			colour.colourise(colourMask);
+			pixels[i] = colour.convertToPixel(exposure);
+		}
+		return;
+	}
+
+	// (colourised the same way as Colour::colourise())
+	const __m256 exposures = _mm256_set1_ps(exposure);
+	const __m256 redScales = _mm256_set1_ps((colourMask & 4) ? 1.5f : 0.75f);
+	const __m256 greenScales = _mm256_set1_ps((colourMask & 2) ? 1.5f : 0.75f);
+	const __m256 blueScales = _mm256_set1_ps((colourMask & 1) ? 1.5f : 0.75f);
+
+	for (unsigned int i = 0; i < count; i += 8)
+	{
+		__m256i rs = tonemapChannel(_mm256_loadu_ps(reds + i) * redScales * exposures);
+		__m256i gs = tonemapChannel(_mm256_loadu_ps(greens + i) * greenScales * exposures);
+		__m256i bs = tonemapChannel(_mm256_loadu_ps(blues + i) * blueScales * exposures);
+		__m256i packed = _mm256_or_si256(_mm256_or_si256(rs, _mm256_slli_epi32(gs, 8)), _mm256_slli_epi32(bs, 16));
+
+		// the last (partial) lot of 8 only stores what's needed
+		if (i + 8 <= count)
+		{
+			_mm256_storeu_si256((__m256i*)(pixels + i), packed);
+		}
+		else
+		{
+			unsigned int last[8];
+			_mm256_storeu_si256((__m256i*)last, packed);
+			memcpy(pixels + i, last, sizeof(unsigned int) * (count - i));
+		}
+	}
+}
+
+// tonemap the first width x height pixels of a tile into an image
+void tonemapTile(const HDRTile* tile, const int width, const int height, const float exposure, const unsigned int colourMask, unsigned int* out, const unsigned int outStride)
+{
+	for (int y = 0; y < height; ++y)
+	{
+		const unsigned int line = y * tile->stride;
+		tonemap(tile->reds + line, tile->greens + line, tile->blues + line, width, exposure, colourMask, out + y * outStride);
+	}
+}
+
+// tonemap blocks of the frame into an image, claiming them one at a time
+void tonemapBlocks(const HDRFrame* frame, const float exposure, const int blockSize, const unsigned char* colourMasks, unsigned int* nextBlockShared, unsigned int* out)
+{
+	const unsigned int blocksWide = (frame->width - 1) / blockSize + 1;
+	const unsigned int blocksHigh = (frame->height - 1) / blockSize + 1;
+
+	unsigned int block;
+	while ((block = InterlockedIncrement(nextBlockShared)) < blocksWide * blocksHigh)
+	{
+		const int x = (block % blocksWide) * blockSize, y = (block / blocksWide) * blockSize;
+		const HDRTile tile = frameTile(frame, x, y);
+
+		tonemapTile(&tile, (std::min)(blockSize, frame->width - x), (std::min)(blockSize, frame->height - y), exposure, colourMasks[block],
+			out + y * frame->width + x, frame->width);
+	}
+}
+
+
+// ---- PFM files ----
+
+// save the frame as a little endian PFM file
+bool saveHDRFrame(const char* filename, const HDRFrame* frame)
+{
+	FILE* file = fopen(filename, "wb");
+	if (file == NULL) return false;
+
+	// a negative scale means little endian
+	fprintf(file, "PF\n");
+	if (!std::isnan(frame->exposure)) fprintf(file, "# exposure %g\n", frame->exposure);
+	fprintf(file, "%d %d\n-1.0\n", frame->width, frame->height);
+
+	// the pixels are interleaved (one line at a time)
+	float* line = new float[frame->width * 3];
+	bool written = true;
+	for (int y = 0; y < frame->height && written; ++y)
+	{
+		for (int x = 0; x < frame->width; ++x)
+		{
+			const unsigned int i = y * frame->width + x;
+			line[x * 3 + 0] = frame->reds[i];
+			line[x * 3 + 1] = frame->greens[i];
+			line[x * 3 + 2] = frame->blues[i];
+		}
+		written = fwrite(line, sizeof(float) * 3, frame->width, file) == (size_t)frame->width;
+	}
+
+	delete[] line;
+	fclose(file);
+	return written;
+}
+
+// skip whitespace and "#" comment lines (picking up the exposure if one of them has it)
+static void skipComments(FILE* file, float* exposure)
+{
+	int c;
+	while ((c = fgetc(file)) != EOF)
+	{
+		if (c == '#')
+		{
+			char line[256];
+			if (fgets(line, sizeof(line), file) != NULL) sscanf(line, " exposure %f", exposure);
+		}
+		else if (!isspace(c))
+		{
+			ungetc(c, file);
+			return;
+		}
+	}
+}
+
+// load a colour PFM file, making space for it
+bool loadHDRFrame(const char* filename, HDRFrame* frame)
+{
+	FILE* file = fopen(filename, "rb");
+	if (file == NULL) return false;
+
+	// header, then exactly one whitespace character before the pixels (only little endian files are supported)
+	char type[3] = { 0 };
+	int width = 0, height = 0;
+	float scale = 0.0f, exposure = NAN;
+	bool header = fscanf(file, "%2s", type) == 1 && strcmp(type, "PF") == 0;
+	if (header) skipComments(file, &exposure);
+	if (!header || fscanf(file, "%d %d %f", &width, &height, &scale) != 3 || width <= 0 || height <= 0 || scale >= 0.0f || fgetc(file) == EOF)
+	{
+		fclose(file);
+		return false;
+	}
+
+	initHDRFrame(frame, width, height);
+	frame->exposure = exposure;
+
+	float* line = new float[width * 3];
+	bool read = true;
+	for (int y = 0; y < height && read; ++y)
+	{
+		read = fread(line, sizeof(float) * 3, width, file) == (size_t)width;
+		for (int x = 0; x < width && read; ++x)
+		{
+			const unsigned int i = y * width + x;
+			frame->reds[i] = line[x * 3 + 0];
+			frame->greens[i] = line[x * 3 + 1];
+			frame->blues[i] = line[x * 3 + 2];
+		}
+	}
+
+	delete[] line;
+	fclose(file);
+	if (!read) freeHDRFrame(frame);
+	return read;
+}
@@ -0,0 +1,68 @@
+// tonemapping (turning the linear colours that rendering adds up into pixels, with respect to an exposure level)
+// rendering stores each pixel's colour in a float frame (before colourising), and once every block has been traced the frame is tonemapped
+// 8 pixels at a time in a separate pass (shared between all of the threads, a block at a time), so there's no exponential in the tracing loops
+// the frame is kept, so it can be saved (as a PFM file) and tonemapped again later with a different exposure without tracing anything
+
+#ifndef __TONEMAP_H
+#define __TONEMAP_H
+
+#include "Colour.h"
+
+// the linear colours of the whole image (SoA, one line of the image after another, bottom line first)
+typedef struct HDRFrame
+{
+	float* reds, *greens, *blues;		// (with space for 8 more floats on the end, so the last line can be read in whole lots of 8)
+	int width, height;
+	float exposure;						// the exposure it was rendered with (NAN if it isn't known)
+} HDRFrame;
+
+// the colours of a block (the part of the frame it covers)
+typedef struct HDRTile
+{
+	float* reds, *greens, *blues;
+	unsigned int stride;				// floats from the start of one line to the next (the frame's width)
+} HDRTile;
+
+void initHDRFrame(HDRFrame* frame, const int width, const int height);
+
+void freeHDRFrame(HDRFrame* frame);
+
+// the tile of the frame starting at pixel (x, y) (counting from the bottom left of the image)
+inline HDRTile frameTile(const HDRFrame* frame, const int x, const int y)
+{
+	const unsigned int start = y * frame->width + x;
+	HDRTile tile = { frame->reds + start, frame->greens + start, frame->blues + start, (unsigned int)frame->width };
+	return tile;
+}
+
+// store the colour of the pixel at (x, y) (relative to the start of the tile)
+inline void setTileColour(HDRTile* tile, const int x, const int y, const Colour& colour)
+{
+	const unsigned int i = y * tile->stride + x;
+	tile->reds[i] = colour.red;
+	tile->greens[i] = colour.green;
+	tile->blues[i] = colour.blue;
+}
+
+// turn count colours into pixels (in 0x00BBGGRR format), i.e. colourise them with colourMask (see Colour::colourise()),
+// then 1 - e^(colour * exposure), clamped to [0, 1] and scaled to [0, 255]
+// 8 at a time with AVX2 (with the maths library accurate exponential from PrimitivesSIMD.h, or fastExp() with -fastMath),
+// otherwise one at a time with Colour::convertToPixel()
+// the colour arrays are read in whole lots of 8, so must have space for count rounded up to 8
+void tonemap(const float* reds, const float* greens, const float* blues, const unsigned int count, const float exposure, const unsigned int colourMask, unsigned int* pixels);
+
+// tonemap the first width x height pixels of a tile into an image (with outStride pixels from one line of it to the next)
+void tonemapTile(const HDRTile* tile, const int width, const int height, const float exposure, const unsigned int colourMask, unsigned int* out, const unsigned int outStride);
+
+// tonemap blocks of the frame into an image (of the same size), claiming them one at a time from nextBlockShared
+// (one less than the next block to tonemap, so any number of threads can share the work), with block i colourised with colourMasks[i]
+void tonemapBlocks(const HDRFrame* frame, const float exposure, const int blockSize, const unsigned char* colourMasks, unsigned int* nextBlockShared, unsigned int* out);
+
+// save the frame as a little endian PFM file (3 floats per pixel, bottom line first)
+// with its exposure in a "# exposure" comment line after the "PF" line (when it's known)
+bool saveHDRFrame(const char* filename, const HDRFrame* frame);
+
+// load a frame saved by saveHDRFrame() (or any other colour PFM file, which won't have an exposure), making space for it
+bool loadHDRFrame(const char* filename, HDRFrame* frame);
+
+#endif // __TONEMAP_H